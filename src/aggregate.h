@@ -0,0 +1,186 @@
+// Block aggregation of rasters (replacement for raster::aggregate).
+//
+// Every fact x fact block of cells, anchored at the top left corner, is
+// reduced to one cell of the coarse grid; blocks at the right and bottom
+// edge reduce the cells they cover (expand=TRUE) and NaN cells are skipped
+// (na.rm=TRUE). A block is read row segment by row segment, so each cell
+// of the input is touched once and a band of fact rows stays in cache
+// while its blocks are reduced. Sums are accumulated in double as by R.
+//
+// The segment sums and maxima run in an AVX2 kernel when the CPU has
+// one; the scalar loops are the reference.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#ifndef TCH_HAVE_AVX2_KERNEL
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#endif
+
+#include "grid.h"
+#include "mosaic.h"
+#include "rasterize.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+namespace detail {
+
+struct SegmentStats {
+  double sum = 0;
+  float max = -std::numeric_limits<float>::infinity();
+  std::size_t cnt = 0;
+};
+
+inline void segment_stats_scalar(const float* v, std::size_t n, SegmentStats& s) {
+  for (std::size_t i = 0; i < n; ++i)
+    if (!std::isnan(v[i])) {
+      s.sum += v[i];
+      s.max = std::max(s.max, v[i]);
+      ++s.cnt;
+    }
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+__attribute__((target("avx2"))) inline void segment_stats_avx2(const float* v, std::size_t n,
+                                                              SegmentStats& s) {
+  __m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+  __m256 mx = _mm256_set1_ps(s.max);
+  std::size_t cnt = 0, i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(v + i);
+    __m256 ok = _mm256_cmp_ps(x, x, _CMP_ORD_Q);
+    __m256 xz = _mm256_and_ps(x, ok); // NaN -> 0
+    sum_lo = _mm256_add_pd(sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(xz)));
+    sum_hi = _mm256_add_pd(sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(xz, 1)));
+    mx = _mm256_max_ps(x, mx); // the second operand wins when x is NaN
+    cnt += std::size_t(__builtin_popcount(unsigned(_mm256_movemask_ps(ok))));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(sum_lo, sum_hi));
+  float mlanes[8];
+  _mm256_storeu_ps(mlanes, mx);
+  s.sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (float m : mlanes) s.max = std::max(s.max, m);
+  s.cnt += cnt;
+  segment_stats_scalar(v + i, n - i, s);
+}
+#endif
+
+} // namespace detail
+
+// Reduce block (row, col) of fact x fact cells. scratch holds fact * fact
+// floats and is only used by the percentile reducer.
+inline float block_reduce(const Grid<float>& g, int fact, int row, int col, Reducer reducer,
+                          double prob, float* scratch) {
+  const GridSpec& s = g.spec;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  int r0 = row * fact, r1 = std::min(s.nrow, r0 + fact);
+  int c0 = col * fact, c1 = std::min(s.ncol, c0 + fact);
+  std::size_t width = std::size_t(c1 - c0);
+  if (reducer == Reducer::Percentile) {
+    float* end = scratch;
+    for (int r = r0; r < r1; ++r) {
+      const float* v = &g.at(r, c0);
+      for (std::size_t c = 0; c < width; ++c)
+        if (!std::isnan(v[c])) *end++ = v[c];
+    }
+    return end == scratch ? nan : float(quantile_type7(scratch, end, prob));
+  }
+#ifdef TCH_HAVE_AVX2_KERNEL
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+  detail::SegmentStats st;
+  for (int r = r0; r < r1; ++r) {
+#ifdef TCH_HAVE_AVX2_KERNEL
+    if (avx2) {
+      detail::segment_stats_avx2(&g.at(r, c0), width, st);
+      continue;
+    }
+#endif
+    detail::segment_stats_scalar(&g.at(r, c0), width, st);
+  }
+  if (st.cnt == 0) return nan;
+  switch (reducer) {
+  case Reducer::Max: return st.max;
+  case Reducer::Sum: return float(st.sum);
+  default: return float(st.sum / double(st.cnt));
+  }
+}
+
+// Aggregate g by fact (raster::aggregate(g, fact, fun, expand=TRUE,
+// na.rm=TRUE)); rows of blocks are reduced in parallel.
+inline Grid<float> aggregate(const Grid<float>& g, int fact, Reducer reducer, double prob,
+                             ThreadPool& pool) {
+  if (reducer == Reducer::Percentile && !(prob >= 0 && prob <= 1))
+    throw std::invalid_argument("prob must be in [0, 1]");
+  Grid<float> out(detail::block_layout(g.spec, fact), std::numeric_limits<float>::quiet_NaN());
+  const GridSpec& cs = out.spec;
+  parallel_for(pool, std::size_t(cs.nrow), 1, [&](std::size_t b, std::size_t e) {
+    std::vector<float> scratch(reducer == Reducer::Percentile ? std::size_t(fact) * fact : 0);
+    for (std::size_t r = b; r < e; ++r)
+      for (int c = 0; c < cs.ncol; ++c)
+        out.at(int(r), c) = block_reduce(g, fact, int(r), c, reducer, prob, scratch.data());
+  });
+  return out;
+}
+
+// Aggregate a mosaic in one pass over its blocks: block rows are read in
+// order into a band of cell rows, and every row of coarse cells is reduced
+// as soon as the band holds all of its input rows.
+inline Grid<float> aggregate(const Mosaic& m, int fact, Reducer reducer, double prob,
+                             ThreadPool& pool) {
+  if (reducer == Reducer::Percentile && !(prob >= 0 && prob <= 1))
+    throw std::invalid_argument("prob must be in [0, 1]");
+  const GridSpec& s = m.spec();
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  Grid<float> out(detail::block_layout(s, fact), nan);
+  const int bs = Mosaic::kBlock;
+  Grid<float> band; // input rows [band_row0, band_row0 + band.spec.nrow)
+  band.spec = s;
+  band.spec.nrow = 0;
+  int band_row0 = 0, next_out = 0;
+  std::vector<float> block(std::size_t(bs) * bs);
+  for (int by = 0; by < m.nblocks_y(); ++by) {
+    int rows = std::min(bs, s.nrow - by * bs);
+    std::size_t at = band.values.size();
+    band.values.resize(at + std::size_t(rows) * s.ncol);
+    band.spec.nrow += rows;
+    for (int bx = 0; bx < m.nblocks_x(); ++bx) {
+      m.read_block(by, bx, block.data());
+      int cols = std::min(bs, s.ncol - bx * bs);
+      for (int r = 0; r < rows; ++r)
+        std::copy(&block[std::size_t(r) * bs], &block[std::size_t(r) * bs] + cols,
+                  &band.values[at + std::size_t(r) * s.ncol + std::size_t(bx) * bs]);
+    }
+    // coarse rows whose fact input rows (fewer at the bottom) are loaded
+    int ready = by + 1 == m.nblocks_y() ? out.spec.nrow : (band_row0 + band.spec.nrow) / fact;
+    int nready = ready - next_out;
+    if (nready <= 0) continue;
+    parallel_for(pool, std::size_t(nready), 1, [&](std::size_t b, std::size_t e) {
+      std::vector<float> scratch(reducer == Reducer::Percentile ? std::size_t(fact) * fact : 0);
+      for (std::size_t j = b; j < e; ++j)
+        for (int c = 0; c < out.spec.ncol; ++c)
+          out.at(next_out + int(j), c) =
+              block_reduce(band, fact, int(j), c, reducer, prob, scratch.data());
+    });
+    // drop the consumed rows; the band starts at a multiple of fact again
+    int used = std::min(band.spec.nrow, nready * fact);
+    band.values.erase(band.values.begin(), band.values.begin() + std::size_t(used) * s.ncol);
+    band.spec.nrow -= used;
+    band_row0 += used;
+    next_out = ready;
+  }
+  return out;
+}
+
+} // namespace tch
@@ -0,0 +1,203 @@
+// Support for the per-stage benchmarks of R/bench.R.
+//
+// Process memory probes (resident set size, its peak and a reset of the
+// peak, so every stage gets its own high-water mark) and a synthetic ALS
+// tile: a sloped, undulating terrain with flat-roofed buildings and
+// conical tree crowns, generated from a seed with splitmix64 only, so the
+// same seed gives the same points on every platform and compiler.
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace tch {
+
+// resident set size in bytes, 0 where it is not known
+inline std::size_t current_rss_bytes() {
+#if defined(__linux__)
+  std::FILE* f = std::fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  unsigned long long pages = 0, resident = 0;
+  int got = std::fscanf(f, "%llu %llu", &pages, &resident);
+  std::fclose(f);
+  return got == 2 ? std::size_t(resident) * std::size_t(sysconf(_SC_PAGESIZE)) : 0;
+#else
+  return 0;
+#endif
+}
+
+// peak resident set size in bytes since the start of the process or the
+// last reset_peak_rss(), 0 where it is not known
+inline std::size_t peak_rss_bytes() {
+#if defined(__linux__)
+  // VmHWM follows reset_peak_rss(), getrusage() does not
+  if (std::FILE* f = std::fopen("/proc/self/status", "r")) {
+    char line[256];
+    unsigned long long kb = 0;
+    bool found = false;
+    while (std::fgets(line, sizeof line, f))
+      if (std::strncmp(line, "VmHWM:", 6) == 0) {
+        found = std::sscanf(line + 6, "%llu", &kb) == 1;
+        break;
+      }
+    std::fclose(f);
+    if (found) return std::size_t(kb) * 1024;
+  }
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#if defined(__APPLE__)
+  return std::size_t(ru.ru_maxrss); // bytes on macOS
+#else
+  return std::size_t(ru.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+// reset the peak to the current resident set size (Linux 4.0 and later);
+// false if the peak can only grow over the life of the process
+inline bool reset_peak_rss() {
+#if defined(__linux__)
+  std::FILE* f = std::fopen("/proc/self/clear_refs", "w");
+  if (!f) return false;
+  bool ok = std::fputs("5", f) >= 0;
+  return std::fclose(f) == 0 && ok;
+#else
+  return false;
+#endif
+}
+
+struct SyntheticTile {
+  std::vector<double> x, y, z;
+  std::vector<std::int32_t> return_number, number_of_returns;
+  std::size_t size() const { return x.size(); }
+};
+
+namespace detail {
+
+class SplitMix64 {
+public:
+  explicit SplitMix64(std::uint64_t seed) : s_(seed) {}
+  std::uint64_t next() {
+    std::uint64_t z = (s_ += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  // uniform on [0, 1)
+  double uniform() { return double(next() >> 11) * 0x1.0p-53; }
+  double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+
+private:
+  std::uint64_t s_;
+};
+
+inline double synthetic_terrain(double x, double y) {
+  return 50 + 0.02 * x - 0.01 * y + 3 * std::sin(x / 40) * std::cos(y / 55);
+}
+
+} // namespace detail
+
+// npoints points on a size x size tile with its corner at (0, 0): about a
+// tenth of the area is covered by buildings, half by trees; canopy
+// returns get 1 to 3 returns with the last one on the ground
+inline SyntheticTile synthetic_tile(std::size_t npoints, double size, std::uint64_t seed) {
+  detail::SplitMix64 rng(seed);
+  struct Box { double x0, y0, x1, y1, h; };
+  struct Crown { double x, y, r, h; };
+  std::vector<Box> boxes;
+  double built = 0;
+  while (built < 0.1 * size * size) {
+    double w = rng.uniform(10, 40), d = rng.uniform(10, 25);
+    double x0 = rng.uniform(0, size - w), y0 = rng.uniform(0, size - d);
+    boxes.push_back({x0, y0, x0 + w, y0 + d, rng.uniform(4, 15)});
+    built += w * d;
+  }
+  // the boxes overlapping every bucket x bucket m square
+  const double bucket = 25;
+  int nb = int(size / bucket) + 1;
+  std::vector<std::vector<std::uint32_t>> boxes_in(std::size_t(nb) * nb);
+  for (std::size_t k = 0; k < boxes.size(); ++k)
+    for (int r = int(boxes[k].y0 / bucket); r <= int(boxes[k].y1 / bucket) && r < nb; ++r)
+      for (int c = int(boxes[k].x0 / bucket); c <= int(boxes[k].x1 / bucket) && c < nb; ++c)
+        boxes_in[std::size_t(r) * nb + c].push_back(std::uint32_t(k));
+  // crowns on a jittered grid, one per 7 x 7 m in the forested half
+  std::vector<Crown> crowns;
+  const double cell = 7;
+  int ncell = int(size / cell);
+  std::vector<std::int32_t> crown_of(std::size_t(ncell) * ncell, -1);
+  for (int r = 0; r < ncell; ++r)
+    for (int c = 0; c < ncell; ++c) {
+      double cx = (c + rng.uniform()) * cell, cy = (r + rng.uniform()) * cell;
+      if (std::sin(cx / 90) + std::cos(cy / 70) < 0) continue;
+      crown_of[std::size_t(r) * ncell + c] = std::int32_t(crowns.size());
+      crowns.push_back({cx, cy, rng.uniform(2.5, 5), rng.uniform(15, 35)});
+    }
+
+  SyntheticTile t;
+  t.x.reserve(npoints);
+  t.y.reserve(npoints);
+  t.z.reserve(npoints);
+  t.return_number.reserve(npoints);
+  t.number_of_returns.reserve(npoints);
+  auto push = [&](double x, double y, double z, int rn, int nr) {
+    t.x.push_back(x);
+    t.y.push_back(y);
+    t.z.push_back(z);
+    t.return_number.push_back(rn);
+    t.number_of_returns.push_back(nr);
+  };
+  while (t.size() < npoints) {
+    double x = rng.uniform(0, size), y = rng.uniform(0, size);
+    double ground = detail::synthetic_terrain(x, y) + rng.uniform(-0.05, 0.05);
+    const Box* roof = nullptr;
+    for (std::uint32_t k : boxes_in[std::size_t(int(y / bucket)) * nb + std::size_t(int(x / bucket))]) {
+      const Box& b = boxes[k];
+      if (x >= b.x0 && x < b.x1 && y >= b.y0 && y < b.y1) {
+        roof = &b;
+        break;
+      }
+    }
+    if (roof) {
+      push(x, y, detail::synthetic_terrain(roof->x0, roof->y0) + roof->h + rng.uniform(-0.02, 0.02), 1, 1);
+      continue;
+    }
+    // the highest crown over (x, y) among the neighbouring grid cells
+    double canopy = -1;
+    int c0 = int(x / cell), r0 = int(y / cell);
+    for (int r = r0 - 1; r <= r0 + 1; ++r)
+      for (int c = c0 - 1; c <= c0 + 1; ++c) {
+        if (r < 0 || c < 0 || r >= ncell || c >= ncell) continue;
+        std::int32_t k = crown_of[std::size_t(r) * ncell + c];
+        if (k < 0) continue;
+        const Crown& cr = crowns[std::size_t(k)];
+        double d = std::hypot(x - cr.x, y - cr.y);
+        if (d < cr.r) canopy = std::fmax(canopy, cr.h * (1 - 0.6 * d / cr.r));
+      }
+    if (canopy < 0) {
+      push(x, y, ground, 1, 1);
+      continue;
+    }
+    int nr = 1 + int(rng.uniform() * 3);
+    double top = canopy * rng.uniform(0.85, 1);
+    for (int rn = 1; rn <= nr && t.size() < npoints; ++rn) {
+      double h = rn == nr && nr > 1 ? 0 : top * (1 - 0.4 * (rn - 1) * rng.uniform());
+      push(x, y, h == 0 ? ground : ground + h, rn, nr);
+    }
+  }
+  return t;
+}
+
+} // namespace tch
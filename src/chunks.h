@@ -0,0 +1,182 @@
+// Buffered chunk layout and chunk scheduler for tile processing.
+//
+// A tile is split into square chunks. Every point belongs to the core of
+// exactly one chunk and, if it lies within `buffer` of a neighbouring
+// chunk, to that chunk's buffer as well. A stage processes a chunk with its
+// buffer points as context but only writes results for the core points,
+// so merging the chunks back into the tile drops the buffer for free and
+// no two chunks ever write the same point.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "grid.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct Chunk {
+  int id = 0;
+  double xmin = 0, ymin = 0, xmax = 0, ymax = 0; // core extent
+  std::size_t begin = 0, ncore = 0, nbuffer = 0; // slice of ChunkPlan::members
+
+  std::size_t size() const { return ncore + nbuffer; }
+};
+
+struct ChunkPlan {
+  GridSpec layout; // one layout cell per chunk
+  double buffer = 0;
+  std::vector<Chunk> chunks;
+  // point indices of every chunk, core points first then buffer points
+  std::vector<std::uint32_t> members;
+
+  const std::uint32_t* indices(const Chunk& c) const { return members.data() + c.begin; }
+};
+
+namespace detail {
+
+inline void init_chunks(ChunkPlan& plan) {
+  const GridSpec& g = plan.layout;
+  plan.chunks.resize(g.size());
+  for (int r = 0; r < g.nrow; ++r)
+    for (int c = 0; c < g.ncol; ++c) {
+      Chunk& ch = plan.chunks[std::size_t(r) * g.ncol + c];
+      ch = Chunk(); // counts of a reused plan start over
+      ch.id = r * g.ncol + c;
+      ch.xmin = g.xmin + c * g.res;
+      ch.xmax = ch.xmin + g.res;
+      ch.ymax = g.ymax() - r * g.res;
+      ch.ymin = ch.ymax - g.res;
+    }
+}
+
+// turn per-chunk counts into offsets into plan.members
+inline void layout_members(ChunkPlan& plan) {
+  std::size_t off = 0;
+  for (Chunk& ch : plan.chunks) {
+    ch.begin = off;
+    off += ch.ncore + ch.nbuffer;
+  }
+  plan.members.resize(off);
+}
+
+} // namespace detail
+
+// Plan chunks of `size` map units (snapped to multiples of size) over the
+// points, each with a `buffer` map units wide overlap, into plan (whose
+// vectors are reused) with fill as scratch. x and y may be quantized
+// columns.
+template <class X, class Y>
+void plan_chunks_into(ChunkPlan& plan, X x, Y y, std::size_t n, double size, double buffer,
+                      std::vector<std::size_t>& fill) {
+  if (!(size > 0)) throw std::invalid_argument("chunk size must be positive");
+  if (!(buffer >= 0)) throw std::invalid_argument("chunk buffer must be >= 0");
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points for one tile");
+  plan.layout = grid_spec_covering(x, y, n, size);
+  plan.buffer = buffer;
+  detail::init_chunks(plan);
+  const GridSpec& g = plan.layout;
+
+  // visit(i, chunk, is_core) for every chunk point i belongs to
+  auto for_each_chunk = [&](std::size_t i, auto&& visit) {
+    if (std::isnan(x[i]) || std::isnan(y[i])) return;
+    int cc = g.col_of(x[i]), cr = g.row_of(y[i]);
+    visit(std::size_t(cr) * g.ncol + cc, true);
+    if (buffer == 0) return;
+    int c0 = g.col_of(x[i] - buffer), c1 = g.col_of(x[i] + buffer);
+    int r0 = g.row_of(y[i] + buffer), r1 = g.row_of(y[i] - buffer);
+    for (int r = r0; r <= r1; ++r)
+      for (int c = c0; c <= c1; ++c)
+        if (r != cr || c != cc) visit(std::size_t(r) * g.ncol + c, false);
+  };
+
+  for (std::size_t i = 0; i < n; ++i)
+    for_each_chunk(i, [&](std::size_t k, bool core) {
+      ++(core ? plan.chunks[k].ncore : plan.chunks[k].nbuffer);
+    });
+  detail::layout_members(plan);
+
+  // core fill positions first, buffer fill positions after them
+  const std::size_t nc = plan.chunks.size();
+  fill.resize(2 * nc);
+  for (std::size_t k = 0; k < nc; ++k) {
+    fill[k] = plan.chunks[k].begin;
+    fill[nc + k] = plan.chunks[k].begin + plan.chunks[k].ncore;
+  }
+  for (std::size_t i = 0; i < n; ++i)
+    for_each_chunk(i, [&](std::size_t k, bool core) {
+      plan.members[fill[core ? k : nc + k]++] = std::uint32_t(i);
+    });
+}
+
+inline ChunkPlan plan_chunks(const double* x, const double* y, std::size_t n,
+                             double size, double buffer) {
+  ChunkPlan plan;
+  std::vector<std::size_t> fill;
+  plan_chunks_into(plan, x, y, n, size, buffer, fill);
+  return plan;
+}
+
+// The points as a single unbuffered chunk over their extent, for running
+// the chunked stages on a whole tile
+template <class X, class Y>
+void plan_single_chunk_into(ChunkPlan& plan, X x, Y y, std::size_t n) {
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points for one tile");
+  GridSpec g = grid_spec_covering(x, y, n, 1);
+  plan.layout = g;
+  plan.layout.res = std::max(g.xmax() - g.xmin, g.ymax() - g.ymin);
+  plan.layout.ncol = plan.layout.nrow = 1;
+  plan.buffer = 0;
+  detail::init_chunks(plan);
+  plan.members.clear();
+  for (std::size_t i = 0; i < n; ++i)
+    if (!std::isnan(x[i]) && !std::isnan(y[i])) plan.members.push_back(std::uint32_t(i));
+  plan.chunks[0].ncore = plan.members.size();
+}
+
+// Plan unbuffered chunks from precomputed chunk keys (key < 0 = skip),
+// e.g. raster cells grouped into blocks with exact integer arithmetic.
+inline void plan_chunks_from_keys_into(ChunkPlan& plan, const std::int32_t* key, std::size_t n,
+                                       const GridSpec& layout, std::vector<std::size_t>& fill) {
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points for one tile");
+  plan.layout = layout;
+  plan.buffer = 0;
+  detail::init_chunks(plan);
+  for (std::size_t i = 0; i < n; ++i)
+    if (key[i] >= 0) ++plan.chunks[key[i]].ncore;
+  detail::layout_members(plan);
+  fill.resize(plan.chunks.size());
+  for (std::size_t k = 0; k < plan.chunks.size(); ++k) fill[k] = plan.chunks[k].begin;
+  for (std::size_t i = 0; i < n; ++i)
+    if (key[i] >= 0) plan.members[fill[key[i]]++] = std::uint32_t(i);
+}
+
+inline ChunkPlan plan_chunks_from_keys(const std::int32_t* key, std::size_t n,
+                                       const GridSpec& layout) {
+  ChunkPlan plan;
+  std::vector<std::size_t> fill;
+  plan_chunks_from_keys_into(plan, key, n, layout, fill);
+  return plan;
+}
+
+// Run fn(chunk, indices) for every non-empty chunk on the pool, largest
+// chunks first so the stragglers are the small ones.
+template <class Fn>
+void run_chunks(const ChunkPlan& plan, ThreadPool& pool, Fn fn) {
+  std::vector<const Chunk*> order;
+  for (const Chunk& ch : plan.chunks)
+    if (ch.ncore > 0) order.push_back(&ch);
+  std::sort(order.begin(), order.end(),
+            [](const Chunk* a, const Chunk* b) { return a->size() > b->size(); });
+  for (const Chunk* ch : order)
+    pool.submit([&plan, &fn, ch] { fn(*ch, plan.indices(*ch)); });
+  pool.wait();
+}
+
+} // namespace tch
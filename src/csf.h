@@ -0,0 +1,420 @@
+// Cloth Simulation Filter ground classification (Zhang et al. 2016), the
+// native version of lidR::classify_ground(las, csf()).
+//
+// The point cloud is turned upside down (h = -Z) and a cloth of particles
+// spaced cloth_resolution apart falls onto it under gravity; particles
+// that hit the inverted surface stick, and points close to the settled
+// cloth are ground. Instead of one cloth for the whole tile, the cloth is
+// cut into the chunks of a ChunkPlan: every chunk simulates its own piece
+// (core plus buffer) on the pool and classifies only its core points.
+// Particles sit on a global lattice (multiples of cloth_resolution), so
+// neighbouring pieces agree on where the cloth is. Each piece stops as
+// soon as its largest displacement in a step falls below
+// class_threshold / 100 (RCSF's convergence test), so flat pieces are done
+// after a fraction of `iterations` while steep ones keep going.
+//
+// Particle state is kept as one array per quantity and every update is a
+// branch free loop over rows, with an AVX2 kernel selected at run time.
+// For that the springs are relaxed in sweeps over disjoint particle pairs
+// (even/odd columns, then even/odd rows), not in RCSF's particle by
+// particle order; the settled cloth is the same up to the convergence
+// tolerance.
+// sloop_smooth is not implemented.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "chunks.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#ifndef TCH_HAVE_AVX2_KERNEL
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#endif
+
+namespace tch {
+
+struct CsfParams {
+  double class_threshold = 0.5;
+  double cloth_resolution = 0.5;
+  int rigidness = 1;
+  int iterations = 500; // upper bound, pieces usually converge far earlier
+  double time_step = 0.65;
+  double tile = 100;    // size of the simulated cloth pieces (map units)
+  double buffer = 20;   // overlap simulated around every piece
+};
+
+namespace detail {
+
+// CSF's share of a spring's length that one particle moves when both ends
+// are movable / only it is movable, by rigidness
+const double kCsfDoubleMove[15] = {0, 0.3, 0.42, 0.468, 0.4872, 0.4949, 0.498, 0.4992,
+                                   0.4997, 0.4999, 0.4999, 0.5, 0.5, 0.5, 0.5};
+const double kCsfSingleMove[15] = {0, 0.3, 0.51, 0.657, 0.7599, 0.83193, 0.88235, 0.91765,
+                                   0.94235, 0.95965, 0.97175, 0.98023, 0.98616, 0.99031, 0.99322};
+
+// One piece of cloth; particle (row, col) sits at lattice position
+// ((col0 + col) * res, (row0 + row) * res), rows counted from south.
+struct Cloth {
+  std::int64_t col0 = 0, row0 = 0;
+  int ncol = 0, nrow = 0;
+  double res = 1;
+  std::vector<double> h, old; // current and previous height
+  std::vector<double> mov;    // 1 while movable, 0 once stuck
+  std::vector<double> ground; // height of the inverted surface below
+  // scratch of cloth_terrain(), kept with the piece so a reused piece
+  // needs no allocations
+  std::vector<double> best, filled;
+  std::vector<std::size_t> queue;
+
+  std::size_t size() const { return h.size(); }
+};
+
+// make cl the cloth over the points idx[0..n) with CSF's margin of 2
+// particles, starting flat at `height`
+inline void reset_cloth(Cloth& cl, const double* x, const double* y, const std::uint32_t* idx,
+                        std::size_t n, double res, double height) {
+  double xmin = std::numeric_limits<double>::infinity(), ymin = xmin;
+  double xmax = -xmin, ymax = -xmin;
+  for (std::size_t j = 0; j < n; ++j) {
+    xmin = std::min(xmin, x[idx[j]]);
+    xmax = std::max(xmax, x[idx[j]]);
+    ymin = std::min(ymin, y[idx[j]]);
+    ymax = std::max(ymax, y[idx[j]]);
+  }
+  cl.res = res;
+  cl.col0 = std::int64_t(std::floor(xmin / res)) - 2;
+  cl.row0 = std::int64_t(std::floor(ymin / res)) - 2;
+  cl.ncol = int(std::int64_t(std::ceil(xmax / res)) + 2 - cl.col0 + 1);
+  cl.nrow = int(std::int64_t(std::ceil(ymax / res)) + 2 - cl.row0 + 1);
+  std::size_t np = std::size_t(cl.ncol) * cl.nrow;
+  cl.h.assign(np, height);
+  cl.old.assign(np, height);
+  cl.mov.assign(np, 1.0);
+  cl.ground.assign(np, std::numeric_limits<double>::quiet_NaN());
+}
+
+// Surface height under every particle: the height of the horizontally
+// closest point among those nearest to it. Particles without a point take
+// the first value found on their row (right, then left) or column (south,
+// then north) like RCSF's findHeightValByScanline, and the rest the value
+// of the closest particle that has one.
+inline void cloth_terrain(Cloth& cl, const double* x, const double* y, const double* h,
+                          const std::uint32_t* idx, std::size_t n) {
+  const int nc = cl.ncol, nr = cl.nrow;
+  std::vector<double>& best = cl.best;
+  best.assign(cl.size(), std::numeric_limits<double>::infinity());
+  std::vector<double>& g = cl.ground;
+  for (std::size_t j = 0; j < n; ++j) {
+    std::uint32_t i = idx[j];
+    double fc = x[i] / cl.res - double(cl.col0), fr = y[i] / cl.res - double(cl.row0);
+    int c = int(fc + 0.5), r = int(fr + 0.5);
+    double d = (fc - c) * (fc - c) + (fr - r) * (fr - r);
+    std::size_t k = std::size_t(r) * nc + c;
+    if (d < best[k]) {
+      best[k] = d;
+      g[k] = h[i];
+    }
+  }
+  std::vector<double>& filled = cl.filled;
+  filled.assign(g.begin(), g.end());
+  bool unresolved = false;
+  for (int r = 0; r < nr; ++r)
+    for (int c = 0; c < nc; ++c) {
+      std::size_t k = std::size_t(r) * nc + c;
+      if (!std::isnan(g[k])) continue;
+      double v = std::numeric_limits<double>::quiet_NaN();
+      for (int cc = c + 1; cc < nc && std::isnan(v); ++cc) v = g[std::size_t(r) * nc + cc];
+      for (int cc = c - 1; cc >= 0 && std::isnan(v); --cc) v = g[std::size_t(r) * nc + cc];
+      for (int rr = r - 1; rr >= 0 && std::isnan(v); --rr) v = g[std::size_t(rr) * nc + c];
+      for (int rr = r + 1; rr < nr && std::isnan(v); ++rr) v = g[std::size_t(rr) * nc + c];
+      filled[k] = v;
+      unresolved |= std::isnan(v);
+    }
+  if (unresolved) {
+    // breadth first from every particle with a value
+    std::vector<std::size_t>& queue = cl.queue;
+    queue.clear();
+    for (std::size_t k = 0; k < filled.size(); ++k)
+      if (!std::isnan(filled[k])) queue.push_back(k);
+    for (std::size_t q = 0; q < queue.size(); ++q) {
+      std::size_t k = queue[q];
+      int r = int(k / nc), c = int(k % nc);
+      const int dr[4] = {0, 0, -1, 1}, dc[4] = {1, -1, 0, 0};
+      for (int d = 0; d < 4; ++d) {
+        int rr = r + dr[d], cc = c + dc[d];
+        if (rr < 0 || rr >= nr || cc < 0 || cc >= nc) continue;
+        std::size_t kk = std::size_t(rr) * nc + cc;
+        if (!std::isnan(filled[kk])) continue;
+        filled[kk] = filled[k];
+        queue.push_back(kk);
+      }
+    }
+  }
+  g.swap(filled);
+}
+
+// constants of one time step
+struct ClothStep {
+  double keep, acc; // 1 - damping, gravity displacement
+  double dm, sm;    // spring moves for two / one movable ends
+};
+
+// move both ends of the spring a-b towards each other
+inline void relax_spring(double& a, double& b, double ma, double mb, const ClothStep& k) {
+  double d = b - a;
+  a += d * ma * (mb * k.dm + (1 - mb) * k.sm);
+  b -= d * mb * (ma * k.dm + (1 - ma) * k.sm);
+}
+
+// The step kernels work on particle ranges [b, e); the scalar ones are
+// the reference and finish the tails of the AVX2 ones.
+inline void cloth_fall_scalar(double* h, double* o, const double* m, std::size_t b,
+                              std::size_t e, const ClothStep& k) {
+  for (std::size_t i = b; i < e; ++i) {
+    double t = h[i];
+    h[i] = t + m[i] * ((t - o[i]) * k.keep + k.acc);
+    o[i] = t;
+  }
+}
+
+// springs between ha[c] and hb[c] (two rows)
+inline void cloth_relax_rows_scalar(double* ha, double* hb, const double* ma, const double* mb,
+                                    std::size_t b, std::size_t e, const ClothStep& k) {
+  for (std::size_t c = b; c < e; ++c) relax_spring(ha[c], hb[c], ma[c], mb[c], k);
+}
+
+// springs between h[c] and h[c + 1] for every second c from b
+inline void cloth_relax_pairs_scalar(double* h, const double* m, std::size_t b, std::size_t nc,
+                                     const ClothStep& k) {
+  for (std::size_t c = b; c + 1 < nc; c += 2) relax_spring(h[c], h[c + 1], m[c], m[c + 1], k);
+}
+
+// largest displacement of the step, then stick particles that went below
+// the surface
+inline double cloth_settle_scalar(double* h, const double* o, double* m, const double* g,
+                                  std::size_t b, std::size_t e) {
+  double max_diff = 0;
+  for (std::size_t i = b; i < e; ++i) {
+    max_diff = std::max(max_diff, std::fabs(h[i] - o[i]));
+    bool below = h[i] < g[i];
+    h[i] = below ? g[i] : h[i];
+    m[i] = below ? 0.0 : m[i];
+  }
+  return max_diff;
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+struct ClothStepAvx2 {
+  __m256d keep, acc, dm, sm, one;
+};
+
+__attribute__((target("avx2,fma"))) inline void
+relax_spring_avx2(__m256d& a, __m256d& b, __m256d ma, __m256d mb, const ClothStepAvx2& k) {
+  __m256d d = _mm256_sub_pd(b, a);
+  __m256d fa = _mm256_mul_pd(ma, _mm256_fmadd_pd(mb, k.dm, _mm256_mul_pd(_mm256_sub_pd(k.one, mb), k.sm)));
+  __m256d fb = _mm256_mul_pd(mb, _mm256_fmadd_pd(ma, k.dm, _mm256_mul_pd(_mm256_sub_pd(k.one, ma), k.sm)));
+  a = _mm256_fmadd_pd(d, fa, a);
+  b = _mm256_fnmadd_pd(d, fb, b);
+}
+
+__attribute__((target("avx2,fma"))) inline double cloth_step_avx2(Cloth& cl, const ClothStep& s) {
+  const ClothStepAvx2 k{_mm256_set1_pd(s.keep), _mm256_set1_pd(s.acc), _mm256_set1_pd(s.dm),
+                        _mm256_set1_pd(s.sm), _mm256_set1_pd(1.0)};
+  const std::size_t np = cl.size(), nc = std::size_t(cl.ncol), nr = std::size_t(cl.nrow);
+  double* h = cl.h.data();
+  double* o = cl.old.data();
+  double* m = cl.mov.data();
+  const double* g = cl.ground.data();
+  std::size_t i = 0;
+  for (; i + 4 <= np; i += 4) {
+    __m256d t = _mm256_loadu_pd(h + i);
+    __m256d v = _mm256_fmadd_pd(_mm256_sub_pd(t, _mm256_loadu_pd(o + i)), k.keep, k.acc);
+    _mm256_storeu_pd(h + i, _mm256_fmadd_pd(_mm256_loadu_pd(m + i), v, t));
+    _mm256_storeu_pd(o + i, t);
+  }
+  cloth_fall_scalar(h, o, m, i, np, s);
+  for (int rep = 0; rep < 2; ++rep) {
+    for (std::size_t r = 0; r < nr; ++r) {
+      double* hr = h + r * nc;
+      const double* mr = m + r * nc;
+      for (std::size_t par = 0; par < 2; ++par) {
+        // 4 springs per 8 particles: split into left and right ends
+        std::size_t c = par;
+        for (; c + 8 <= nc; c += 8) {
+          __m256d h0 = _mm256_loadu_pd(hr + c), h1 = _mm256_loadu_pd(hr + c + 4);
+          __m256d m0 = _mm256_loadu_pd(mr + c), m1 = _mm256_loadu_pd(mr + c + 4);
+          __m256d a = _mm256_unpacklo_pd(h0, h1), b = _mm256_unpackhi_pd(h0, h1);
+          relax_spring_avx2(a, b, _mm256_unpacklo_pd(m0, m1), _mm256_unpackhi_pd(m0, m1), k);
+          _mm256_storeu_pd(hr + c, _mm256_unpacklo_pd(a, b));
+          _mm256_storeu_pd(hr + c + 4, _mm256_unpackhi_pd(a, b));
+        }
+        cloth_relax_pairs_scalar(hr, mr, c, nc, s);
+      }
+    }
+    for (std::size_t par = 0; par < 2; ++par)
+      for (std::size_t r = par; r + 1 < nr; r += 2) {
+        double* ha = h + r * nc;
+        double* hb = ha + nc;
+        const double* ma = m + r * nc;
+        const double* mb = ma + nc;
+        std::size_t c = 0;
+        for (; c + 4 <= nc; c += 4) {
+          __m256d a = _mm256_loadu_pd(ha + c), b = _mm256_loadu_pd(hb + c);
+          relax_spring_avx2(a, b, _mm256_loadu_pd(ma + c), _mm256_loadu_pd(mb + c), k);
+          _mm256_storeu_pd(ha + c, a);
+          _mm256_storeu_pd(hb + c, b);
+        }
+        cloth_relax_rows_scalar(ha, hb, ma, mb, c, nc, s);
+      }
+  }
+  const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFF));
+  __m256d md = _mm256_setzero_pd(), zero = _mm256_setzero_pd();
+  for (i = 0; i + 4 <= np; i += 4) {
+    __m256d hv = _mm256_loadu_pd(h + i), gv = _mm256_loadu_pd(g + i);
+    md = _mm256_max_pd(md, _mm256_and_pd(_mm256_sub_pd(hv, _mm256_loadu_pd(o + i)), abs_mask));
+    __m256d below = _mm256_cmp_pd(hv, gv, _CMP_LT_OQ);
+    _mm256_storeu_pd(h + i, _mm256_blendv_pd(hv, gv, below));
+    _mm256_storeu_pd(m + i, _mm256_blendv_pd(_mm256_loadu_pd(m + i), zero, below));
+  }
+  alignas(32) double lanes[4];
+  _mm256_store_pd(lanes, md);
+  double max_diff = cloth_settle_scalar(h, o, m, g, i, np);
+  for (double v : lanes) max_diff = std::max(max_diff, v);
+  return max_diff;
+}
+#endif
+
+// one time step: fall, relax every spring twice (as RCSF visits it from
+// both of its particles), settle; returns the largest displacement
+inline double cloth_step_scalar(Cloth& cl, const ClothStep& s) {
+  const std::size_t np = cl.size(), nc = std::size_t(cl.ncol), nr = std::size_t(cl.nrow);
+  double* h = cl.h.data();
+  double* m = cl.mov.data();
+  cloth_fall_scalar(h, cl.old.data(), m, 0, np, s);
+  for (int rep = 0; rep < 2; ++rep) {
+    for (std::size_t r = 0; r < nr; ++r)
+      for (std::size_t par = 0; par < 2; ++par)
+        cloth_relax_pairs_scalar(h + r * nc, m + r * nc, par, nc, s);
+    for (std::size_t par = 0; par < 2; ++par)
+      for (std::size_t r = par; r + 1 < nr; r += 2)
+        cloth_relax_rows_scalar(h + r * nc, h + (r + 1) * nc, m + r * nc, m + (r + 1) * nc, 0,
+                                nc, s);
+  }
+  return cloth_settle_scalar(h, cl.old.data(), m, cl.ground.data(), 0, np);
+}
+
+// Let the cloth fall until it converges; returns the number of steps run.
+inline int simulate_cloth(Cloth& cl, const CsfParams& p) {
+  const double dt2 = p.time_step * p.time_step;
+  const int rig = std::min(std::max(p.rigidness, 0), 14);
+  // gravity 0.2, damping 0.01
+  const ClothStep s{1 - 0.01, -0.2 * dt2 * dt2, kCsfDoubleMove[rig], kCsfSingleMove[rig]};
+  const double tol = p.class_threshold / 100;
+#ifdef TCH_HAVE_AVX2_KERNEL
+  const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  for (int it = 1; it <= p.iterations; ++it) {
+#ifdef TCH_HAVE_AVX2_KERNEL
+    double max_diff = avx2 ? cloth_step_avx2(cl, s) : cloth_step_scalar(cl, s);
+#else
+    double max_diff = cloth_step_scalar(cl, s);
+#endif
+    if (max_diff < tol) return it;
+  }
+  return p.iterations;
+}
+
+// bilinear cloth height at (x, y)
+inline double cloth_height(const Cloth& cl, double x, double y) {
+  double fc = x / cl.res - double(cl.col0), fr = y / cl.res - double(cl.row0);
+  int c = int(fc), r = int(fr);
+  double sx = fc - c, sy = fr - r;
+  const double* h0 = &cl.h[std::size_t(r) * cl.ncol + c];
+  const double* h1 = h0 + cl.ncol;
+  return h0[0] * (1 - sx) * (1 - sy) + h0[1] * sx * (1 - sy) + h1[0] * (1 - sx) * sy +
+         h1[1] * sx * sy;
+}
+
+} // namespace detail
+
+// scratch of csf_ground_into(): the inverted points, their chunks, the
+// steps per chunk and one cloth piece per worker
+struct CsfScratch {
+  std::vector<std::uint32_t> sub;
+  std::vector<double> sx, sy, sh;
+  ChunkPlan plan;
+  std::vector<std::size_t> fill;
+  std::vector<int> steps;
+  PerWorker<detail::Cloth> cloths;
+};
+
+// Ground flags (0/1) of the n points into ground. The cloth is dropped on
+// the points with use[i] == 1 (all points when use is null), e.g. the last
+// returns; the other points are never ground. Returns the number of steps
+// every cloth piece ran, by chunk id (0 for empty chunks), held in s,
+// whose buffers are reused from call to call.
+template <class X, class Y>
+const std::vector<int>& csf_ground_into(X x, Y y, const double* z, std::size_t n,
+                                        const std::int32_t* use, const CsfParams& p,
+                                        ThreadPool& pool, std::int32_t* ground, CsfScratch& s) {
+  if (!(p.cloth_resolution > 0)) throw std::invalid_argument("cloth_resolution must be positive");
+  if (!(p.time_step > 0)) throw std::invalid_argument("time_step must be positive");
+  StageTimer timer(TimedStage::Csf);
+  std::fill(ground, ground + n, 0);
+  // the points the cloth is dropped on, upside down
+  s.sub.clear();
+  for (std::size_t i = 0; i < n; ++i)
+    if ((!use || use[i] == 1) && !std::isnan(x[i]) && !std::isnan(y[i]) && !std::isnan(z[i]))
+      s.sub.push_back(std::uint32_t(i));
+  std::size_t m = s.sub.size();
+  s.sx.resize(m);
+  s.sy.resize(m);
+  s.sh.resize(m);
+  double top = -std::numeric_limits<double>::infinity();
+  for (std::size_t j = 0; j < m; ++j) {
+    s.sx[j] = x[s.sub[j]];
+    s.sy[j] = y[s.sub[j]];
+    s.sh[j] = -z[s.sub[j]];
+    top = std::max(top, s.sh[j]);
+  }
+  s.steps.clear();
+  if (m == 0) return s.steps;
+  plan_chunks_into(s.plan, s.sx.data(), s.sy.data(), m, p.tile, p.buffer, s.fill);
+  s.steps.assign(s.plan.chunks.size(), 0);
+  s.cloths.resize(pool);
+  // every piece starts at the same height, just above the whole cloud
+  const double height = top + 0.05;
+  run_chunks(s.plan, pool, [&](const Chunk& ch, const std::uint32_t* idx) {
+    detail::Cloth& cl = s.cloths.local(pool);
+    detail::reset_cloth(cl, s.sx.data(), s.sy.data(), idx, ch.size(), p.cloth_resolution, height);
+    detail::cloth_terrain(cl, s.sx.data(), s.sy.data(), s.sh.data(), idx, ch.size());
+    s.steps[ch.id] = detail::simulate_cloth(cl, p);
+    std::uint64_t found = 0;
+    for (std::size_t j = 0; j < ch.ncore; ++j) {
+      std::uint32_t i = idx[j];
+      double d = detail::cloth_height(cl, s.sx[i], s.sy[i]) - s.sh[i];
+      found += ground[s.sub[i]] = std::fabs(d) < p.class_threshold;
+    }
+    count(Counter::PointsGround, found);
+  });
+  return s.steps;
+}
+
+inline std::vector<int> csf_ground(const double* x, const double* y, const double* z,
+                                   std::size_t n, const std::int32_t* use, const CsfParams& p,
+                                   ThreadPool& pool, std::int32_t* ground) {
+  CsfScratch s;
+  return csf_ground_into(x, y, z, n, use, p, pool, ground, s);
+}
+
+} // namespace tch
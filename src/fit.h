@@ -0,0 +1,192 @@
+// Power law fits y = a * x^b by Levenberg-Marquardt, with bootstrap and
+// cross-validation replicates (the TCH-to-biomass relationship).
+//
+// The least squares problem has two parameters, so every LM step solves
+// the damped 2 x 2 normal equations built from the analytic Jacobian
+//   d/da = x^b, d/db = a * x^b * log(x)
+// in closed form. Replicates are independent fits on resampled or held
+// out observations and run concurrently on the pool; each draws from its
+// own generator seeded with (seed, replicate), so the ensemble does not
+// depend on the number of threads.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace tch {
+
+struct PowerLawFit {
+  double a = 0, b = 0;
+  double rss = 0;
+  int iterations = 0;
+  bool converged = false;
+};
+
+struct LmParams {
+  int max_iter = 100;
+  double tol = 1e-10; // relative RSS decrease (and step) at convergence
+};
+
+namespace detail {
+
+// rss of a * x^b over the observations idx[0..n) (all if idx is null)
+inline double power_law_rss(const double* x, const double* y, const std::uint32_t* idx,
+                            std::size_t n, double a, double b) {
+  double rss = 0;
+  for (std::size_t j = 0; j < n; ++j) {
+    std::size_t i = idx ? idx[j] : j;
+    double r = y[i] - a * std::pow(x[i], b);
+    rss += r * r;
+  }
+  return rss;
+}
+
+} // namespace detail
+
+// Least squares fit of y = a * x^b from (a0, b0). Observations with a NaN
+// or a non-positive x are skipped by the caller (see valid_observations).
+inline PowerLawFit fit_power_law(const double* x, const double* y, const std::uint32_t* idx,
+                                 std::size_t n, double a0, double b0, const LmParams& p = {}) {
+  PowerLawFit f;
+  f.a = a0;
+  f.b = b0;
+  f.rss = detail::power_law_rss(x, y, idx, n, f.a, f.b);
+  double lambda = 1e-3;
+  for (f.iterations = 0; f.iterations < p.max_iter; ++f.iterations) {
+    // J'J and J'r
+    double jaa = 0, jab = 0, jbb = 0, ga = 0, gb = 0;
+    for (std::size_t j = 0; j < n; ++j) {
+      std::size_t i = idx ? idx[j] : j;
+      double lx = std::log(x[i]), xb = std::exp(f.b * lx);
+      double da = xb, db = f.a * xb * lx, r = y[i] - f.a * xb;
+      jaa += da * da;
+      jab += da * db;
+      jbb += db * db;
+      ga += da * r;
+      gb += db * r;
+    }
+    bool improved = false;
+    while (lambda < 1e16) {
+      // Marquardt's scaling: damp the diagonal relative to itself
+      double maa = jaa * (1 + lambda), mbb = jbb * (1 + lambda);
+      double det = maa * mbb - jab * jab;
+      if (!(det > 0)) {
+        lambda *= 10;
+        continue;
+      }
+      double sa = (mbb * ga - jab * gb) / det, sb = (maa * gb - jab * ga) / det;
+      double rss = detail::power_law_rss(x, y, idx, n, f.a + sa, f.b + sb);
+      if (rss <= f.rss) {
+        bool small = f.rss - rss <= p.tol * f.rss &&
+                     std::fabs(sa) <= std::sqrt(p.tol) * (std::fabs(f.a) + p.tol) &&
+                     std::fabs(sb) <= std::sqrt(p.tol) * (std::fabs(f.b) + p.tol);
+        f.a += sa;
+        f.b += sb;
+        f.rss = rss;
+        lambda = std::max(lambda / 10, 1e-12);
+        improved = true;
+        if (small) f.converged = true;
+        break;
+      }
+      lambda *= 10;
+    }
+    // no downhill step is left: the current estimate is the minimum, unless
+    // it is not finite (a NaN or Inf rss fails every comparison above)
+    if (!improved) {
+      f.converged = std::isfinite(f.rss) && std::isfinite(f.a) && std::isfinite(f.b);
+      break;
+    }
+    if (f.converged) break;
+  }
+  return f;
+}
+
+// indices of the observations a power law can be fitted to
+inline std::vector<std::uint32_t> valid_observations(const double* x, const double* y,
+                                                     std::size_t n) {
+  std::vector<std::uint32_t> idx;
+  for (std::size_t i = 0; i < n; ++i)
+    if (x[i] > 0 && std::isfinite(x[i]) && std::isfinite(y[i])) idx.push_back(std::uint32_t(i));
+  return idx;
+}
+
+inline std::mt19937_64 replicate_rng(std::uint64_t seed, std::size_t replicate) {
+  std::seed_seq s{std::uint32_t(seed), std::uint32_t(seed >> 32), std::uint32_t(replicate),
+                  std::uint32_t(std::uint64_t(replicate) >> 32)};
+  return std::mt19937_64(s);
+}
+
+// Case bootstrap: every replicate refits on n observations drawn with
+// replacement, starting from the fit on all of them.
+inline std::vector<PowerLawFit> bootstrap_power_law(const double* x, const double* y,
+                                                    const std::vector<std::uint32_t>& obs,
+                                                    const PowerLawFit& full, std::size_t replicates,
+                                                    std::uint64_t seed, const LmParams& p,
+                                                    ThreadPool& pool) {
+  std::vector<PowerLawFit> out(replicates);
+  parallel_for(pool, replicates, 1, [&](std::size_t b, std::size_t e) {
+    std::vector<std::uint32_t> sample(obs.size());
+    for (std::size_t r = b; r < e; ++r) {
+      std::mt19937_64 rng = replicate_rng(seed, r);
+      std::uniform_int_distribution<std::size_t> pick(0, obs.size() - 1);
+      for (std::uint32_t& s : sample) s = obs[pick(rng)];
+      out[r] = fit_power_law(x, y, sample.data(), sample.size(), full.a, full.b, p);
+    }
+  });
+  return out;
+}
+
+// Repeated k-fold cross-validation: the observations are shuffled into k
+// folds per repeat and every fold is predicted from a fit on the others.
+// pred holds repeats x nobs out-of-fold predictions (in the order of
+// obs), fits repeats x k fits.
+struct CrossValidation {
+  std::vector<double> pred;
+  std::vector<PowerLawFit> fits;
+};
+
+inline CrossValidation cross_validate_power_law(const double* x, const double* y,
+                                                const std::vector<std::uint32_t>& obs,
+                                                const PowerLawFit& full, int k, int repeats,
+                                                std::uint64_t seed, const LmParams& p,
+                                                ThreadPool& pool) {
+  std::size_t n = obs.size();
+  if (k < 2 || std::size_t(k) > n) throw std::invalid_argument("k must be in [2, number of observations]");
+  CrossValidation cv;
+  cv.pred.assign(std::size_t(repeats) * n, std::numeric_limits<double>::quiet_NaN());
+  cv.fits.resize(std::size_t(repeats) * k);
+  // fold of every observation per repeat: a shuffled 0, 1, ..., k-1, 0, ...
+  std::vector<int> fold(std::size_t(repeats) * n);
+  for (int rep = 0; rep < repeats; ++rep) {
+    int* f = &fold[std::size_t(rep) * n];
+    for (std::size_t j = 0; j < n; ++j) f[j] = int(j % std::size_t(k));
+    std::mt19937_64 rng = replicate_rng(seed, std::size_t(rep));
+    std::shuffle(f, f + n, rng);
+  }
+  parallel_for(pool, cv.fits.size(), 1, [&](std::size_t b, std::size_t e) {
+    std::vector<std::uint32_t> train;
+    for (std::size_t t = b; t < e; ++t) {
+      std::size_t rep = t / std::size_t(k);
+      int hold = int(t % std::size_t(k));
+      const int* f = &fold[rep * n];
+      train.clear();
+      for (std::size_t j = 0; j < n; ++j)
+        if (f[j] != hold) train.push_back(obs[j]);
+      PowerLawFit fit = fit_power_law(x, y, train.data(), train.size(), full.a, full.b, p);
+      cv.fits[t] = fit;
+      for (std::size_t j = 0; j < n; ++j)
+        if (f[j] == hold) cv.pred[rep * n + j] = fit.a * std::pow(x[obs[j]], fit.b);
+    }
+  });
+  return cv;
+}
+
+} // namespace tch
@@ -0,0 +1,342 @@
+// Tiled GeoTIFF writer laid out as a Cloud Optimized GeoTIFF.
+//
+// Written from a Mosaic block by block, so writing never needs more than
+// one block in memory. The file holds the full resolution image and
+// overviews down to a single block (the 2 x 2 means of Mosaic::downsample)
+// in kBlock x kBlock float tiles. All IFDs come first and the tile data
+// follows from the smallest overview to the full resolution, as COG
+// readers expect. Files beyond 4 GB are written as BigTIFF.
+//
+// Tiles are compressed (DEFLATE, or ZSTD when built with TCH_HAVE_ZSTD)
+// on the pool, a batch of tiles at a time, after the floating point
+// predictor of TIFF Technical Note 3. Their sizes are only known once they
+// are compressed, so the IFDs are written last into the space reserved
+// for them at the start of the file. The EPSG code is written as a GeoKey,
+// the extent as the tie point and pixel scale of the grid.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+#ifdef TCH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "grid.h"
+#include "mosaic.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+enum class TiffCompression { None, Deflate, Zstd };
+
+inline TiffCompression parse_compression(const std::string& name) {
+  if (name == "none") return TiffCompression::None;
+  if (name == "deflate") return TiffCompression::Deflate;
+  if (name != "zstd") throw std::invalid_argument("unknown compression '" + name + "', use 'none', 'deflate' or 'zstd'");
+#ifndef TCH_HAVE_ZSTD
+  throw std::invalid_argument("built without ZSTD, define TCH_HAVE_ZSTD and link libzstd");
+#endif
+  return TiffCompression::Zstd;
+}
+
+struct GeoTiffOptions {
+  TiffCompression compression = TiffCompression::Deflate;
+  int level = 6;           // zlib 1-9, zstd 1-22
+  bool predictor = true;   // floating point predictor before compressing
+  int epsg = 0;            // CRS of the grid, 0 if unknown
+  bool geographic = false; // epsg is a geographic (lon/lat) CRS
+};
+
+namespace detail {
+
+// TIFF field types
+enum : std::uint16_t { kTiffAscii = 2, kTiffShort = 3, kTiffLong = 4, kTiffDouble = 12, kTiffLong8 = 16 };
+
+struct TiffEntry {
+  std::uint16_t tag, type;
+  std::uint64_t count;
+  std::vector<std::uint8_t> data; // little endian values
+};
+
+template <class T>
+TiffEntry tiff_entry(std::uint16_t tag, std::uint16_t type, const std::vector<T>& v) {
+  TiffEntry e{tag, type, v.size(), std::vector<std::uint8_t>(v.size() * sizeof(T))};
+  if (!v.empty()) std::memcpy(e.data.data(), v.data(), e.data.size());
+  return e;
+}
+
+inline TiffEntry tiff_ascii(std::uint16_t tag, const std::string& s) {
+  TiffEntry e{tag, kTiffAscii, s.size() + 1, std::vector<std::uint8_t>(s.begin(), s.end())};
+  e.data.push_back(0);
+  return e;
+}
+
+// tile offsets or byte counts in the width of the TIFF flavour
+inline TiffEntry tiff_offsets(std::uint16_t tag, const std::vector<std::uint64_t>& v, bool big) {
+  if (big) return tiff_entry(tag, kTiffLong8, v);
+  std::vector<std::uint32_t> v32(v.begin(), v.end());
+  return tiff_entry(tag, kTiffLong, v32);
+}
+
+class TiffIfdWriter {
+public:
+  explicit TiffIfdWriter(bool big) : big_(big) {}
+
+  // bytes of an IFD with these entries, including values that do not fit
+  // into an entry
+  std::uint64_t size(const std::vector<TiffEntry>& entries) const {
+    std::uint64_t n = big_ ? 8 + 20 * entries.size() + 8 : 2 + 12 * entries.size() + 4;
+    for (const TiffEntry& e : entries)
+      if (e.data.size() > inline_bytes()) n += (e.data.size() + 1) & ~std::uint64_t(1);
+    return n;
+  }
+
+  // IFD at offset at, linking to next (0 = last)
+  std::vector<std::uint8_t> write(const std::vector<TiffEntry>& entries, std::uint64_t at,
+                                  std::uint64_t next) const {
+    std::vector<std::uint8_t> b, extra;
+    std::uint64_t extra_at = at + (big_ ? 8 + 20 * entries.size() + 8 : 2 + 12 * entries.size() + 4);
+    put(b, entries.size(), big_ ? 8 : 2);
+    for (const TiffEntry& e : entries) {
+      put(b, e.tag, 2);
+      put(b, e.type, 2);
+      put(b, e.count, big_ ? 8 : 4);
+      if (e.data.size() <= inline_bytes()) {
+        b.insert(b.end(), e.data.begin(), e.data.end());
+        b.insert(b.end(), inline_bytes() - e.data.size(), 0);
+      } else {
+        put(b, extra_at + extra.size(), big_ ? 8 : 4);
+        extra.insert(extra.end(), e.data.begin(), e.data.end());
+        if (extra.size() & 1) extra.push_back(0); // word alignment
+      }
+    }
+    put(b, next, big_ ? 8 : 4);
+    b.insert(b.end(), extra.begin(), extra.end());
+    return b;
+  }
+
+private:
+  std::size_t inline_bytes() const { return big_ ? 8 : 4; }
+  static void put(std::vector<std::uint8_t>& b, std::uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) b.push_back(std::uint8_t(v >> (8 * i)));
+  }
+  bool big_;
+};
+
+// Floating point predictor (TIFF Technical Note 3) of a tile of rows of
+// width floats: the bytes of every row are split into planes, most
+// significant first, and differenced byte by byte.
+inline void float_predictor(const float* tile, std::size_t width, std::size_t rows,
+                            std::vector<std::uint8_t>& out) {
+  out.resize(rows * width * 4);
+  for (std::size_t r = 0; r < rows; ++r) {
+    const std::uint8_t* src = reinterpret_cast<const std::uint8_t*>(tile + r * width);
+    std::uint8_t* row = out.data() + r * width * 4;
+    for (std::size_t i = 0; i < width; ++i)
+      for (std::size_t b = 0; b < 4; ++b) row[b * width + i] = src[4 * i + 3 - b]; // little endian host
+    for (std::size_t k = width * 4 - 1; k > 0; --k) row[k] = std::uint8_t(row[k] - row[k - 1]);
+  }
+}
+
+// worst case size of a compressed tile of n bytes
+inline std::size_t compressed_bound(TiffCompression c, std::size_t n) {
+  switch (c) {
+  case TiffCompression::Deflate: return std::size_t(compressBound(uLong(n)));
+#ifdef TCH_HAVE_ZSTD
+  case TiffCompression::Zstd: return ZSTD_compressBound(n);
+#endif
+  default: return n;
+  }
+}
+
+// tile (kBlock x kBlock floats) as stored in the file, in out
+inline void encode_tile(const float* tile, const GeoTiffOptions& opt, std::vector<std::uint8_t>& scratch,
+                        std::vector<std::uint8_t>& out) {
+  const std::size_t n = std::size_t(Mosaic::kBlock) * Mosaic::kBlock * sizeof(float);
+  const std::uint8_t* src = reinterpret_cast<const std::uint8_t*>(tile);
+  if (opt.compression != TiffCompression::None && opt.predictor) {
+    float_predictor(tile, Mosaic::kBlock, Mosaic::kBlock, scratch);
+    src = scratch.data();
+  }
+  out.resize(compressed_bound(opt.compression, n));
+  switch (opt.compression) {
+  case TiffCompression::None: std::memcpy(out.data(), src, n); break;
+  case TiffCompression::Deflate: {
+    uLongf size = uLongf(out.size());
+    if (compress2(out.data(), &size, src, uLong(n), opt.level) != Z_OK)
+      throw std::runtime_error("DEFLATE compression failed");
+    out.resize(size);
+    break;
+  }
+  case TiffCompression::Zstd: {
+#ifdef TCH_HAVE_ZSTD
+    std::size_t size = ZSTD_compress(out.data(), out.size(), src, n, opt.level);
+    if (ZSTD_isError(size)) throw std::runtime_error(std::string("ZSTD compression failed: ") + ZSTD_getErrorName(size));
+    out.resize(size);
+#endif
+    break;
+  }
+  }
+}
+
+// GeoKeyDirectory: model type, pixels are areas and the EPSG code
+inline std::vector<std::uint16_t> geo_keys(const GeoTiffOptions& opt) {
+  if (opt.epsg < 0 || opt.epsg > 65535) throw std::invalid_argument("EPSG code out of range");
+  std::vector<std::uint16_t> keys{1, 1, 0, 2, 1024, 0, 1, std::uint16_t(opt.geographic ? 2 : 1),
+                                  1025, 0, 1, 1};
+  if (opt.epsg > 0) {
+    keys[3] = 3;
+    keys.insert(keys.end(), {std::uint16_t(opt.geographic ? 2048 : 3072), 0, 1,
+                             std::uint16_t(opt.epsg)});
+  }
+  return keys;
+}
+
+} // namespace detail
+
+// Write the mosaic to path as a float32 GeoTIFF with overviews.
+inline void write_cog(const Mosaic& base, const std::string& path, ThreadPool& pool,
+                      const GeoTiffOptions& opt = GeoTiffOptions()) {
+  if (opt.compression == TiffCompression::Deflate && (opt.level < 1 || opt.level > 9))
+    throw std::invalid_argument("DEFLATE level must be in 1..9");
+  std::vector<std::unique_ptr<Mosaic>> overviews;
+  const Mosaic* top = &base;
+  while (top->nblocks_x() > 1 || top->nblocks_y() > 1) {
+    overviews.push_back(top->downsample(pool));
+    top = overviews.back().get();
+  }
+  std::vector<const Mosaic*> levels{&base};
+  for (const auto& o : overviews) levels.push_back(o.get());
+
+  const std::uint64_t tile_bytes = std::uint64_t(Mosaic::kBlock) * Mosaic::kBlock * sizeof(float);
+  std::uint64_t ntiles = 0;
+  for (const Mosaic* m : levels) ntiles += std::uint64_t(m->nblocks_x()) * m->nblocks_y();
+  std::uint64_t bound = detail::compressed_bound(opt.compression, std::size_t(tile_bytes));
+  bool big = ntiles * (bound + 16) + (1u << 16) > UINT32_MAX;
+  detail::TiffIfdWriter ifd(big);
+
+  // IFD entries with placeholder offsets to size the header
+  const GridSpec& s = base.spec();
+  const std::uint16_t compression = opt.compression == TiffCompression::Deflate ? 8
+                                   : opt.compression == TiffCompression::Zstd  ? 50000
+                                                                               : 1;
+  const bool predictor = opt.compression != TiffCompression::None && opt.predictor;
+  auto entries = [&](std::size_t level, const std::vector<std::uint64_t>& offsets,
+                     const std::vector<std::uint64_t>& counts) {
+    const Mosaic& m = *levels[level];
+    using u16 = std::vector<std::uint16_t>;
+    using u32 = std::vector<std::uint32_t>;
+    std::vector<detail::TiffEntry> e;
+    e.push_back(detail::tiff_entry(254, detail::kTiffLong, u32{level ? 1u : 0u})); // NewSubfileType
+    e.push_back(detail::tiff_entry(256, detail::kTiffLong, u32{std::uint32_t(m.spec().ncol)}));
+    e.push_back(detail::tiff_entry(257, detail::kTiffLong, u32{std::uint32_t(m.spec().nrow)}));
+    e.push_back(detail::tiff_entry(258, detail::kTiffShort, u16{32}));  // BitsPerSample
+    e.push_back(detail::tiff_entry(259, detail::kTiffShort, u16{compression}));
+    e.push_back(detail::tiff_entry(262, detail::kTiffShort, u16{1}));   // MinIsBlack
+    e.push_back(detail::tiff_entry(277, detail::kTiffShort, u16{1}));   // SamplesPerPixel
+    e.push_back(detail::tiff_entry(284, detail::kTiffShort, u16{1}));   // PlanarConfiguration
+    if (predictor) e.push_back(detail::tiff_entry(317, detail::kTiffShort, u16{3})); // floating point
+    e.push_back(detail::tiff_entry(322, detail::kTiffShort, u16{Mosaic::kBlock}));
+    e.push_back(detail::tiff_entry(323, detail::kTiffShort, u16{Mosaic::kBlock}));
+    e.push_back(detail::tiff_offsets(324, offsets, big));
+    e.push_back(detail::tiff_offsets(325, counts, big));
+    e.push_back(detail::tiff_entry(339, detail::kTiffShort, u16{3})); // IEEE float
+    if (level == 0) {
+      // ModelPixelScale, ModelTiepoint (top left corner) and the GeoKeys:
+      // projected model, pixels are areas
+      e.push_back(detail::tiff_entry(33550, detail::kTiffDouble, std::vector<double>{s.res, s.res, 0}));
+      e.push_back(detail::tiff_entry(33922, detail::kTiffDouble,
+                                     std::vector<double>{0, 0, 0, s.xmin, s.ymax(), 0}));
+      e.push_back(detail::tiff_entry(34735, detail::kTiffShort, detail::geo_keys(opt)));
+    }
+    e.push_back(detail::tiff_ascii(42113, "nan")); // GDAL_NODATA
+    return e;
+  };
+
+  // the IFDs do not change size with the values of the offsets and byte
+  // counts, so their space is known before the tiles are compressed
+  std::vector<std::vector<std::uint64_t>> offsets(levels.size()), counts(levels.size());
+  std::uint64_t head = big ? 16 : 8;
+  for (std::size_t l = 0; l < levels.size(); ++l) {
+    offsets[l].assign(std::size_t(levels[l]->nblocks_x()) * levels[l]->nblocks_y(), 0);
+    counts[l].assign(offsets[l].size(), 0);
+    head += ifd.size(entries(l, offsets[l], counts[l]));
+  }
+
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+    // tile data: smallest overview first, full resolution last; a batch of
+    // tiles is read and compressed in parallel, then written in order
+    f.seekp(std::streamoff(head));
+    std::uint64_t at = head;
+    const std::size_t batch = std::size_t(std::max(1u, pool.size())) * 4;
+    std::vector<std::vector<std::uint8_t>> encoded(batch);
+    PerWorker<std::vector<float>> tiles(pool);
+    PerWorker<std::vector<std::uint8_t>> scratch(pool);
+    for (std::size_t l = levels.size(); l-- > 0;) {
+      const Mosaic& m = *levels[l];
+      const std::size_t n = offsets[l].size();
+      for (std::size_t first = 0; first < n; first += batch) {
+        std::size_t size = std::min(batch, n - first);
+        parallel_for(pool, size, 1, [&](std::size_t b, std::size_t e) {
+          std::vector<float>& tile = tiles.local(pool);
+          tile.resize(std::size_t(Mosaic::kBlock) * Mosaic::kBlock);
+          for (std::size_t j = b; j < e; ++j) {
+            std::size_t k = first + j;
+            m.read_block(int(k / m.nblocks_x()), int(k % m.nblocks_x()), tile.data());
+            detail::encode_tile(tile.data(), opt, scratch.local(pool), encoded[j]);
+          }
+        });
+        for (std::size_t j = 0; j < size; ++j) {
+          offsets[l][first + j] = at;
+          counts[l][first + j] = encoded[j].size();
+          f.write(reinterpret_cast<const char*>(encoded[j].data()), std::streamsize(encoded[j].size()));
+          at += encoded[j].size();
+        }
+      }
+    }
+    f.seekp(0);
+    if (big) {
+      const std::uint8_t h[16] = {'I', 'I', 43, 0, 8, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0};
+      f.write(reinterpret_cast<const char*>(h), 16);
+    } else {
+      const std::uint8_t h[8] = {'I', 'I', 42, 0, 8, 0, 0, 0};
+      f.write(reinterpret_cast<const char*>(h), 8);
+    }
+    std::uint64_t pos = big ? 16 : 8;
+    for (std::size_t l = 0; l < levels.size(); ++l) {
+      std::vector<detail::TiffEntry> e = entries(l, offsets[l], counts[l]);
+      std::uint64_t next = l + 1 < levels.size() ? pos + ifd.size(e) : 0;
+      std::vector<std::uint8_t> b = ifd.write(e, pos, next);
+      f.write(reinterpret_cast<const char*>(b.data()), std::streamsize(b.size()));
+      pos += b.size();
+    }
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+  }
+  std::remove(path.c_str()); // rename does not replace files on Windows
+  if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    throw std::runtime_error("cannot move '" + tmp + "' to '" + path + "'");
+}
+
+// Write an in-memory grid the same way, through a scratch mosaic next to
+// path that holds it block by block for the overviews.
+inline void write_geotiff(const Grid<float>& g, const std::string& path, ThreadPool& pool,
+                          const GeoTiffOptions& opt = GeoTiffOptions()) {
+  Mosaic m(g.spec, path + ".blocks");
+  m.merge_max(g, pool);
+  write_cog(m, path, pool, opt);
+}
+
+} // namespace tch
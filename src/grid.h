@@ -0,0 +1,80 @@
+// Georeferenced raster grid shared by the native pipeline stages.
+//
+// Cells are stored row-major in a flat buffer, row 0 being the northern
+// edge, so a grid maps onto raster::raster() without transposing or
+// flipping.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace tch {
+
+struct GridSpec {
+  double xmin = 0, ymin = 0; // lower left corner
+  double res = 1;            // cell size in map units
+  int ncol = 0, nrow = 0;
+
+  double xmax() const { return xmin + ncol * res; }
+  double ymax() const { return ymin + nrow * res; }
+  std::size_t size() const { return std::size_t(ncol) * std::size_t(nrow); }
+
+  // column/row of a coordinate, clamped so points on the max edge
+  // fall into the last cell
+  int col_of(double x) const {
+    int c = int(std::floor((x - xmin) / res));
+    return c < 0 ? 0 : (c >= ncol ? ncol - 1 : c);
+  }
+  int row_of(double y) const {
+    int r = nrow - 1 - int(std::floor((y - ymin) / res));
+    return r < 0 ? 0 : (r >= nrow ? nrow - 1 : r);
+  }
+  bool contains(double x, double y) const {
+    return x >= xmin && x <= xmax() && y >= ymin && y <= ymax();
+  }
+};
+
+// grid snapped to multiples of res that covers [x0, x1] x [y0, y1]
+inline GridSpec grid_spec_of_extent(double x0, double x1, double y0, double y1, double res) {
+  if (!(res > 0)) throw std::invalid_argument("res must be positive");
+  GridSpec g;
+  g.res = res;
+  g.xmin = std::floor(x0 / res) * res;
+  g.ymin = std::floor(y0 / res) * res;
+  g.ncol = std::max(1, int(std::ceil((x1 - g.xmin) / res)));
+  g.nrow = std::max(1, int(std::ceil((y1 - g.ymin) / res)));
+  return g;
+}
+
+// grid snapped to multiples of res that covers all finite coordinates
+template <class X, class Y>
+GridSpec grid_spec_covering(X x, Y y, std::size_t n, double res) {
+  if (!(res > 0)) throw std::invalid_argument("res must be positive");
+  double x0 = std::numeric_limits<double>::infinity(), x1 = -x0;
+  double y0 = x0, y1 = -x0;
+  for (std::size_t i = 0; i < n; ++i) {
+    if (std::isnan(x[i]) || std::isnan(y[i])) continue;
+    x0 = std::min(x0, x[i]); x1 = std::max(x1, x[i]);
+    y0 = std::min(y0, y[i]); y1 = std::max(y1, y[i]);
+  }
+  if (x0 > x1) throw std::invalid_argument("point cloud has no valid XY coordinates");
+  return grid_spec_of_extent(x0, x1, y0, y1, res);
+}
+
+template <class T>
+struct Grid {
+  GridSpec spec;
+  std::vector<T> values;
+
+  Grid() = default;
+  Grid(const GridSpec& s, T fill) : spec(s), values(s.size(), fill) {}
+
+  T& at(int row, int col) { return values[std::size_t(row) * spec.ncol + col]; }
+  const T& at(int row, int col) const { return values[std::size_t(row) * spec.ncol + col]; }
+};
+
+} // namespace tch
@@ -0,0 +1,153 @@
+// Summed-area tables (integral images) of a CHM.
+//
+// One pass over the 1 m CHM stores, for every cell corner, the sum of the
+// non-NaN heights above and left of it and their count. The sum and the
+// count of any rectangle of cells are then four lookups each, so the TCH
+// (mean height, NA removed) at any multiple of the base resolution and any
+// grid offset, or of any rectangular plot, costs O(1) per output cell
+// without reading the CHM again. This is what aggregate() computes with
+// the mean reducer, for every fact at once. Max and percentiles are not
+// decomposable and stay with aggregate().
+//
+// Sums are double (exact to ~1e-16 of the total, far below float CHM
+// precision); counts are 32 bit.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "grid.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+class IntegralImage {
+public:
+  IntegralImage() = default;
+
+  // tables of g, rows in parallel and then column strips in parallel
+  IntegralImage(const Grid<float>& g, ThreadPool& pool) : spec_(g.spec) {
+    const std::size_t w = std::size_t(spec_.ncol) + 1, h = std::size_t(spec_.nrow) + 1;
+    if (spec_.size() > UINT32_MAX) throw std::invalid_argument("too many cells for the count table");
+    sum_.assign(w * h, 0);
+    count_.assign(w * h, 0);
+    parallel_for(pool, std::size_t(spec_.nrow), 64, [&](std::size_t b, std::size_t e) {
+      for (std::size_t r = b; r < e; ++r) {
+        const float* v = &g.values[r * spec_.ncol];
+        double* s = &sum_[(r + 1) * w];
+        std::uint32_t* n = &count_[(r + 1) * w];
+        double acc = 0;
+        std::uint32_t cnt = 0;
+        for (std::size_t c = 0; c < std::size_t(spec_.ncol); ++c) {
+          if (!std::isnan(v[c])) {
+            acc += v[c];
+            ++cnt;
+          }
+          s[c + 1] = acc;
+          n[c + 1] = cnt;
+        }
+      }
+    });
+    const std::size_t strip = 256;
+    parallel_for(pool, (w + strip - 1) / strip, 1, [&](std::size_t b, std::size_t e) {
+      for (std::size_t k = b; k < e; ++k) {
+        std::size_t c0 = k * strip, c1 = std::min(w, c0 + strip);
+        for (std::size_t r = 2; r < h; ++r)
+          for (std::size_t c = c0; c < c1; ++c) {
+            sum_[r * w + c] += sum_[(r - 1) * w + c];
+            count_[r * w + c] += count_[(r - 1) * w + c];
+          }
+      }
+    });
+  }
+
+  const GridSpec& spec() const { return spec_; }
+
+  // sum and count of the cells [r0, r1) x [c0, c1), clipped to the grid
+  void rect(int r0, int c0, int r1, int c1, double& sum, std::uint32_t& count) const {
+    r0 = std::max(r0, 0);
+    c0 = std::max(c0, 0);
+    r1 = std::min(r1, spec_.nrow);
+    c1 = std::min(c1, spec_.ncol);
+    if (r0 >= r1 || c0 >= c1) {
+      sum = 0;
+      count = 0;
+      return;
+    }
+    const std::size_t w = std::size_t(spec_.ncol) + 1;
+    std::size_t a = std::size_t(r0) * w + c0, b = std::size_t(r0) * w + c1;
+    std::size_t c = std::size_t(r1) * w + c0, d = std::size_t(r1) * w + c1;
+    sum = sum_[d] - sum_[b] - sum_[c] + sum_[a];
+    count = count_[d] - count_[b] - count_[c] + count_[a];
+  }
+
+  // mean of the cells in [r0, r1) x [c0, c1), NaN without any
+  double mean(int r0, int c0, int r1, int c1) const {
+    double s;
+    std::uint32_t n;
+    rect(r0, c0, r1, c1, s, n);
+    return n ? s / n : std::numeric_limits<double>::quiet_NaN();
+  }
+
+  // mean of the cells whose centres lie in [xmin, xmax) x [ymin, ymax)
+  double mean_in(double xmin, double xmax, double ymin, double ymax) const {
+    int c0 = int(std::ceil((xmin - spec_.xmin) / spec_.res - 0.5));
+    int c1 = int(std::ceil((xmax - spec_.xmin) / spec_.res - 0.5));
+    int r0 = int(std::ceil((spec_.ymax() - ymax) / spec_.res - 0.5));
+    int r1 = int(std::ceil((spec_.ymax() - ymin) / spec_.res - 0.5));
+    return mean(r0, c0, r1, c1);
+  }
+
+  std::size_t bytes() const { return sum_.size() * sizeof(double) + count_.size() * sizeof(std::uint32_t); }
+
+private:
+  GridSpec spec_;
+  std::vector<double> sum_;          // (nrow + 1) x (ncol + 1), row 0 the northern edge
+  std::vector<std::uint32_t> count_; // same layout
+};
+
+// Layout of fact x fact blocks whose edges run through the cell corners
+// nearest to (x0, y0); fact=f with the corner of the grid as origin is the
+// layout of aggregate(). col_shift/row_shift are the base cells the first
+// block column/row reaches beyond the western/northern edge.
+struct BlockLayout {
+  GridSpec spec;
+  int fact = 1, col_shift = 0, row_shift = 0;
+};
+
+inline BlockLayout block_layout_at(const GridSpec& base, int fact, double x0, double y0) {
+  if (fact < 1) throw std::invalid_argument("fact must be >= 1");
+  BlockLayout l;
+  l.fact = fact;
+  long ox = std::lround((x0 - base.xmin) / base.res), oy = std::lround((base.ymax() - y0) / base.res);
+  l.col_shift = int(((fact - ox % fact) % fact + fact) % fact);
+  l.row_shift = int(((fact - oy % fact) % fact + fact) % fact);
+  l.spec.res = base.res * fact;
+  l.spec.ncol = (base.ncol + l.col_shift + fact - 1) / fact;
+  l.spec.nrow = (base.nrow + l.row_shift + fact - 1) / fact;
+  l.spec.xmin = base.xmin - l.col_shift * base.res;
+  l.spec.ymin = base.ymax() + l.row_shift * base.res - l.spec.nrow * l.spec.res;
+  return l;
+}
+
+// mean of every block of the layout, rows of blocks in parallel
+inline Grid<float> block_means(const IntegralImage& ii, const BlockLayout& l, ThreadPool& pool) {
+  Grid<float> out(l.spec, std::numeric_limits<float>::quiet_NaN());
+  parallel_for(pool, std::size_t(l.spec.nrow), 16, [&](std::size_t b, std::size_t e) {
+    for (std::size_t r = b; r < e; ++r) {
+      int r0 = int(r) * l.fact - l.row_shift;
+      for (int c = 0; c < l.spec.ncol; ++c) {
+        int c0 = c * l.fact - l.col_shift;
+        out.at(int(r), c) = float(ii.mean(r0, c0, r0 + l.fact, c0 + l.fact));
+      }
+    }
+  });
+  return out;
+}
+
+} // namespace tch
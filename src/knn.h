@@ -0,0 +1,350 @@
+// k nearest neighbour search: a flat KD-tree and a cached CSR adjacency.
+//
+// The tree keeps its points in tree order (AoS, D coordinates per point)
+// so a leaf is one contiguous block; nodes live in a single vector in depth
+// first order (the left child directly follows its parent). It is built
+// once per tile or chunk and shared by every stage that needs
+// neighbourhoods; the k = 10 neighbour lists of shp_plane and
+// point_metrics are computed once into a Neighbours adjacency.
+//
+// As in lidR, a point is its own first neighbour.
+//
+// KdTree<D, std::int32_t> indexes quantized coordinates (QuantizedAxis)
+// and stores their raw counts, half the memory of a double tree. Its
+// extents, splits and distances are taken on the converted doubles, so
+// it is the same tree and finds the same neighbours as a double tree over
+// the converted columns.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "metrics.h"
+#include "quantized.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+// scratch of KdTree::rebuild(), kept to rebuild without allocating
+struct KdScratch {
+  std::vector<std::uint32_t> order, ids;
+  std::vector<double> pts;
+  std::vector<std::int32_t> qpts; // points of int32 trees
+};
+
+template <int D, class T = double>
+class KdTree {
+  static_assert(std::is_same<T, double>::value || std::is_same<T, std::int32_t>::value,
+                "a KdTree stores double or int32 coordinates");
+
+public:
+  KdTree() = default;
+
+  // index the points coords[0..D)[i] for i in subset (all n points when
+  // subset is null); results refer to the original point indices. coords
+  // are const double* for a double tree and QuantizedAxis for an int32 one.
+  template <class A>
+  KdTree(const A* coords, std::size_t n, const std::uint32_t* subset = nullptr,
+         std::size_t nsubset = 0) {
+    KdScratch s;
+    rebuild(coords, n, subset, nsubset, s);
+  }
+
+  // the same in place: the tree's storage and s keep their capacity, so
+  // rebuilding for a cloud no larger than before allocates nothing
+  template <class A>
+  void rebuild(const A* coords, std::size_t n, const std::uint32_t* subset, std::size_t nsubset,
+               KdScratch& s) {
+    static_assert(std::is_same<T, double>::value || std::is_same<A, QuantizedAxis>::value,
+                  "an int32 tree indexes quantized coordinates");
+    std::size_t m = subset ? nsubset : n;
+    if (m > UINT32_MAX) throw std::invalid_argument("too many points for the k-NN index");
+    if (subset) {
+      ids_.assign(subset, subset + m);
+    } else {
+      ids_.resize(m);
+      std::iota(ids_.begin(), ids_.end(), 0u);
+    }
+    // drop points with NaN coordinates, they can never be neighbours
+    ids_.erase(std::remove_if(ids_.begin(), ids_.end(),
+                              [&](std::uint32_t i) {
+                                for (int d = 0; d < D; ++d)
+                                  if (std::isnan(coords[d][i])) return true;
+                                return false;
+                              }),
+               ids_.end());
+    pts_.resize(ids_.size() * D);
+    for (int d = 0; d < D; ++d) {
+      if constexpr (std::is_same<T, double>::value) {
+        for (std::size_t j = 0; j < ids_.size(); ++j) pts_[j * D + d] = coords[d][ids_[j]];
+      } else {
+        scale_[d] = coords[d].scale;
+        offset_[d] = coords[d].offset;
+        for (std::size_t j = 0; j < ids_.size(); ++j) pts_[j * D + d] = coords[d].q[ids_[j]];
+      }
+    }
+    s.order.resize(ids_.size());
+    std::iota(s.order.begin(), s.order.end(), 0u);
+    nodes_.clear();
+    if (!s.order.empty()) build(s.order, 0, std::uint32_t(s.order.size()));
+    // reorder points and ids into tree order
+    std::vector<T>& pts = scratch_pts(s);
+    pts.resize(pts_.size());
+    s.ids.resize(ids_.size());
+    for (std::size_t j = 0; j < s.order.size(); ++j) {
+      for (int d = 0; d < D; ++d) pts[j * D + d] = pts_[std::size_t(s.order[j]) * D + d];
+      s.ids[j] = ids_[s.order[j]];
+    }
+    pts_.swap(pts);
+    ids_.swap(s.ids);
+  }
+
+  std::size_t size() const { return ids_.size(); }
+  // bytes held by the tree (capacity, not size)
+  std::size_t bytes() const {
+    return pts_.capacity() * sizeof(T) + ids_.capacity() * sizeof(std::uint32_t) +
+           nodes_.capacity() * sizeof(Node);
+  }
+  // indexed points in tree order; consecutive points are spatially close
+  const std::vector<std::uint32_t>& tree_order() const { return ids_; }
+
+  // The k nearest indexed points of q, closest first, into idx (original
+  // indices) and d2 (squared distances). Returns how many were found
+  // (fewer than k only if the index holds fewer points). Of equally
+  // distant points the lower indices come first, so the neighbours do not
+  // depend on which other points the tree holds, e.g. those of a chunk.
+  int knn(const double* q, int k, std::uint32_t* idx, double* d2) const {
+    if (nodes_.empty() || k <= 0) return 0;
+    Heap h{idx, d2, ids_.data(), 0, k};
+    double off[D] = {};
+    search(0, q, h, off, 0);
+    for (int j = 0; j < h.n; ++j) idx[j] = ids_[idx[j]];
+    return h.n;
+  }
+
+private:
+  static const std::uint32_t kLeafSize = 16;
+
+  struct Node {
+    std::uint32_t begin, end; // point range in tree order
+    std::uint32_t right;      // right child, 0 for leaves
+    std::uint8_t dim;
+    double split;
+  };
+
+  // k best so far, sorted by distance and index; idx holds tree order
+  // positions
+  struct Heap {
+    std::uint32_t* idx;
+    double* d2;
+    const std::uint32_t* ids;
+    int n, k;
+    double worst() const { return n < k ? std::numeric_limits<double>::infinity() : d2[n - 1]; }
+    bool before(std::uint32_t i, double d, int j) const {
+      return d < d2[j] || (d == d2[j] && ids[i] < ids[idx[j]]);
+    }
+    bool accepts(std::uint32_t i, double d) const { return n < k || before(i, d, n - 1); }
+    void push(std::uint32_t i, double d) {
+      int j = n < k ? n++ : k - 1;
+      while (j > 0 && before(i, d, j - 1)) {
+        d2[j] = d2[j - 1];
+        idx[j] = idx[j - 1];
+        --j;
+      }
+      d2[j] = d;
+      idx[j] = i;
+    }
+  };
+
+  static std::vector<T>& scratch_pts(KdScratch& s) {
+    if constexpr (std::is_same<T, double>::value) return s.pts;
+    else return s.qpts;
+  }
+
+  // coordinate d of the point at tree position j
+  double coord(std::size_t j, int d) const {
+    if constexpr (std::is_same<T, double>::value) return pts_[j * D + d];
+    else return pts_[j * D + d] * scale_[d] + offset_[d];
+  }
+
+  std::uint32_t build(std::vector<std::uint32_t>& order, std::uint32_t b, std::uint32_t e) {
+    std::uint32_t self = std::uint32_t(nodes_.size());
+    nodes_.push_back(Node{b, e, 0, 0, 0});
+    if (e - b <= kLeafSize) return self;
+    double lo[D], hi[D];
+    for (int d = 0; d < D; ++d) {
+      lo[d] = std::numeric_limits<double>::infinity();
+      hi[d] = -lo[d];
+    }
+    for (std::uint32_t j = b; j < e; ++j)
+      for (int d = 0; d < D; ++d) {
+        double v = coord(order[j], d);
+        lo[d] = std::min(lo[d], v);
+        hi[d] = std::max(hi[d], v);
+      }
+    int dim = 0;
+    for (int d = 1; d < D; ++d)
+      if (hi[d] - lo[d] > hi[dim] - lo[dim]) dim = d;
+    if (hi[dim] == lo[dim]) return self; // all duplicates, keep as one leaf
+    std::uint32_t mid = b + (e - b) / 2;
+    std::nth_element(order.begin() + b, order.begin() + mid, order.begin() + e,
+                     [&](std::uint32_t i, std::uint32_t j) {
+                       return coord(i, dim) < coord(j, dim);
+                     });
+    double split = coord(order[mid], dim);
+    build(order, b, mid);
+    std::uint32_t right = build(order, mid, e);
+    Node& n = nodes_[self];
+    n.right = right;
+    n.dim = std::uint8_t(dim);
+    n.split = split;
+    return self;
+  }
+
+  // off[d] is the distance of q to the current node's box along d and
+  // box_d2 the squared distance to the box, so far subtrees are pruned by
+  // their real box distance rather than by the split plane alone
+  void search(std::uint32_t node, const double* q, Heap& h, double* off, double box_d2) const {
+    const Node& n = nodes_[node];
+    if (n.right == 0) {
+      for (std::uint32_t j = n.begin; j < n.end; ++j) {
+        double d = 0;
+        for (int k = 0; k < D; ++k) {
+          double p = coord(j, k);
+          d += (p - q[k]) * (p - q[k]);
+        }
+        if (h.accepts(j, d)) h.push(j, d);
+      }
+      return;
+    }
+    double diff = q[n.dim] - n.split;
+    std::uint32_t near = diff < 0 ? node + 1 : n.right, far = diff < 0 ? n.right : node + 1;
+    search(near, q, h, off, box_d2);
+    double old = off[n.dim];
+    double far_d2 = box_d2 - old * old + diff * diff;
+    if (far_d2 <= h.worst()) {
+      off[n.dim] = diff;
+      search(far, q, h, off, far_d2);
+      off[n.dim] = old;
+    }
+  }
+
+  std::vector<T> pts_;
+  std::vector<std::uint32_t> ids_;
+  std::vector<Node> nodes_;
+  double scale_[D] = {}, offset_[D] = {}; // of the int32 coordinates
+};
+
+// Neighbour lists in CSR layout: the neighbours of row i are
+// idx[offset[i] .. offset[i + 1]), closest first. Rows correspond to the
+// query points in the order they were given.
+struct Neighbours {
+  int k = 0;
+  std::vector<std::uint32_t> rows; // point index of every row
+  std::vector<std::uint64_t> offset;
+  std::vector<std::uint32_t> idx;
+  std::vector<float> dist; // distances, same layout as idx
+
+  std::size_t size() const { return rows.size(); }
+  const std::uint32_t* begin(std::size_t row) const { return idx.data() + offset[row]; }
+  std::size_t count(std::size_t row) const { return std::size_t(offset[row + 1] - offset[row]); }
+};
+
+// scratch of knn_adjacency_into()
+struct KnnScratch {
+  std::vector<std::uint32_t> found, visit, row_of;
+  PerWorker<std::vector<double>> d2; // squared distances of one search
+};
+
+// k-NN of the points `query` (all n points when null) against the tree,
+// computed in parallel into nb, whose vectors are reused like those of s.
+// Points with NaN coordinates get an empty row. The rows are searched
+// straight into nb.idx and nb.dist at a stride of k and then compacted in
+// place, so besides nb only a count per row is held.
+template <int D, class T, class A>
+void knn_adjacency_into(const KdTree<D, T>& tree, const A* coords, std::size_t n, int k,
+                        ThreadPool& pool, Neighbours& nb, KnnScratch& s,
+                        const std::uint32_t* query = nullptr, std::size_t nquery = 0) {
+  if (k < 1) throw std::invalid_argument("k must be >= 1");
+  StageTimer timer(TimedStage::Knn);
+  nb.k = k;
+  std::size_t m = query ? nquery : n;
+  count(Counter::KnnQueries, m);
+  if (query) {
+    nb.rows.assign(query, query + m);
+  } else {
+    nb.rows.resize(m);
+    std::iota(nb.rows.begin(), nb.rows.end(), 0u);
+  }
+  s.found.resize(m);
+  // fixed stride first, compacted into CSR afterwards
+  nb.idx.resize(m * std::size_t(k));
+  nb.dist.resize(m * std::size_t(k));
+  // query in tree order when the tree indexes the query points, so that
+  // consecutive searches walk the same nodes
+  s.visit.clear();
+  if (!query && tree.size() == n) {
+    s.visit.assign(tree.tree_order().begin(), tree.tree_order().end());
+  } else if (query && tree.size() == m) {
+    // a tree over the query subset: rows in the tree order of their points
+    s.row_of.assign(n, UINT32_MAX);
+    for (std::size_t r = 0; r < m; ++r) s.row_of[nb.rows[r]] = std::uint32_t(r);
+    for (std::uint32_t i : tree.tree_order())
+      if (s.row_of[i] != UINT32_MAX) s.visit.push_back(s.row_of[i]);
+  }
+  if (s.visit.size() != m) {
+    s.visit.resize(m);
+    std::iota(s.visit.begin(), s.visit.end(), 0u);
+  }
+  std::uint32_t* idx = nb.idx.data();
+  float* dist = nb.dist.data();
+  s.d2.resize(pool);
+  for (std::vector<double>& d2 : s.d2.all()) d2.resize(k);
+  parallel_for(pool, m, 4096, [&](std::size_t b, std::size_t e) {
+    std::vector<double>& d2 = s.d2.local(pool);
+    for (std::size_t v = b; v < e; ++v) {
+      std::size_t r = s.visit[v];
+      double q[D];
+      bool ok = true;
+      for (int d = 0; d < D; ++d) {
+        q[d] = coords[d][nb.rows[r]];
+        ok = ok && !std::isnan(q[d]);
+      }
+      std::uint32_t f = ok ? std::uint32_t(tree.knn(q, k, &idx[r * k], d2.data())) : 0;
+      for (std::uint32_t j = 0; j < f; ++j) dist[r * k + j] = float(std::sqrt(d2[j]));
+      s.found[r] = f;
+    }
+  });
+  nb.offset.assign(m + 1, 0);
+  for (std::size_t r = 0; r < m; ++r) nb.offset[r + 1] = nb.offset[r] + s.found[r];
+  // offset[r] <= r * k, so moving the rows forward in order never
+  // overwrites a row not yet moved
+  if (nb.offset[m] != m * std::size_t(k)) {
+    for (std::size_t r = 0; r < m; ++r) {
+      if (nb.offset[r] == r * std::size_t(k)) continue;
+      std::copy(idx + r * k, idx + r * k + s.found[r], idx + nb.offset[r]);
+      std::copy(dist + r * k, dist + r * k + s.found[r], dist + nb.offset[r]);
+    }
+    nb.idx.resize(nb.offset[m]);
+    nb.dist.resize(nb.offset[m]);
+  }
+}
+
+template <int D, class T, class A>
+Neighbours knn_adjacency(const KdTree<D, T>& tree, const A* coords, std::size_t n, int k,
+                         ThreadPool& pool, const std::uint32_t* query = nullptr,
+                         std::size_t nquery = 0) {
+  Neighbours nb;
+  KnnScratch s;
+  knn_adjacency_into(tree, coords, n, k, pool, nb, s, query, nquery);
+  return nb;
+}
+
+} // namespace tch
@@ -0,0 +1,499 @@
+// Column-selective, windowed LAS/LAZ reader.
+//
+// Points are read chunk by chunk (LASzip chunks for LAZ, blocks of
+// 50000 records for LAS). Chunks are decoded on the thread pool, each
+// into its own slice of the output columns, and only the selected
+// attributes are materialized. A window read skips every chunk whose
+// bounding box does not intersect the window once a chunk index
+// (write_chunk_index) exists next to the file and matches it; without one
+// all chunks are decoded but only points inside the window are kept.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "laz_decoder.h"
+#include "metrics.h"
+#include "quantized.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct LasHeader {
+  int version_major = 1, version_minor = 2;
+  int point_format = 0, record_length = 0;
+  std::uint64_t npoints = 0;
+  std::uint32_t offset_to_points = 0;
+  double scale[3] = {0.01, 0.01, 0.01}, offset[3] = {0, 0, 0};
+  double xmin = 0, xmax = 0, ymin = 0, ymax = 0, zmin = 0, zmax = 0;
+  bool compressed = false;
+  bool gpstime = false; // record carries a GPS time
+
+  // coordinate d (0 X, 1 Y, 2 Z) of quantized columns
+  QuantizedAxis axis(const std::vector<std::int32_t>& q, int d) const {
+    return QuantizedAxis{q.data(), scale[d], offset[d]};
+  }
+};
+
+// attributes to materialize besides X, Y, Z; letters as in lidR::readLAS
+struct ColumnSelection {
+  bool intensity = false, gpstime = false, return_number = false;
+  bool number_of_returns = false, classification = false;
+  bool quantized = false; // X, Y, Z as the file's int32 counts instead of doubles
+
+  static ColumnSelection parse(const std::string& select) {
+    ColumnSelection s;
+    for (char c : select) {
+      switch (c) {
+      case 'x': case 'y': case 'z': break;
+      case 'i': s.intensity = true; break;
+      case 't': s.gpstime = true; break;
+      case 'r': s.return_number = true; break;
+      case 'n': s.number_of_returns = true; break;
+      case 'c': s.classification = true; break;
+      case 'q': s.quantized = true; break;
+      case '*':
+        s.intensity = s.gpstime = s.return_number = s.number_of_returns = s.classification = true;
+        break;
+      default:
+        throw std::invalid_argument(std::string("unsupported attribute '") + c +
+                                    "' in select, use any of 'xyzitrncq'");
+      }
+    }
+    return s;
+  }
+};
+
+struct Window {
+  double xmin, ymin, xmax, ymax;
+  bool contains(double x, double y) const { return x >= xmin && x <= xmax && y >= ymin && y <= ymax; }
+  bool intersects(const double* b) const { // b = {xmin, ymin, xmax, ymax}
+    return b[0] <= xmax && b[2] >= xmin && b[1] <= ymax && b[3] >= ymin;
+  }
+};
+
+// Columns of a read; with ColumnSelection::quantized the coordinates are
+// in qx, qy, qz (see quantized.h) and x, y, z stay empty.
+struct LasColumns {
+  std::vector<double> x, y, z, gpstime;
+  std::vector<std::int32_t> qx, qy, qz;
+  std::vector<std::int32_t> intensity, return_number, number_of_returns, classification;
+
+  std::size_t size() const { return x.empty() ? qx.size() : x.size(); }
+  void resize(std::size_t n, const ColumnSelection& s) {
+    if (s.quantized) {
+      x.clear(); y.clear(); z.clear();
+      qx.resize(n); qy.resize(n); qz.resize(n);
+    } else {
+      qx.clear(); qy.clear(); qz.clear();
+      x.resize(n); y.resize(n); z.resize(n);
+    }
+    if (s.gpstime) gpstime.resize(n);
+    if (s.intensity) intensity.resize(n);
+    if (s.return_number) return_number.resize(n);
+    if (s.number_of_returns) number_of_returns.resize(n);
+    if (s.classification) classification.resize(n);
+  }
+};
+
+// What decoding a chunk needs besides the output columns: the chunk's
+// bytes, an open stream and the LASzip decoders, whose models init()
+// resets for every chunk. Kept per worker by LasReader::read_into(), so
+// reading tile after tile does not allocate them again.
+struct LasChunkScratch {
+  std::vector<std::uint8_t> bytes;
+  std::string path;
+  std::unique_ptr<std::ifstream> file;
+  std::unique_ptr<laz::ArithmeticDecoder> dec;
+  std::unique_ptr<laz::Point10Decoder> p10;
+  std::unique_ptr<laz::GpsTime11Decoder> gps;
+};
+
+class LasReader {
+public:
+  explicit LasReader(const std::string& path) : path_(path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) throw std::runtime_error("cannot open '" + path + "'");
+    f.seekg(0, std::ios::end);
+    file_size_ = std::uint64_t(f.tellg());
+    read_header(f);
+    if (h_.compressed) read_chunk_table(f);
+    else plan_raw_chunks();
+  }
+
+  const LasHeader& header() const { return h_; }
+  std::size_t nchunks() const { return chunk_points_.size(); }
+  std::uint64_t file_size() const { return file_size_; }
+
+  // xy bounding box {xmin, ymin, xmax, ymax} of every chunk
+  std::vector<double> chunk_bounds(ThreadPool* pool) const {
+    std::vector<double> b(4 * nchunks());
+    for_each_chunk(pool, [&](std::size_t k) {
+      LasColumns c = decode_chunk(k, ColumnSelection());
+      double* out = &b[4 * k];
+      out[0] = out[1] = std::numeric_limits<double>::infinity();
+      out[2] = out[3] = -out[0];
+      for (std::size_t i = 0; i < c.size(); ++i) {
+        out[0] = std::min(out[0], c.x[i]); out[1] = std::min(out[1], c.y[i]);
+        out[2] = std::max(out[2], c.x[i]); out[3] = std::max(out[3], c.y[i]);
+      }
+    });
+    return b;
+  }
+
+  // Read the selected columns. bounds (from chunk_bounds) lets a window
+  // read skip chunks, it may be empty.
+  LasColumns read(const ColumnSelection& sel, const Window* window, ThreadPool* pool,
+                  const std::vector<double>& bounds = {}) const {
+    LasColumns out;
+    if (!window) {
+      read_into(sel, pool, out);
+      return out;
+    }
+    StageTimer timer(TimedStage::Read);
+    std::vector<LasColumns> parts(nchunks());
+    for_each_chunk(pool, [&](std::size_t k) {
+      if (!bounds.empty() && !window->intersects(&bounds[4 * k])) return;
+      parts[k] = decode_chunk(k, sel, window);
+    });
+    std::size_t n = 0;
+    for (const LasColumns& p : parts) n += p.size();
+    count(Counter::PointsRead, n);
+    out.resize(n, sel);
+    std::size_t at = 0;
+    for (const LasColumns& p : parts) {
+      append(out.x, p.x, at); append(out.y, p.y, at); append(out.z, p.z, at);
+      append(out.qx, p.qx, at); append(out.qy, p.qy, at); append(out.qz, p.qz, at);
+      append(out.gpstime, p.gpstime, at);
+      append(out.intensity, p.intensity, at);
+      append(out.return_number, p.return_number, at);
+      append(out.number_of_returns, p.number_of_returns, at);
+      append(out.classification, p.classification, at);
+      at += p.size();
+    }
+    return out;
+  }
+
+  // Read every point into out, whose columns are resized in place and so
+  // keep their capacity from earlier tiles; with scratch the chunks are
+  // decoded with the workers' buffers and decoders too. Columns not
+  // selected are left as they are.
+  void read_into(const ColumnSelection& sel, ThreadPool* pool, LasColumns& out,
+                 PerWorker<LasChunkScratch>* scratch = nullptr) const {
+    StageTimer timer(TimedStage::Read);
+    std::vector<std::uint64_t> first(nchunks() + 1, 0);
+    for (std::size_t k = 0; k < nchunks(); ++k) first[k + 1] = first[k] + chunk_points_[k];
+    out.resize(std::size_t(first.back()), sel);
+    if (scratch && pool) scratch->resize(*pool);
+    for_each_chunk(pool, [&](std::size_t k) {
+      LasChunkScratch own;
+      decode_chunk_into(k, sel, out, first[k], nullptr, scratch && pool ? scratch->local(*pool) : own);
+    });
+    count(Counter::PointsRead, out.size());
+  }
+
+private:
+  static const std::uint32_t kRawChunk = 50000;
+
+  template <class T>
+  static T get(const std::uint8_t* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+  }
+  template <class T>
+  static void append(std::vector<T>& to, const std::vector<T>& from, std::size_t at) {
+    if (!from.empty()) std::copy(from.begin(), from.end(), to.begin() + at);
+  }
+
+  std::vector<std::uint8_t> read_bytes(std::ifstream& f, std::uint64_t pos, std::size_t n) const {
+    std::vector<std::uint8_t> b;
+    read_bytes_into(f, pos, n, b);
+    return b;
+  }
+
+  void read_bytes_into(std::ifstream& f, std::uint64_t pos, std::size_t n, std::vector<std::uint8_t>& b) const {
+    b.resize(n);
+    f.seekg(std::streamoff(pos));
+    f.read(reinterpret_cast<char*>(b.data()), std::streamsize(n));
+    if (std::size_t(f.gcount()) != n) throw std::runtime_error("'" + path_ + "' is truncated");
+  }
+
+  void read_header(std::ifstream& f) {
+    if (file_size_ < 227) throw std::runtime_error("'" + path_ + "' is not a LAS file");
+    std::vector<std::uint8_t> b = read_bytes(f, 0, std::min<std::uint64_t>(file_size_, 375));
+    if (std::memcmp(b.data(), "LASF", 4) != 0) throw std::runtime_error("'" + path_ + "' is not a LAS file");
+    h_.version_major = b[24];
+    h_.version_minor = b[25];
+    std::uint16_t header_size = get<std::uint16_t>(&b[94]);
+    h_.offset_to_points = get<std::uint32_t>(&b[96]);
+    std::uint32_t nvlr = get<std::uint32_t>(&b[100]);
+    h_.compressed = (b[104] & 0xC0) != 0;
+    h_.point_format = b[104] & 0x3F;
+    h_.record_length = get<std::uint16_t>(&b[105]);
+    h_.npoints = get<std::uint32_t>(&b[107]);
+    for (int i = 0; i < 3; ++i) {
+      h_.scale[i] = get<double>(&b[131 + 8 * i]);
+      h_.offset[i] = get<double>(&b[155 + 8 * i]);
+    }
+    h_.xmax = get<double>(&b[179]); h_.xmin = get<double>(&b[187]);
+    h_.ymax = get<double>(&b[195]); h_.ymin = get<double>(&b[203]);
+    h_.zmax = get<double>(&b[211]); h_.zmin = get<double>(&b[219]);
+    if (h_.version_minor >= 4 && b.size() >= 255 && h_.npoints == 0)
+      h_.npoints = get<std::uint64_t>(&b[247]);
+    int f0 = h_.point_format;
+    h_.gpstime = f0 == 1 || f0 >= 3;
+    if (f0 > 10) throw std::runtime_error("unsupported point format " + std::to_string(f0));
+
+    // find the LASzip VLR
+    std::uint64_t pos = header_size;
+    for (std::uint32_t v = 0; v < nvlr && pos + 54 <= file_size_; ++v) {
+      std::vector<std::uint8_t> vh = read_bytes(f, pos, 54);
+      std::uint16_t record_id = get<std::uint16_t>(&vh[18]), length = get<std::uint16_t>(&vh[20]);
+      if (record_id == 22204 && std::strncmp(reinterpret_cast<char*>(&vh[2]), "laszip encoded", 16) == 0)
+        parse_laszip_vlr(read_bytes(f, pos + 54, length));
+      pos += 54 + length;
+    }
+    if (h_.compressed && chunk_size_ == 0)
+      throw std::runtime_error("'" + path_ + "' is compressed but has no LASzip VLR");
+  }
+
+  void parse_laszip_vlr(const std::vector<std::uint8_t>& d) {
+    if (d.size() < 34) throw std::runtime_error("'" + path_ + "': corrupt LASzip VLR");
+    std::uint16_t compressor = get<std::uint16_t>(&d[0]);
+    chunk_size_ = get<std::uint32_t>(&d[12]);
+    std::uint16_t nitems = get<std::uint16_t>(&d[32]);
+    bool point10 = false;
+    for (std::uint16_t i = 0; i < nitems && 34u + 6u * i + 6u <= d.size(); ++i) {
+      std::uint16_t type = get<std::uint16_t>(&d[34 + 6 * i]);
+      std::uint16_t version = get<std::uint16_t>(&d[38 + 6 * i]);
+      if (type == 6 && version == 2) point10 = true;
+      else if (type == 7 && version == 2) gps11_ = true;
+      else unsupported("LASzip item type " + std::to_string(type) + " v" + std::to_string(version));
+    }
+    if (compressor != 2) unsupported("LASzip compressor " + std::to_string(compressor));
+    if (!point10) unsupported("LASzip stream without POINT10");
+    if (chunk_size_ == 0xFFFFFFFFu) unsupported("variable sized LASzip chunks");
+  }
+
+  [[noreturn]] void unsupported(const std::string& what) const {
+    throw std::runtime_error("'" + path_ + "': " + what + " is not supported by the native reader");
+  }
+
+  void read_chunk_table(std::ifstream& f) {
+    std::uint64_t first = h_.offset_to_points + 8;
+    std::int64_t table = get<std::int64_t>(read_bytes(f, h_.offset_to_points, 8).data());
+    if (table == -1) table = get<std::int64_t>(read_bytes(f, file_size_ - 8, 8).data());
+    if (table <= 0 || std::uint64_t(table) + 8 > file_size_)
+      throw std::runtime_error("'" + path_ + "': corrupt LASzip chunk table");
+    std::vector<std::uint8_t> t = read_bytes(f, std::uint64_t(table), std::size_t(file_size_ - std::uint64_t(table)));
+    std::uint32_t n = get<std::uint32_t>(&t[4]);
+    laz::ArithmeticDecoder dec(t.data() + 8, t.data() + t.size());
+    laz::IntegerDecompressor ic(dec, 32, 2);
+    dec.init();
+    ic.init();
+    chunk_start_.assign(n + 1, 0);
+    std::uint32_t prev = 0;
+    for (std::uint32_t i = 0; i < n; ++i) {
+      prev = std::uint32_t(ic.decompress(std::int32_t(prev), 1));
+      chunk_start_[i + 1] = chunk_start_[i] + prev;
+    }
+    for (std::uint64_t& s : chunk_start_) s += first;
+    chunk_points_.resize(n);
+    std::uint64_t left = h_.npoints;
+    for (std::uint32_t i = 0; i < n; ++i) {
+      chunk_points_[i] = std::uint32_t(std::min<std::uint64_t>(left, chunk_size_));
+      left -= chunk_points_[i];
+    }
+  }
+
+  void plan_raw_chunks() {
+    std::uint64_t n = h_.npoints;
+    for (std::uint64_t at = 0; at < n; at += kRawChunk) {
+      chunk_start_.push_back(h_.offset_to_points + at * std::uint64_t(h_.record_length));
+      chunk_points_.push_back(std::uint32_t(std::min<std::uint64_t>(kRawChunk, n - at)));
+    }
+    chunk_start_.push_back(h_.offset_to_points + n * std::uint64_t(h_.record_length));
+  }
+
+  template <class Fn>
+  void for_each_chunk(ThreadPool* pool, Fn fn) const {
+    if (!pool || pool->size() < 2) {
+      for (std::size_t k = 0; k < nchunks(); ++k) fn(k);
+      return;
+    }
+    for (std::size_t k = 0; k < nchunks(); ++k) pool->submit([&fn, k] { fn(k); });
+    pool->wait();
+  }
+
+  LasColumns decode_chunk(std::size_t k, const ColumnSelection& sel, const Window* window = nullptr) const {
+    LasColumns c;
+    c.resize(chunk_points_[k], sel);
+    LasChunkScratch s;
+    std::size_t kept = decode_chunk_into(k, sel, c, 0, window, s);
+    c.resize(kept, sel);
+    return c;
+  }
+
+  // decode chunk k into out starting at row `at` with the buffers and
+  // decoders of s; returns the rows written
+  std::size_t decode_chunk_into(std::size_t k, const ColumnSelection& sel, LasColumns& out,
+                                std::uint64_t at, const Window* window, LasChunkScratch& s) const {
+    if (!s.file || s.path != path_) {
+      s.file.reset(new std::ifstream(path_, std::ios::binary));
+      s.path = path_;
+    }
+    std::ifstream& f = *s.file;
+    if (!f) throw std::runtime_error("cannot open '" + path_ + "'");
+    std::vector<std::uint8_t>& bytes = s.bytes;
+    read_bytes_into(f, chunk_start_[k], std::size_t(chunk_start_[k + 1] - chunk_start_[k]), bytes);
+    std::size_t row = std::size_t(at);
+    auto emit = [&](const std::uint8_t* rec) {
+      double x = get<std::int32_t>(rec) * h_.scale[0] + h_.offset[0];
+      double y = get<std::int32_t>(rec + 4) * h_.scale[1] + h_.offset[1];
+      if (window && !window->contains(x, y)) return;
+      if (sel.quantized) {
+        out.qx[row] = get<std::int32_t>(rec);
+        out.qy[row] = get<std::int32_t>(rec + 4);
+        out.qz[row] = get<std::int32_t>(rec + 8);
+      } else {
+        out.x[row] = x;
+        out.y[row] = y;
+        out.z[row] = get<std::int32_t>(rec + 8) * h_.scale[2] + h_.offset[2];
+      }
+      bool extended = h_.point_format >= 6;
+      if (sel.intensity) out.intensity[row] = get<std::uint16_t>(rec + 12);
+      if (sel.return_number) out.return_number[row] = extended ? rec[14] & 15 : rec[14] & 7;
+      if (sel.number_of_returns) out.number_of_returns[row] = extended ? rec[14] >> 4 : (rec[14] >> 3) & 7;
+      if (sel.classification) out.classification[row] = extended ? rec[16] : rec[15] & 31;
+      if (sel.gpstime) {
+        out.gpstime[row] = h_.gpstime ? get<double>(rec + (extended ? 22 : 20))
+                                      : std::numeric_limits<double>::quiet_NaN();
+      }
+      ++row;
+    };
+
+    std::uint32_t n = chunk_points_[k];
+    if (!h_.compressed) {
+      for (std::uint32_t i = 0; i < n; ++i) emit(&bytes[std::size_t(i) * h_.record_length]);
+      return row - std::size_t(at);
+    }
+    // LASzip: the first point of a chunk is stored raw, the arithmetic coded
+    // stream of the remaining points follows it
+    const std::size_t size = laz::Point10Decoder::kSize + (gps11_ ? laz::GpsTime11Decoder::kSize : 0);
+    if (n == 0) return 0;
+    if (bytes.size() < size) throw std::runtime_error("'" + path_ + "': corrupt LASzip chunk");
+    std::uint8_t rec[laz::Point10Decoder::kSize + laz::GpsTime11Decoder::kSize] = {0};
+    std::memcpy(rec, bytes.data(), size);
+    if (!s.dec) {
+      s.dec.reset(new laz::ArithmeticDecoder(nullptr, nullptr));
+      s.p10.reset(new laz::Point10Decoder(*s.dec));
+      s.gps.reset(new laz::GpsTime11Decoder(*s.dec));
+    }
+    laz::ArithmeticDecoder& dec = *s.dec;
+    dec.reset(bytes.data() + size, bytes.data() + bytes.size());
+    s.p10->init(rec);
+    if (gps11_) s.gps->init(rec + laz::Point10Decoder::kSize);
+    emit(rec);
+    if (n > 1) dec.init();
+    for (std::uint32_t i = 1; i < n; ++i) {
+      s.p10->read(rec);
+      if (gps11_) s.gps->read(rec + laz::Point10Decoder::kSize);
+      emit(rec);
+    }
+    return row - std::size_t(at);
+  }
+
+  std::string path_;
+  std::uint64_t file_size_ = 0;
+  LasHeader h_;
+  std::uint32_t chunk_size_ = 0;
+  bool gps11_ = false;
+  std::vector<std::uint64_t> chunk_start_; // byte offsets, nchunks + 1
+  std::vector<std::uint32_t> chunk_points_;
+};
+
+// Chunk index sidecar ("<file>.tchx"): the chunk bounding boxes of a
+// LAS/LAZ file, stamped with the size and modification time of the file
+// they were computed from.
+//   "TCHX" u32 version u64 size i64 mtime u64 nchunks, nchunks x 4 f64
+const std::uint32_t kChunkIndexVersion = 2;
+
+namespace detail {
+
+inline std::int64_t file_mtime(const std::string& path) {
+  std::error_code ec;
+  std::filesystem::file_time_type t = std::filesystem::last_write_time(path, ec);
+  return ec ? 0 : std::int64_t(t.time_since_epoch().count());
+}
+
+} // namespace detail
+
+inline void write_chunk_index(const std::string& path, const LasReader& r, const std::vector<double>& bounds) {
+  std::ofstream f(path + ".tchx", std::ios::binary);
+  if (!f) throw std::runtime_error("cannot write '" + path + ".tchx'");
+  std::uint32_t version = kChunkIndexVersion;
+  std::uint64_t size = r.file_size(), n = bounds.size() / 4;
+  std::int64_t mtime = detail::file_mtime(path);
+  f.write("TCHX", 4);
+  f.write(reinterpret_cast<const char*>(&version), 4);
+  f.write(reinterpret_cast<const char*>(&size), 8);
+  f.write(reinterpret_cast<const char*>(&mtime), 8);
+  f.write(reinterpret_cast<const char*>(&n), 8);
+  f.write(reinterpret_cast<const char*>(bounds.data()), std::streamsize(bounds.size() * sizeof(double)));
+  if (!f) throw std::runtime_error("cannot write '" + path + ".tchx'");
+}
+
+// the bounds of the sidecar, empty if there is none or (stale set) if it
+// does not match the file
+inline std::vector<double> read_chunk_index(const std::string& path, const LasReader& r,
+                                            bool* stale = nullptr) {
+  if (stale) *stale = false;
+  std::ifstream f(path + ".tchx", std::ios::binary);
+  if (!f) return {};
+  char magic[4];
+  std::uint32_t version = 0;
+  std::uint64_t size = 0, n = 0;
+  std::int64_t mtime = 0;
+  f.read(magic, 4);
+  f.read(reinterpret_cast<char*>(&version), 4);
+  f.read(reinterpret_cast<char*>(&size), 8);
+  f.read(reinterpret_cast<char*>(&mtime), 8);
+  f.read(reinterpret_cast<char*>(&n), 8);
+  std::vector<double> b;
+  if (f && std::memcmp(magic, "TCHX", 4) == 0 && version == kChunkIndexVersion &&
+      size == r.file_size() && mtime == detail::file_mtime(path) && n == r.nchunks()) {
+    b.resize(4 * n);
+    f.read(reinterpret_cast<char*>(b.data()), std::streamsize(b.size() * sizeof(double)));
+    if (f) return b;
+    b.clear();
+  }
+  if (stale) *stale = true;
+  return b;
+}
+
+// The chunk bounds for a window read: those of the sidecar, rebuilt and
+// rewritten when the file changed since it was written (or it is of an
+// older version); empty when the file was never indexed. Where the
+// sidecar cannot be rewritten the rebuilt bounds are still used.
+inline std::vector<double> chunk_index(const std::string& path, const LasReader& r, ThreadPool* pool) {
+  bool stale = false;
+  std::vector<double> b = read_chunk_index(path, r, &stale);
+  if (!stale) return b;
+  b = r.chunk_bounds(pool);
+  try {
+    write_chunk_index(path, r, b);
+  } catch (const std::runtime_error&) {
+  }
+  return b;
+}
+
+} // namespace tch
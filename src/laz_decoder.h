@@ -0,0 +1,617 @@
+// Decoder for LASzip compressed point records.
+//
+// Covers what LAS 1.0-1.3 files with point formats 0 and 1 need: the
+// arithmetic decoder, the integer decompressor and the version 2 POINT10
+// and GPSTIME11 item decoders of LASzip (pointwise chunked compression).
+// The bit streams follow the LASzip reference implementation exactly.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace tch {
+namespace laz {
+
+class ArithmeticDecoder;
+
+// adaptive model over `symbols` symbols
+class SymbolModel {
+public:
+  explicit SymbolModel(std::uint32_t symbols) : symbols_(symbols) {
+    if (symbols < 2 || symbols > (1u << 11)) throw std::invalid_argument("laz: bad model size");
+    last_symbol_ = symbols - 1;
+    if (symbols > 16) {
+      std::uint32_t table_bits = 3;
+      while (symbols > (1u << (table_bits + 2))) ++table_bits;
+      table_size_ = 1u << table_bits;
+      table_shift_ = kLengthShift - table_bits;
+      decoder_table_.resize(table_size_ + 2);
+    }
+    distribution_.resize(symbols);
+    symbol_count_.resize(symbols);
+    init();
+  }
+
+  void init() {
+    total_count_ = 0;
+    update_cycle_ = symbols_;
+    for (std::uint32_t k = 0; k < symbols_; ++k) symbol_count_[k] = 1;
+    update();
+    symbols_until_update_ = update_cycle_ = (symbols_ + 6) >> 1;
+  }
+
+private:
+  friend class ArithmeticDecoder;
+  static const std::uint32_t kLengthShift = 15, kMaxCount = 1u << 15;
+
+  void update() {
+    if ((total_count_ += update_cycle_) > kMaxCount) {
+      total_count_ = 0;
+      for (std::uint32_t n = 0; n < symbols_; ++n)
+        total_count_ += (symbol_count_[n] = (symbol_count_[n] + 1) >> 1);
+    }
+    std::uint32_t sum = 0, s = 0;
+    std::uint32_t scale = 0x80000000u / total_count_;
+    if (table_size_ == 0) {
+      for (std::uint32_t k = 0; k < symbols_; ++k) {
+        distribution_[k] = (scale * sum) >> (31 - kLengthShift);
+        sum += symbol_count_[k];
+      }
+    } else {
+      for (std::uint32_t k = 0; k < symbols_; ++k) {
+        distribution_[k] = (scale * sum) >> (31 - kLengthShift);
+        sum += symbol_count_[k];
+        std::uint32_t w = distribution_[k] >> table_shift_;
+        while (s < w) decoder_table_[++s] = k - 1;
+      }
+      decoder_table_[0] = 0;
+      while (s <= table_size_) decoder_table_[++s] = symbols_ - 1;
+    }
+    update_cycle_ = (5 * update_cycle_) >> 2;
+    std::uint32_t max_cycle = (symbols_ + 6) << 3;
+    if (update_cycle_ > max_cycle) update_cycle_ = max_cycle;
+    symbols_until_update_ = update_cycle_;
+  }
+
+  std::uint32_t symbols_, last_symbol_;
+  std::uint32_t table_size_ = 0, table_shift_ = 0;
+  std::uint32_t total_count_ = 0, update_cycle_ = 0, symbols_until_update_ = 0;
+  std::vector<std::uint32_t> distribution_, symbol_count_, decoder_table_;
+};
+
+// adaptive binary model
+class BitModel {
+public:
+  BitModel() { init(); }
+  void init() {
+    bit_0_count_ = 1;
+    bit_count_ = 2;
+    bit_0_prob_ = 1u << (kLengthShift - 1);
+    update_cycle_ = bits_until_update_ = 4;
+  }
+
+private:
+  friend class ArithmeticDecoder;
+  static const std::uint32_t kLengthShift = 13, kMaxCount = 1u << 13;
+
+  void update() {
+    if ((bit_count_ += update_cycle_) > kMaxCount) {
+      bit_count_ = (bit_count_ + 1) >> 1;
+      bit_0_count_ = (bit_0_count_ + 1) >> 1;
+      if (bit_0_count_ == bit_count_) ++bit_count_;
+    }
+    std::uint32_t scale = 0x80000000u / bit_count_;
+    bit_0_prob_ = (bit_0_count_ * scale) >> (31 - kLengthShift);
+    update_cycle_ = (5 * update_cycle_) >> 2;
+    if (update_cycle_ > 64) update_cycle_ = 64;
+    bits_until_update_ = update_cycle_;
+  }
+
+  std::uint32_t bit_0_count_, bit_count_, bit_0_prob_, update_cycle_, bits_until_update_;
+};
+
+// decodes from an in-memory byte range; reads past the end yield zeros
+class ArithmeticDecoder {
+public:
+  ArithmeticDecoder(const std::uint8_t* begin, const std::uint8_t* end) : p_(begin), end_(end) {}
+
+  const std::uint8_t* position() const { return p_; }
+  void seek(const std::uint8_t* p) { p_ = p; }
+  // decode another byte range, e.g. the next chunk; call init() before
+  void reset(const std::uint8_t* begin, const std::uint8_t* end) {
+    p_ = begin;
+    end_ = end;
+  }
+
+  void init() {
+    length_ = kMaxLength;
+    value_ = std::uint32_t(byte()) << 24;
+    value_ |= std::uint32_t(byte()) << 16;
+    value_ |= std::uint32_t(byte()) << 8;
+    value_ |= std::uint32_t(byte());
+  }
+
+  std::uint32_t decode_bit(BitModel& m) {
+    std::uint32_t x = m.bit_0_prob_ * (length_ >> BitModel::kLengthShift);
+    std::uint32_t sym = value_ >= x;
+    if (sym == 0) {
+      length_ = x;
+      ++m.bit_0_count_;
+    } else {
+      value_ -= x;
+      length_ -= x;
+    }
+    if (length_ < kMinLength) renorm();
+    if (--m.bits_until_update_ == 0) m.update();
+    return sym;
+  }
+
+  std::uint32_t decode_symbol(SymbolModel& m) {
+    std::uint32_t n, sym, x, y = length_;
+    if (m.table_size_) {
+      std::uint32_t dv = value_ / (length_ >>= SymbolModel::kLengthShift);
+      std::uint32_t t = dv >> m.table_shift_;
+      sym = m.decoder_table_[t];
+      n = m.decoder_table_[t + 1] + 1;
+      while (n > sym + 1) {
+        std::uint32_t k = (sym + n) >> 1;
+        if (m.distribution_[k] > dv) n = k;
+        else sym = k;
+      }
+      x = m.distribution_[sym] * length_;
+      if (sym != m.last_symbol_) y = m.distribution_[sym + 1] * length_;
+    } else {
+      x = sym = 0;
+      length_ >>= SymbolModel::kLengthShift;
+      std::uint32_t k = (n = m.symbols_) >> 1;
+      do {
+        std::uint32_t z = length_ * m.distribution_[k];
+        if (z > value_) {
+          n = k;
+          y = z;
+        } else {
+          sym = k;
+          x = z;
+        }
+      } while ((k = (sym + n) >> 1) != sym);
+    }
+    value_ -= x;
+    length_ = y - x;
+    if (length_ < kMinLength) renorm();
+    ++m.symbol_count_[sym];
+    if (--m.symbols_until_update_ == 0) m.update();
+    return sym;
+  }
+
+  std::uint32_t read_bits(std::uint32_t bits) {
+    if (bits > 19) {
+      std::uint32_t lower = read_short();
+      bits -= 16;
+      std::uint32_t upper = read_bits(bits) << 16;
+      return upper | lower;
+    }
+    std::uint32_t sym = value_ / (length_ >>= bits);
+    value_ -= length_ * sym;
+    if (length_ < kMinLength) renorm();
+    return sym;
+  }
+
+  std::uint32_t read_short() {
+    std::uint32_t sym = value_ / (length_ >>= 16);
+    value_ -= length_ * sym;
+    if (length_ < kMinLength) renorm();
+    return sym;
+  }
+
+  std::uint32_t read_int() {
+    std::uint32_t lower = read_short();
+    std::uint32_t upper = read_short();
+    return (upper << 16) | lower;
+  }
+
+private:
+  static const std::uint32_t kMinLength = 0x01000000u, kMaxLength = 0xFFFFFFFFu;
+
+  std::uint8_t byte() { return p_ < end_ ? *p_++ : 0; }
+
+  void renorm() {
+    do {
+      value_ = (value_ << 8) | byte();
+    } while ((length_ <<= 8) < kMinLength);
+  }
+
+  const std::uint8_t* p_;
+  const std::uint8_t* end_;
+  std::uint32_t value_ = 0, length_ = kMaxLength;
+};
+
+// LASzip IntegerCompressor, decompression side
+class IntegerDecompressor {
+public:
+  IntegerDecompressor(ArithmeticDecoder& dec, std::uint32_t bits = 16, std::uint32_t contexts = 1,
+                      std::uint32_t bits_high = 8, std::uint32_t range = 0)
+      : dec_(dec), bits_high_(bits_high) {
+    if (range) {
+      corr_bits_ = 0;
+      corr_range_ = range;
+      while (range) {
+        range >>= 1;
+        ++corr_bits_;
+      }
+      if (corr_range_ == (1u << (corr_bits_ - 1))) --corr_bits_;
+      corr_min_ = -std::int32_t(corr_range_ / 2);
+    } else if (bits && bits < 32) {
+      corr_bits_ = bits;
+      corr_range_ = 1u << bits;
+      corr_min_ = -std::int32_t(corr_range_ / 2);
+    } else {
+      corr_bits_ = 32;
+      corr_range_ = 0;
+      corr_min_ = INT32_MIN;
+    }
+    for (std::uint32_t i = 0; i < contexts; ++i) m_bits_.emplace_back(new SymbolModel(corr_bits_ + 1));
+    for (std::uint32_t i = 1; i <= corr_bits_; ++i)
+      m_corrector_.emplace_back(new SymbolModel(i <= bits_high_ ? 1u << i : 1u << bits_high_));
+  }
+
+  void init() {
+    for (auto& m : m_bits_) m->init();
+    m_corrector0_.init();
+    for (auto& m : m_corrector_) m->init();
+  }
+
+  std::int32_t decompress(std::int32_t pred, std::uint32_t context = 0) {
+    std::int32_t real = std::int32_t(std::uint32_t(pred) + std::uint32_t(read_corrector(*m_bits_[context])));
+    if (real < 0) real = std::int32_t(std::uint32_t(real) + corr_range_);
+    else if (std::uint32_t(real) >= corr_range_) real = std::int32_t(std::uint32_t(real) - corr_range_);
+    return real;
+  }
+
+  // number of bits of the last corrector, used as context by callers
+  std::uint32_t k() const { return k_; }
+
+private:
+  std::int32_t read_corrector(SymbolModel& m_bits) {
+    std::int32_t c;
+    k_ = dec_.decode_symbol(m_bits);
+    if (k_) {
+      if (k_ < 32) {
+        SymbolModel& m = *m_corrector_[k_ - 1];
+        if (k_ <= bits_high_) {
+          c = std::int32_t(dec_.decode_symbol(m));
+        } else {
+          std::uint32_t k1 = k_ - bits_high_;
+          c = std::int32_t(dec_.decode_symbol(m));
+          std::int32_t c1 = std::int32_t(dec_.read_bits(k1));
+          c = std::int32_t((std::uint32_t(c) << k1) | std::uint32_t(c1));
+        }
+        if (c >= (1 << (k_ - 1))) c += 1;
+        else c -= std::int32_t((1u << k_) - 1);
+      } else {
+        c = corr_min_;
+      }
+    } else {
+      c = std::int32_t(dec_.decode_bit(m_corrector0_));
+    }
+    return c;
+  }
+
+  ArithmeticDecoder& dec_;
+  std::uint32_t bits_high_, corr_bits_ = 0, corr_range_ = 0, k_ = 0;
+  std::int32_t corr_min_ = 0;
+  std::vector<std::unique_ptr<SymbolModel>> m_bits_, m_corrector_;
+  BitModel m_corrector0_;
+};
+
+class StreamingMedian5 {
+public:
+  void init() {
+    for (std::int32_t& v : values_) v = 0;
+    high_ = true;
+  }
+  void add(std::int32_t v) {
+    if (high_) {
+      if (v < values_[2]) {
+        values_[4] = values_[3];
+        values_[3] = values_[2];
+        if (v < values_[0]) {
+          values_[2] = values_[1];
+          values_[1] = values_[0];
+          values_[0] = v;
+        } else if (v < values_[1]) {
+          values_[2] = values_[1];
+          values_[1] = v;
+        } else {
+          values_[2] = v;
+        }
+      } else {
+        if (v < values_[3]) {
+          values_[4] = values_[3];
+          values_[3] = v;
+        } else {
+          values_[4] = v;
+        }
+        high_ = false;
+      }
+    } else {
+      if (values_[2] < v) {
+        values_[0] = values_[1];
+        values_[1] = values_[2];
+        if (values_[4] < v) {
+          values_[2] = values_[3];
+          values_[3] = values_[4];
+          values_[4] = v;
+        } else if (values_[3] < v) {
+          values_[2] = values_[3];
+          values_[3] = v;
+        } else {
+          values_[2] = v;
+        }
+      } else {
+        if (values_[1] < v) {
+          values_[0] = values_[1];
+          values_[1] = v;
+        } else {
+          values_[0] = v;
+        }
+        high_ = true;
+      }
+    }
+  }
+  std::int32_t get() const { return values_[2]; }
+
+private:
+  std::int32_t values_[5] = {0, 0, 0, 0, 0};
+  bool high_ = true;
+};
+
+inline std::uint8_t fold_u8(std::int32_t n) { return std::uint8_t(n & 0xFF); }
+
+// POINT10 item, version 2: the 20 byte core point record of formats 0-5
+class Point10Decoder {
+public:
+  static const std::size_t kSize = 20;
+
+  explicit Point10Decoder(ArithmeticDecoder& dec)
+      : dec_(dec), m_changed_values_(64), ic_intensity_(dec, 16, 4),
+        ic_point_source_id_(dec, 16), ic_dx_(dec, 32, 2), ic_dy_(dec, 32, 22), ic_z_(dec, 32, 20) {
+    m_scan_angle_rank_[0].reset(new SymbolModel(256));
+    m_scan_angle_rank_[1].reset(new SymbolModel(256));
+  }
+
+  void init(const std::uint8_t* item) {
+    for (int i = 0; i < 16; ++i) {
+      last_x_diff_median5_[i].init();
+      last_y_diff_median5_[i].init();
+      last_intensity_[i] = 0;
+      last_height_[i / 2] = 0;
+    }
+    m_changed_values_.init();
+    ic_intensity_.init();
+    m_scan_angle_rank_[0]->init();
+    m_scan_angle_rank_[1]->init();
+    ic_point_source_id_.init();
+    for (int i = 0; i < 256; ++i) {
+      if (m_bit_byte_[i]) m_bit_byte_[i]->init();
+      if (m_classification_[i]) m_classification_[i]->init();
+      if (m_user_data_[i]) m_user_data_[i]->init();
+    }
+    ic_dx_.init();
+    ic_dy_.init();
+    ic_z_.init();
+    std::memcpy(last_, item, kSize);
+    set_u16(12, 0); // v2 starts from a zero intensity
+  }
+
+  void read(std::uint8_t* item) {
+    std::uint32_t changed = dec_.decode_symbol(m_changed_values_);
+    std::uint32_t r = last_[14] & 7, n = (last_[14] >> 3) & 7;
+    if (changed) {
+      if (changed & 32) {
+        last_[14] = std::uint8_t(dec_.decode_symbol(model(m_bit_byte_, last_[14])));
+        r = last_[14] & 7;
+        n = (last_[14] >> 3) & 7;
+      }
+      std::uint32_t m = kReturnMap[n][r];
+      if (changed & 16) {
+        std::uint16_t intensity = std::uint16_t(ic_intensity_.decompress(last_intensity_[m], m < 3 ? m : 3));
+        set_u16(12, intensity);
+        last_intensity_[m] = intensity;
+      } else {
+        set_u16(12, last_intensity_[m]);
+      }
+      if (changed & 8) last_[15] = std::uint8_t(dec_.decode_symbol(model(m_classification_, last_[15])));
+      if (changed & 4) {
+        std::int32_t val = std::int32_t(dec_.decode_symbol(*m_scan_angle_rank_[(last_[14] >> 6) & 1]));
+        last_[16] = fold_u8(val + last_[16]);
+      }
+      if (changed & 2) last_[17] = std::uint8_t(dec_.decode_symbol(model(m_user_data_, last_[17])));
+      if (changed & 1) set_u16(18, std::uint16_t(ic_point_source_id_.decompress(u16(18))));
+    }
+    std::uint32_t m = kReturnMap[n][r], l = kReturnLevel[n][r];
+
+    std::int32_t median = last_x_diff_median5_[m].get();
+    std::int32_t diff = ic_dx_.decompress(median, n == 1);
+    set_i32(0, add_wrap(i32(0), diff));
+    last_x_diff_median5_[m].add(diff);
+
+    median = last_y_diff_median5_[m].get();
+    std::uint32_t k_bits = ic_dx_.k();
+    diff = ic_dy_.decompress(median, (n == 1) + (k_bits < 20 ? (k_bits & ~1u) : 20));
+    set_i32(4, add_wrap(i32(4), diff));
+    last_y_diff_median5_[m].add(diff);
+
+    k_bits = (ic_dx_.k() + ic_dy_.k()) / 2;
+    std::int32_t z = ic_z_.decompress(last_height_[l], (n == 1) + (k_bits < 18 ? (k_bits & ~1u) : 18));
+    set_i32(8, z);
+    last_height_[l] = z;
+
+    std::memcpy(item, last_, kSize);
+  }
+
+private:
+  static constexpr std::uint8_t kReturnMap[8][8] = {
+      {15, 14, 13, 12, 11, 10, 9, 8}, {14, 0, 1, 3, 6, 10, 10, 9}, {13, 1, 2, 4, 7, 11, 11, 10},
+      {12, 3, 4, 5, 8, 12, 12, 11},   {11, 6, 7, 8, 9, 13, 13, 12}, {10, 10, 11, 12, 13, 14, 14, 13},
+      {9, 10, 11, 12, 13, 14, 15, 14}, {8, 9, 10, 11, 12, 13, 14, 15}};
+  static constexpr std::uint8_t kReturnLevel[8][8] = {
+      {0, 1, 2, 3, 4, 5, 6, 7}, {1, 0, 1, 2, 3, 4, 5, 6}, {2, 1, 0, 1, 2, 3, 4, 5},
+      {3, 2, 1, 0, 1, 2, 3, 4}, {4, 3, 2, 1, 0, 1, 2, 3}, {5, 4, 3, 2, 1, 0, 1, 2},
+      {6, 5, 4, 3, 2, 1, 0, 1}, {7, 6, 5, 4, 3, 2, 1, 0}};
+
+  // per-context byte models are created on first use
+  SymbolModel& model(std::unique_ptr<SymbolModel> (&models)[256], std::uint8_t ctx) {
+    if (!models[ctx]) models[ctx].reset(new SymbolModel(256));
+    return *models[ctx];
+  }
+
+  static std::int32_t add_wrap(std::int32_t a, std::int32_t b) {
+    return std::int32_t(std::uint32_t(a) + std::uint32_t(b));
+  }
+  std::int32_t i32(int off) const {
+    std::int32_t v;
+    std::memcpy(&v, last_ + off, 4);
+    return v;
+  }
+  void set_i32(int off, std::int32_t v) { std::memcpy(last_ + off, &v, 4); }
+  std::uint16_t u16(int off) const {
+    std::uint16_t v;
+    std::memcpy(&v, last_ + off, 2);
+    return v;
+  }
+  void set_u16(int off, std::uint16_t v) { std::memcpy(last_ + off, &v, 2); }
+
+  ArithmeticDecoder& dec_;
+  std::uint8_t last_[kSize];
+  std::uint16_t last_intensity_[16];
+  StreamingMedian5 last_x_diff_median5_[16], last_y_diff_median5_[16];
+  std::int32_t last_height_[8];
+  SymbolModel m_changed_values_;
+  IntegerDecompressor ic_intensity_, ic_point_source_id_;
+  std::unique_ptr<SymbolModel> m_scan_angle_rank_[2];
+  std::unique_ptr<SymbolModel> m_bit_byte_[256], m_classification_[256], m_user_data_[256];
+  IntegerDecompressor ic_dx_, ic_dy_, ic_z_;
+};
+
+constexpr std::uint8_t Point10Decoder::kReturnMap[8][8];
+constexpr std::uint8_t Point10Decoder::kReturnLevel[8][8];
+
+// GPSTIME11 item, version 2: the 8 byte GPS time of formats 1, 3, 4, 5
+class GpsTime11Decoder {
+public:
+  static const std::size_t kSize = 8;
+
+  explicit GpsTime11Decoder(ArithmeticDecoder& dec)
+      : dec_(dec), m_multi_(kMultiTotal), m_0diff_(6), ic_gpstime_(dec, 32, 9) {}
+
+  void init(const std::uint8_t* item) {
+    last_ = next_ = 0;
+    for (int i = 0; i < 4; ++i) {
+      last_diff_[i] = 0;
+      extreme_counter_[i] = 0;
+      last_gpstime_[i] = 0;
+    }
+    m_multi_.init();
+    m_0diff_.init();
+    ic_gpstime_.init();
+    std::memcpy(&last_gpstime_[0], item, kSize);
+  }
+
+  void read(std::uint8_t* item) {
+    decode();
+    std::memcpy(item, &last_gpstime_[last_], kSize);
+  }
+
+private:
+  static const std::int32_t kMulti = 500, kMultiMinus = -10;
+  static const std::int32_t kMultiUnchanged = kMulti - kMultiMinus + 1;
+  static const std::int32_t kMultiCodeFull = kMulti - kMultiMinus + 2;
+  static const std::int32_t kMultiTotal = kMulti - kMultiMinus + 6;
+
+  static std::int32_t mul(std::int32_t a, std::int32_t b) {
+    return std::int32_t(std::uint32_t(a) * std::uint32_t(b));
+  }
+
+  void full_time() {
+    next_ = (next_ + 1) & 3;
+    std::uint64_t hi = std::uint32_t(ic_gpstime_.decompress(std::int32_t(last_gpstime_[last_] >> 32), 8));
+    last_gpstime_[next_] = (hi << 32) | dec_.read_int();
+    last_ = next_;
+    last_diff_[last_] = 0;
+    extreme_counter_[last_] = 0;
+  }
+
+  void extreme(std::int32_t diff) {
+    if (++extreme_counter_[last_] > 3) {
+      last_diff_[last_] = diff;
+      extreme_counter_[last_] = 0;
+    }
+  }
+
+  void decode() {
+    for (;;) {
+      if (last_diff_[last_] == 0) {
+        std::int32_t multi = std::int32_t(dec_.decode_symbol(m_0diff_));
+        if (multi == 1) {
+          last_diff_[last_] = ic_gpstime_.decompress(0, 0);
+          last_gpstime_[last_] += std::uint64_t(std::int64_t(last_diff_[last_]));
+          extreme_counter_[last_] = 0;
+        } else if (multi == 2) {
+          full_time();
+        } else if (multi > 2) {
+          // switch to another time sequence and decode again
+          last_ = (last_ + std::uint32_t(multi) - 2) & 3;
+          continue;
+        }
+        return;
+      }
+      std::int32_t multi = std::int32_t(dec_.decode_symbol(m_multi_));
+      if (multi == 1) {
+        last_gpstime_[last_] +=
+            std::uint64_t(std::int64_t(ic_gpstime_.decompress(last_diff_[last_], 1)));
+        extreme_counter_[last_] = 0;
+      } else if (multi < kMultiUnchanged) {
+        std::int32_t diff;
+        if (multi == 0) {
+          diff = ic_gpstime_.decompress(0, 7);
+          extreme(diff);
+        } else if (multi < kMulti) {
+          diff = ic_gpstime_.decompress(mul(multi, last_diff_[last_]), multi < 10 ? 2 : 3);
+        } else if (multi == kMulti) {
+          diff = ic_gpstime_.decompress(mul(kMulti, last_diff_[last_]), 4);
+          extreme(diff);
+        } else {
+          multi = kMulti - multi;
+          if (multi > kMultiMinus) {
+            diff = ic_gpstime_.decompress(mul(multi, last_diff_[last_]), 5);
+          } else {
+            diff = ic_gpstime_.decompress(mul(kMultiMinus, last_diff_[last_]), 6);
+            extreme(diff);
+          }
+        }
+        last_gpstime_[last_] += std::uint64_t(std::int64_t(diff));
+      } else if (multi == kMultiCodeFull) {
+        full_time();
+      } else if (multi > kMultiCodeFull) {
+        last_ = (last_ + std::uint32_t(multi - kMultiCodeFull)) & 3;
+        continue;
+      }
+      return;
+    }
+  }
+
+  ArithmeticDecoder& dec_;
+  SymbolModel m_multi_, m_0diff_;
+  IntegerDecompressor ic_gpstime_;
+  std::uint32_t last_ = 0, next_ = 0;
+  std::int32_t last_diff_[4];
+  std::int32_t extreme_counter_[4];
+  std::uint64_t last_gpstime_[4];
+};
+
+} // namespace laz
+} // namespace tch
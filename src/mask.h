@@ -0,0 +1,44 @@
+// Predicate masking of point heights in place.
+//
+// A point matches a rule when its attribute equals the rule's value (R
+// logicals and integers as 0/1/NA, NA never matches). Matching points
+// get their Z overwritten in the buffer that feeds the rasterizer, so the
+// masked heights are what the CHM is built from and no copy of the point
+// table is made.
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace tch {
+
+struct MaskRule {
+  const double* real = nullptr;      // double attribute, or
+  const std::int32_t* int32 = nullptr; // integer/logical attribute
+  double value = 0;
+};
+
+// z[i] = fill for every point matching any rule; returns how many matched
+inline std::size_t mask_heights(double* z, std::size_t n, const std::vector<MaskRule>& rules,
+                                double fill, ThreadPool& pool) {
+  std::atomic<std::size_t> masked{0};
+  parallel_for(pool, n, 65536, [&](std::size_t b, std::size_t e) {
+    std::size_t cnt = 0;
+    for (std::size_t i = b; i < e; ++i) {
+      bool hit = false;
+      for (const MaskRule& r : rules)
+        hit |= r.real ? r.real[i] == r.value : (r.int32[i] != INT32_MIN && r.int32[i] == r.value);
+      z[i] = hit ? fill : z[i];
+      cnt += hit;
+    }
+    masked += cnt;
+  });
+  return masked;
+}
+
+} // namespace tch
@@ -0,0 +1,265 @@
+// Counters and stage timers of the native stages, for runs outside the Rmd.
+//
+// The stages add to a fixed set of process-wide counters (points read,
+// classified as ground, planar or building, k-NN queries, stage cache hits
+// and writes, bytes rasterized) and time themselves with a StageTimer. A
+// counter is one relaxed atomic add per call or per parallel block, never
+// per point, and a timer two clock reads, so they stay on in production.
+// The native allocations (operator new of tch_native.cpp) are counted
+// with one add per allocation.
+// With tracing switched on every timed stage is also recorded as a span;
+// metrics_prometheus() and metrics_chrome_trace() export the state as
+// Prometheus text exposition and as a Chrome trace (chrome://tracing,
+// Perfetto). Compiling with TCH_NO_METRICS turns all of it into no-ops.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tch {
+
+enum class Counter {
+  PointsRead,
+  PointsGround,
+  PointsPlanar,
+  PointsBuilding,
+  KnnQueries,
+  CacheHits,
+  CacheWrites,
+  BytesRasterized,
+  NativeAllocs,
+  NativeAllocBytes,
+  kCount
+};
+
+enum class TimedStage { Read, Csf, Knn, ShpPlane, PointMetrics, Knnidw, Normalize, Rasterize, kCount };
+
+const int kCounters = int(Counter::kCount);
+const int kTimedStages = int(TimedStage::kCount);
+
+inline const char* counter_name(Counter c) {
+  static const char* names[kCounters] = {"points_read",  "points_ground", "points_planar",
+                                         "points_building", "knn_queries", "cache_hits",
+                                         "cache_writes", "bytes_rasterized", "native_allocs",
+                                         "native_alloc_bytes"};
+  return names[int(c)];
+}
+
+inline const char* counter_help(Counter c) {
+  static const char* help[kCounters] = {
+      "Points decoded from LAS/LAZ files.",
+      "Points classified as ground by CSF.",
+      "Points classified as planar by shp_plane.",
+      "Points labelled as building by their planar neighbours.",
+      "k-NN queries (neighbour lists and knnidw interpolations).",
+      "Stage cache files found and mapped.",
+      "Stage cache files written after a miss.",
+      "Bytes of point coordinates rasterized.",
+      "Allocations made by operator new in the native code.",
+      "Bytes requested from operator new by the native code."};
+  return help[int(c)];
+}
+
+inline const char* stage_label(TimedStage s) {
+  static const char* names[kTimedStages] = {"read", "csf", "knn", "shp_plane", "point_metrics",
+                                            "knnidw", "normalize", "rasterize"};
+  return names[int(s)];
+}
+
+namespace detail {
+
+struct TraceEvent {
+  TimedStage stage;
+  int tid;
+  std::int64_t begin_us, dur_us;
+  std::uint64_t counters[kCounters]; // values at the end of the span
+};
+
+struct Metrics {
+  std::atomic<std::uint64_t> counters[kCounters];
+  std::atomic<std::uint64_t> calls[kTimedStages];
+  std::atomic<std::int64_t> nanos[kTimedStages];
+  std::atomic<bool> tracing{false};
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  std::mutex m;
+  std::vector<TraceEvent> events;
+  std::size_t dropped = 0;
+
+  Metrics() { reset(); }
+  void reset() {
+    for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+    for (auto& c : calls) c.store(0, std::memory_order_relaxed);
+    for (auto& c : nanos) c.store(0, std::memory_order_relaxed);
+  }
+};
+
+inline Metrics& metrics() {
+  static Metrics m;
+  return m;
+}
+
+// small id of the calling thread, for the trace
+inline int trace_tid() {
+  static std::atomic<int> next{0};
+  thread_local int id = next.fetch_add(1, std::memory_order_relaxed);
+  return id;
+}
+
+// bound on the recorded spans, so a forgotten trace cannot eat the memory
+const std::size_t kMaxTraceEvents = std::size_t(1) << 20;
+
+} // namespace detail
+
+inline void count(Counter c, std::uint64_t n) {
+#ifndef TCH_NO_METRICS
+  detail::metrics().counters[int(c)].fetch_add(n, std::memory_order_relaxed);
+#else
+  (void)c;
+  (void)n;
+#endif
+}
+
+inline std::uint64_t counter_value(Counter c) {
+  return detail::metrics().counters[int(c)].load(std::memory_order_relaxed);
+}
+
+// calls and total seconds of a stage
+inline std::uint64_t stage_calls(TimedStage s) {
+  return detail::metrics().calls[int(s)].load(std::memory_order_relaxed);
+}
+inline double stage_seconds(TimedStage s) {
+  return double(detail::metrics().nanos[int(s)].load(std::memory_order_relaxed)) * 1e-9;
+}
+
+// record spans from now on (and keep the ones recorded so far)
+inline void set_tracing(bool on) { detail::metrics().tracing.store(on, std::memory_order_relaxed); }
+
+// zero the counters and timers and drop the recorded spans
+inline void reset_metrics() {
+  detail::Metrics& m = detail::metrics();
+  m.reset();
+  std::lock_guard<std::mutex> lk(m.m);
+  m.events.clear();
+  m.dropped = 0;
+}
+
+// times the enclosing scope as one call of stage
+class StageTimer {
+public:
+  explicit StageTimer(TimedStage stage) : stage_(stage) {
+#ifndef TCH_NO_METRICS
+    begin_ = std::chrono::steady_clock::now();
+#endif
+  }
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+  ~StageTimer() {
+#ifndef TCH_NO_METRICS
+    using namespace std::chrono;
+    steady_clock::time_point end = steady_clock::now();
+    detail::Metrics& m = detail::metrics();
+    std::int64_t ns = duration_cast<nanoseconds>(end - begin_).count();
+    m.calls[int(stage_)].fetch_add(1, std::memory_order_relaxed);
+    m.nanos[int(stage_)].fetch_add(ns, std::memory_order_relaxed);
+    if (!m.tracing.load(std::memory_order_relaxed)) return;
+    detail::TraceEvent e;
+    e.stage = stage_;
+    e.tid = detail::trace_tid();
+    e.begin_us = duration_cast<microseconds>(begin_ - m.epoch).count();
+    e.dur_us = duration_cast<microseconds>(end - begin_).count();
+    for (int c = 0; c < kCounters; ++c) e.counters[c] = m.counters[c].load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(m.m);
+    if (m.events.size() < detail::kMaxTraceEvents) m.events.push_back(e);
+    else ++m.dropped;
+#endif
+  }
+
+private:
+  TimedStage stage_;
+  std::chrono::steady_clock::time_point begin_;
+};
+
+// Prometheus text exposition of the counters and stage timers; labels
+// (e.g. tile="419500_5853000") are added to every sample
+inline std::string metrics_prometheus(const std::string& labels = std::string()) {
+  std::string out;
+  char buf[256];
+  std::string l = labels.empty() ? std::string() : "{" + labels + "}";
+  std::string lc = labels.empty() ? std::string() : "," + labels;
+  for (int c = 0; c < kCounters; ++c) {
+    std::string name = std::string("tch_") + counter_name(Counter(c)) + "_total";
+    out += "# HELP " + name + " " + counter_help(Counter(c)) + "\n";
+    out += "# TYPE " + name + " counter\n";
+    std::snprintf(buf, sizeof buf, " %llu\n", (unsigned long long)counter_value(Counter(c)));
+    out += name + l + buf;
+  }
+  out += "# HELP tch_stage_calls_total Calls of the native stages.\n";
+  out += "# TYPE tch_stage_calls_total counter\n";
+  for (int s = 0; s < kTimedStages; ++s) {
+    std::snprintf(buf, sizeof buf, "tch_stage_calls_total{stage=\"%s\"%s} %llu\n",
+                  stage_label(TimedStage(s)), lc.c_str(), (unsigned long long)stage_calls(TimedStage(s)));
+    out += buf;
+  }
+  out += "# HELP tch_stage_seconds_total Wall-clock seconds spent in the native stages.\n";
+  out += "# TYPE tch_stage_seconds_total counter\n";
+  for (int s = 0; s < kTimedStages; ++s) {
+    std::snprintf(buf, sizeof buf, "tch_stage_seconds_total{stage=\"%s\"%s} %.9g\n",
+                  stage_label(TimedStage(s)), lc.c_str(), stage_seconds(TimedStage(s)));
+    out += buf;
+  }
+  return out;
+}
+
+// The recorded spans as a Chrome trace (JSON object format): one complete
+// ("X") event per span and a counter ("C") event with the counters at its
+// end. name is the process name shown by the viewer.
+inline std::string metrics_chrome_trace(const std::string& name = "tch") {
+  detail::Metrics& m = detail::metrics();
+  std::vector<detail::TraceEvent> events;
+  std::size_t dropped;
+  {
+    std::lock_guard<std::mutex> lk(m.m);
+    events = m.events;
+    dropped = m.dropped;
+  }
+  std::string esc;
+  for (char ch : name) {
+    if (ch == '"' || ch == '\\') esc += '\\';
+    if (static_cast<unsigned char>(ch) >= 0x20) esc += ch;
+  }
+  std::string out = "{\"traceEvents\":[";
+  char buf[512];
+  std::snprintf(buf, sizeof buf,
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+                esc.c_str());
+  out += buf;
+  for (const detail::TraceEvent& e : events) {
+    std::snprintf(buf, sizeof buf,
+                  ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                  "\"ts\":%lld,\"dur\":%lld}",
+                  stage_label(e.stage), e.tid, (long long)e.begin_us, (long long)e.dur_us);
+    out += buf;
+    std::snprintf(buf, sizeof buf, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"args\":{",
+                  e.tid, (long long)(e.begin_us + e.dur_us));
+    out += buf;
+    for (int c = 0; c < kCounters; ++c) {
+      std::snprintf(buf, sizeof buf, "%s\"%s\":%llu", c ? "," : "", counter_name(Counter(c)),
+                    (unsigned long long)e.counters[c]);
+      out += buf;
+    }
+    out += "}}";
+  }
+  std::snprintf(buf, sizeof buf, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n",
+                (unsigned long long)dropped);
+  out += buf;
+  return out;
+}
+
+} // namespace tch
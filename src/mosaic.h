@@ -0,0 +1,227 @@
+// Disk-backed raster mosaic for regions larger than memory.
+//
+// The mosaic is a grid of block x block cell blocks stored in a scratch
+// file; only the blocks a tile overlaps are read, merged and written back,
+// so building it needs memory for one tile, not for the region. Tiles are
+// merged with the max reducer of rasterize(), so a cell on a seam gets the
+// value a single rasterize() over the union of the tiles would give it.
+// Blocks are locked individually: tiles merged concurrently only wait for
+// each other where they overlap.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "grid.h"
+#include "rasterize.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+class Mosaic {
+public:
+  static const int kBlock = 256;
+
+  // spec is the grid of the whole region; path the scratch file, removed
+  // again when the mosaic is destroyed
+  Mosaic(const GridSpec& spec, const std::string& path)
+      : spec_(spec), path_(path), nbx_((spec.ncol + kBlock - 1) / kBlock),
+        nby_((spec.nrow + kBlock - 1) / kBlock), written_(std::size_t(nbx_) * nby_, 0),
+        locks_(std::size_t(nbx_) * nby_) {
+    if (spec.ncol < 1 || spec.nrow < 1) throw std::invalid_argument("empty mosaic");
+    file_.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_) throw std::runtime_error("cannot create '" + path + "'");
+  }
+
+  ~Mosaic() {
+    file_.close();
+    std::remove(path_.c_str());
+  }
+
+  Mosaic(const Mosaic&) = delete;
+  Mosaic& operator=(const Mosaic&) = delete;
+
+  const GridSpec& spec() const { return spec_; }
+  int nblocks_x() const { return nbx_; }
+  int nblocks_y() const { return nby_; }
+
+  // Cells of block (by, bx), row-major kBlock x kBlock; NaN where nothing
+  // was merged and beyond the edge of the grid.
+  void read_block(int by, int bx, float* out) const {
+    std::size_t b = std::size_t(by) * nbx_ + bx;
+    std::lock_guard<std::mutex> lock(locks_[b]);
+    load(b, out);
+  }
+
+  // Replace block (by, bx) by cells (row-major kBlock x kBlock).
+  void write_block(int by, int bx, const float* cells) {
+    std::size_t b = std::size_t(by) * nbx_ + bx;
+    std::lock_guard<std::mutex> lock(locks_[b]);
+    store(b, cells);
+  }
+
+  // Max-merge a grid whose cells coincide with cells of the mosaic (same
+  // res, origin offset by whole cells, see cells_covering()).
+  void merge_max(const Grid<float>& g, ThreadPool& pool) {
+    const GridSpec& s = g.spec;
+    double fc = (s.xmin - spec_.xmin) / spec_.res, fr = (spec_.ymax() - s.ymax()) / spec_.res;
+    int col0 = int(std::lround(fc)), row0 = int(std::lround(fr));
+    if (std::fabs(s.res - spec_.res) > 1e-9 * spec_.res)
+      throw std::invalid_argument("grid res " + std::to_string(s.res) + " is not the mosaic's " +
+                                  std::to_string(spec_.res));
+    if (std::fabs(fc - col0) > 1e-6 || std::fabs(fr - row0) > 1e-6)
+      throw std::invalid_argument("grid is not aligned with the mosaic");
+    if (col0 < 0 || row0 < 0 || col0 + s.ncol > spec_.ncol || row0 + s.nrow > spec_.nrow)
+      throw std::invalid_argument("grid lies outside the mosaic");
+    int bx0 = col0 / kBlock, bx1 = (col0 + s.ncol - 1) / kBlock;
+    int by0 = row0 / kBlock, by1 = (row0 + s.nrow - 1) / kBlock;
+    std::size_t nbx = std::size_t(bx1 - bx0 + 1), nblocks = nbx * std::size_t(by1 - by0 + 1);
+    parallel_for(pool, nblocks, 1, [&](std::size_t first, std::size_t last) {
+      std::vector<float> cells(std::size_t(kBlock) * kBlock);
+      for (std::size_t k = first; k < last; ++k) {
+        int by = by0 + int(k / nbx), bx = bx0 + int(k % nbx);
+        std::size_t b = std::size_t(by) * nbx_ + bx;
+        int r0 = std::max(row0, by * kBlock), r1 = std::min(row0 + s.nrow, (by + 1) * kBlock);
+        int c0 = std::max(col0, bx * kBlock), c1 = std::min(col0 + s.ncol, (bx + 1) * kBlock);
+        std::lock_guard<std::mutex> lock(locks_[b]);
+        load(b, cells.data());
+        bool any = false;
+        for (int r = r0; r < r1; ++r) {
+          float* dst = cells.data() + std::size_t(r - by * kBlock) * kBlock;
+          const float* src = g.values.data() + std::size_t(r - row0) * s.ncol;
+          for (int c = c0; c < c1; ++c) {
+            float v = src[c - col0];
+            float& d = dst[c - bx * kBlock];
+            if (std::isnan(v)) continue;
+            if (std::isnan(d) || v > d) d = v;
+            any = true;
+          }
+        }
+        if (any) store(b, cells.data());
+      }
+    });
+  }
+
+  // Bin points into the mosaic with the max reducer; points outside it
+  // are ignored.
+  void add_points(const double* x, const double* y, const double* z, std::size_t n,
+                  ThreadPool& pool) {
+    GridSpec s;
+    if (!cells_covering(x, y, n, s)) return;
+    merge_max(rasterize(x, y, z, n, s, Reducer::Max, 0.95, &pool), pool);
+  }
+
+  // Smallest sub-grid of the mosaic holding the cells of all points inside
+  // it; false if there are none. A point on a cell edge lands in the same
+  // cell of the sub-grid as of the mosaic.
+  bool cells_covering(const double* x, const double* y, std::size_t n, GridSpec& out) const {
+    int c0 = spec_.ncol, c1 = -1, r0 = spec_.nrow, r1 = -1;
+    for (std::size_t i = 0; i < n; ++i) {
+      if (std::isnan(x[i]) || std::isnan(y[i]) || !spec_.contains(x[i], y[i])) continue;
+      int c = spec_.col_of(x[i]), r = spec_.row_of(y[i]);
+      c0 = std::min(c0, c); c1 = std::max(c1, c);
+      r0 = std::min(r0, r); r1 = std::max(r1, r);
+    }
+    if (c1 < 0) return false;
+    out.res = spec_.res;
+    out.xmin = spec_.xmin + c0 * spec_.res;
+    out.ymin = spec_.ymax() - (r1 + 1) * spec_.res;
+    out.ncol = c1 - c0 + 1;
+    out.nrow = r1 - r0 + 1;
+    return true;
+  }
+
+  // Mosaic at twice the cell size: the mean of the non-NaN cells of every
+  // 2 x 2 group (overview level of a COG). Stored next to this one.
+  std::unique_ptr<Mosaic> downsample(ThreadPool& pool) const {
+    GridSpec s;
+    s.res = 2 * spec_.res;
+    s.xmin = spec_.xmin;
+    s.ncol = (spec_.ncol + 1) / 2;
+    s.nrow = (spec_.nrow + 1) / 2;
+    s.ymin = spec_.ymax() - s.nrow * s.res;
+    std::unique_ptr<Mosaic> out(new Mosaic(s, path_ + ".ovr"));
+    std::size_t nblocks = std::size_t(out->nbx_) * out->nby_;
+    parallel_for(pool, nblocks, 1, [&](std::size_t first, std::size_t last) {
+      const std::size_t bs = kBlock;
+      std::vector<float> src(bs * bs), dst(bs * bs);
+      for (std::size_t k = first; k < last; ++k) {
+        int by = int(k / out->nbx_), bx = int(k % out->nbx_);
+        bool any = false;
+        for (int q = 0; q < 4; ++q) {
+          int sy = 2 * by + q / 2, sx = 2 * bx + q % 2;
+          std::size_t oy = std::size_t(q / 2) * bs / 2, ox = std::size_t(q % 2) * bs / 2;
+          bool have = sy < nby_ && sx < nbx_ && written_[std::size_t(sy) * nbx_ + sx];
+          if (have) read_block(sy, sx, src.data());
+          for (std::size_t r = 0; r < bs / 2; ++r)
+            for (std::size_t c = 0; c < bs / 2; ++c) {
+              float m = std::numeric_limits<float>::quiet_NaN();
+              if (have) {
+                const float* p = &src[2 * r * bs + 2 * c];
+                float sum = 0;
+                int cnt = 0;
+                for (float v : {p[0], p[1], p[bs], p[bs + 1]})
+                  if (!std::isnan(v)) {
+                    sum += v;
+                    ++cnt;
+                  }
+                if (cnt) {
+                  m = sum / cnt;
+                  any = true;
+                }
+              }
+              dst[(oy + r) * bs + ox + c] = m;
+            }
+        }
+        if (any) {
+          std::lock_guard<std::mutex> lock(out->locks_[k]);
+          out->store(k, dst.data());
+        }
+      }
+    });
+    return out;
+  }
+
+private:
+  static std::uint64_t block_bytes() { return std::uint64_t(kBlock) * kBlock * sizeof(float); }
+
+  // callers hold the block's lock
+  void load(std::size_t b, float* out) const {
+    if (!written_[b]) {
+      std::fill(out, out + std::size_t(kBlock) * kBlock, std::numeric_limits<float>::quiet_NaN());
+      return;
+    }
+    std::lock_guard<std::mutex> io(io_);
+    file_.seekg(std::streamoff(b * block_bytes()));
+    file_.read(reinterpret_cast<char*>(out), std::streamsize(block_bytes()));
+    if (!file_) throw std::runtime_error("cannot read '" + path_ + "'");
+  }
+
+  void store(std::size_t b, const float* cells) {
+    std::lock_guard<std::mutex> io(io_);
+    file_.seekp(std::streamoff(b * block_bytes()));
+    file_.write(reinterpret_cast<const char*>(cells), std::streamsize(block_bytes()));
+    if (!file_) throw std::runtime_error("cannot write '" + path_ + "'");
+    written_[b] = 1;
+  }
+
+  GridSpec spec_;
+  std::string path_;
+  int nbx_, nby_;
+  std::vector<char> written_;
+  mutable std::vector<std::mutex> locks_;
+  mutable std::mutex io_;
+  mutable std::fstream file_;
+};
+
+} // namespace tch
@@ -0,0 +1,47 @@
+// Neighbourhood statistics over a cached k-NN adjacency.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "knn.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+const std::int32_t kNaFlag = INT32_MIN; // R's NA for logical/integer
+
+// Share of each point's neighbours whose flag is set (R logical: 0, 1 or
+// NA) into frac, and frac >= threshold into label (0/1). Like
+// mean(planar) in R, a neighbourhood containing an NA flag yields NA
+// (NaN / kNaFlag). Rows of nb are the points 0..n-1.
+inline void neighbour_fraction(const Neighbours& nb, const std::int32_t* flag, double threshold,
+                               double* frac, std::int32_t* label, ThreadPool& pool) {
+  StageTimer timer(TimedStage::PointMetrics);
+  parallel_for(pool, nb.size(), 8192, [&](std::size_t b, std::size_t e) {
+    std::uint64_t labelled = 0;
+    for (std::size_t r = b; r < e; ++r) {
+      const std::uint32_t* nbr = nb.begin(r);
+      std::size_t cnt = nb.count(r);
+      std::size_t set = 0;
+      bool na = cnt == 0;
+      for (std::size_t j = 0; j < cnt; ++j) {
+        std::int32_t f = flag[nbr[j]];
+        na |= f == kNaFlag;
+        set += f == 1;
+      }
+      // compared in double, the way R compares mean(planar) < threshold
+      double v = na ? std::numeric_limits<double>::quiet_NaN() : double(set) / double(cnt);
+      std::size_t i = nb.rows[r];
+      if (frac) frac[i] = v;
+      bool set_label = !na && !(v < threshold);
+      labelled += set_label;
+      if (label) label[i] = na ? kNaFlag : (set_label ? 1 : 0);
+    }
+    count(Counter::PointsBuilding, labelled);
+  });
+}
+
+} // namespace tch
@@ -0,0 +1,201 @@
+// Height normalization against a DTM raster (fast path for
+// lidR::normalize_height(las, knnidw())).
+//
+// Instead of interpolating the ground elevation under every point from
+// its k nearest ground points, the same inverse distance weighting is
+// evaluated once per DTM cell centre and the points subtract the bilinear
+// interpolation of the DTM. At 1 m that is a few hundred thousand IDW
+// queries for a tile of millions of points. The deviation from the exact
+// per-point knnidw is measured on a sample of points, so the accuracy
+// given up for the speed is known for every run.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "grid.h"
+#include "knn.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct IdwParams {
+  int k = 10;
+  double p = 2;
+  double rmax = 50;
+};
+
+// lidR's knnidw over a set of ground points: the inverse distance^p
+// weighted mean of the k nearest ground points within rmax in XY; a
+// query on a ground point returns its elevation, a query without ground
+// points within rmax NaN.
+class GroundIdw {
+public:
+  GroundIdw() = default;
+  template <class A>
+  GroundIdw(A x, A y, const double* z, const std::uint32_t* ground, std::size_t nground,
+            std::size_t n, const IdwParams& p) {
+    KdScratch s;
+    rebuild(x, y, z, ground, nground, n, p, s);
+  }
+
+  // the same for another cloud, reusing the tree's storage; x and y may
+  // be quantized columns, the tree holds their converted doubles
+  template <class A>
+  void rebuild(A x, A y, const double* z, const std::uint32_t* ground, std::size_t nground,
+               std::size_t n, const IdwParams& p, KdScratch& s) {
+    if (p.k < 1) throw std::invalid_argument("k must be >= 1");
+    if (nground == 0) throw std::invalid_argument("no ground points to interpolate from");
+    z_ = z;
+    p_ = p;
+    const A coords[2] = {x, y};
+    tree_.rebuild(coords, n, ground, nground, s);
+  }
+
+  int k() const { return p_.k; }
+  const KdTree<2>& tree() const { return tree_; }
+
+  // idx and d2 are scratch buffers of k() elements
+  double at(double x, double y, std::uint32_t* idx, double* d2) const {
+    const double q[2] = {x, y};
+    int found = tree_.knn(q, p_.k, idx, d2);
+    double sw = 0, szw = 0;
+    for (int j = 0; j < found; ++j) {
+      double d = std::sqrt(d2[j]);
+      if (d > p_.rmax) break; // closest first
+      if (d == 0) return z_[idx[j]];
+      double w = 1 / std::pow(d, p_.p);
+      sw += w;
+      szw += w * z_[idx[j]];
+    }
+    return sw > 0 ? szw / sw : std::numeric_limits<double>::quiet_NaN();
+  }
+
+private:
+  KdTree<2> tree_;
+  const double* z_ = nullptr;
+  IdwParams p_;
+};
+
+// The IDW ground elevation at the centres of the cells [r0, r1) x [c0, c1)
+// of dtm, e.g. those of one chunk interpolated from the chunk's ground
+// points; the other cells are left as they are
+inline void idw_dtm_window(Grid<double>& dtm, const GroundIdw& idw, int r0, int r1, int c0, int c1,
+                           ThreadPool& pool) {
+  StageTimer timer(TimedStage::Knnidw);
+  if (r1 <= r0 || c1 <= c0) return;
+  count(Counter::KnnQueries, std::size_t(r1 - r0) * std::size_t(c1 - c0));
+  const GridSpec& spec = dtm.spec;
+  parallel_for(pool, std::size_t(r1 - r0), 8, [&](std::size_t b, std::size_t e) {
+    std::vector<std::uint32_t> idx(idw.k());
+    std::vector<double> d2(idw.k());
+    for (std::size_t r = r0 + b; r < r0 + e; ++r) {
+      double y = spec.ymax() - (double(r) + 0.5) * spec.res;
+      for (int c = c0; c < c1; ++c)
+        dtm.at(int(r), c) = idw.at(spec.xmin + (c + 0.5) * spec.res, y, idx.data(), d2.data());
+    }
+  });
+}
+
+// DTM with the IDW ground elevation at every cell centre, into dtm (its
+// values are reused)
+inline void idw_dtm_into(Grid<double>& dtm, const GroundIdw& idw, const GridSpec& spec, ThreadPool& pool) {
+  dtm.spec = spec;
+  dtm.values.assign(spec.size(), std::numeric_limits<double>::quiet_NaN());
+  idw_dtm_window(dtm, idw, 0, spec.nrow, 0, spec.ncol, pool);
+}
+
+inline Grid<double> idw_dtm(const GroundIdw& idw, const GridSpec& spec, ThreadPool& pool) {
+  Grid<double> dtm;
+  idw_dtm_into(dtm, idw, spec, pool);
+  return dtm;
+}
+
+// bilinear interpolation between the cell centres, held constant beyond
+// the outer centres. NaN cells (no ground within rmax of their centre)
+// are left out and the weights of the others renormalized, so an empty
+// cell does not spread to the points around it; NaN only when all four
+// are NaN.
+inline double dtm_height(const Grid<double>& dtm, double x, double y) {
+  const GridSpec& s = dtm.spec;
+  double fc = (x - s.xmin) / s.res - 0.5, fr = (s.ymax() - y) / s.res - 0.5;
+  fc = std::min(std::max(fc, 0.0), double(s.ncol - 1));
+  fr = std::min(std::max(fr, 0.0), double(s.nrow - 1));
+  int c0 = std::min(int(fc), s.ncol - 1), r0 = std::min(int(fr), s.nrow - 1);
+  int c1 = std::min(c0 + 1, s.ncol - 1), r1 = std::min(r0 + 1, s.nrow - 1);
+  double tx = fc - c0, ty = fr - r0;
+  double v00 = dtm.at(r0, c0), v01 = dtm.at(r0, c1), v10 = dtm.at(r1, c0), v11 = dtm.at(r1, c1);
+  if (!std::isnan(v00 + v01 + v10 + v11)) {
+    double top = v00 * (1 - tx) + v01 * tx;
+    double bottom = v10 * (1 - tx) + v11 * tx;
+    return top * (1 - ty) + bottom * ty;
+  }
+  const double v[4] = {v00, v01, v10, v11};
+  const double w[4] = {(1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty};
+  double sw = 0, szw = 0;
+  for (int j = 0; j < 4; ++j)
+    if (!std::isnan(v[j])) {
+      sw += w[j];
+      szw += w[j] * v[j];
+    }
+  return sw > 0 ? szw / sw : std::numeric_limits<double>::quiet_NaN();
+}
+
+// z[i] -= DTM height under (x[i], y[i]), in place
+template <class X, class Y>
+void subtract_dtm(const Grid<double>& dtm, X x, Y y, double* z, std::size_t n, ThreadPool& pool) {
+  StageTimer timer(TimedStage::Normalize);
+  parallel_for(pool, n, 65536, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) z[i] -= dtm_height(dtm, x[i], y[i]);
+  });
+}
+
+// deviation of the DTM ground elevation from the exact knnidw one
+struct DtmError {
+  std::size_t n = 0; // points compared
+  double max_abs = 0, mean_abs = 0, rmse = 0, q99 = 0;
+};
+
+// compares nsample points spread evenly over the n points (in file order)
+inline DtmError dtm_error(const Grid<double>& dtm, const GroundIdw& idw, const double* x,
+                          const double* y, std::size_t n, std::size_t nsample, ThreadPool& pool) {
+  DtmError err;
+  nsample = std::min(nsample, n);
+  if (nsample == 0) return err;
+  StageTimer timer(TimedStage::Knnidw);
+  count(Counter::KnnQueries, nsample);
+  std::vector<double> diff(nsample, std::numeric_limits<double>::quiet_NaN());
+  parallel_for(pool, nsample, 256, [&](std::size_t b, std::size_t e) {
+    std::vector<std::uint32_t> idx(idw.k());
+    std::vector<double> d2(idw.k());
+    for (std::size_t j = b; j < e; ++j) {
+      std::size_t i = std::size_t(double(j) * double(n) / double(nsample));
+      if (std::isnan(x[i]) || std::isnan(y[i])) continue;
+      diff[j] = std::fabs(dtm_height(dtm, x[i], y[i]) - idw.at(x[i], y[i], idx.data(), d2.data()));
+    }
+  });
+  diff.erase(std::remove_if(diff.begin(), diff.end(), [](double d) { return std::isnan(d); }),
+             diff.end());
+  err.n = diff.size();
+  if (diff.empty()) return err;
+  double sum = 0, sum2 = 0;
+  for (double d : diff) {
+    err.max_abs = std::max(err.max_abs, d);
+    sum += d;
+    sum2 += d * d;
+  }
+  err.mean_abs = sum / diff.size();
+  err.rmse = std::sqrt(sum2 / diff.size());
+  std::size_t q = std::min(diff.size() - 1, std::size_t(std::ceil(0.99 * diff.size())) - 1);
+  std::nth_element(diff.begin(), diff.begin() + q, diff.end());
+  err.q99 = diff[q];
+  return err;
+}
+
+} // namespace tch
@@ -0,0 +1,313 @@
+// Octree level of detail (LOD) files for viewing large point clouds.
+//
+// Points are sorted into an octree of nested samples, as in Potree: a
+// node keeps at most one point per cell of a grid^3 lattice over its cube
+// (the point with the smallest hash of its index, so the sample is spread
+// evenly) and passes the other points on to its children. Nodes with at
+// most leaf_size points keep all of them. A node together with its
+// ancestors is therefore a subsample of the cloud at a spacing of
+// cube / grid. Nodes are numbered breadth first and written as the chunks
+// of a point file (point_file.h) in that order, with the node table in
+// path + ".nodes", so a viewer decodes only the nodes it shows.
+//
+// select_nodes() picks the nodes for a view: nodes outside the view
+// frustum are culled, and the others are taken largest on screen first
+// until the point budget is spent or their spacing drops below a pixel.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.h"
+#include "point_file.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct OctreeNode {
+  double x0 = 0, y0 = 0, z0 = 0, size = 0; // cube
+  std::int32_t level = 0, parent = -1;
+  std::int32_t child[8] = {-1, -1, -1, -1, -1, -1, -1, -1}; // by octant x | y << 1 | z << 2
+  std::uint64_t count = 0;
+};
+
+struct OctreeParams {
+  int grid = 128;              // sample cells per cube side
+  std::size_t leaf_size = 20000;
+  int max_level = 20;          // deeper nodes keep all points (duplicates)
+};
+
+struct Octree {
+  int grid = 128;
+  std::vector<OctreeNode> nodes;   // breadth first
+  std::vector<std::uint32_t> order; // points of node k are order[start[k] .. start[k + 1])
+  std::vector<std::size_t> start;
+};
+
+namespace detail {
+
+inline std::uint32_t point_hash(std::uint32_t i) {
+  std::uint64_t h = std::uint64_t(i) * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  return std::uint32_t(h >> 32);
+}
+
+} // namespace detail
+
+// Octree of the points with coordinates (NaN points are left out).
+inline Octree build_octree(const double* x, const double* y, const double* z, std::size_t n,
+                           const OctreeParams& p, ThreadPool& pool) {
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points for one octree");
+  if (p.grid < 1 || p.grid > 1024) throw std::invalid_argument("grid must be in [1, 1024]");
+  const double inf = std::numeric_limits<double>::infinity();
+  double lo[3] = {inf, inf, inf}, hi[3] = {-inf, -inf, -inf};
+  std::vector<std::uint32_t> all;
+  all.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (std::isnan(x[i]) || std::isnan(y[i]) || std::isnan(z[i])) continue;
+    double v[3] = {x[i], y[i], z[i]};
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = std::min(lo[a], v[a]);
+      hi[a] = std::max(hi[a], v[a]);
+    }
+    all.push_back(std::uint32_t(i));
+  }
+  Octree t;
+  t.grid = p.grid;
+  OctreeNode root;
+  if (!all.empty()) {
+    root.x0 = lo[0];
+    root.y0 = lo[1];
+    root.z0 = lo[2];
+    root.size = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    // the largest coordinates must fall inside the cube
+    root.size = root.size > 0 ? root.size * (1 + 1e-9) : 1;
+  }
+  t.nodes.push_back(root);
+
+  struct Pending {
+    std::int32_t node;
+    std::vector<std::uint32_t> idx;
+  };
+  std::vector<Pending> level;
+  level.push_back({0, std::move(all)});
+  std::vector<std::vector<std::uint32_t>> kept(1);
+  const std::uint64_t g = std::uint64_t(p.grid);
+  while (!level.empty()) {
+    std::vector<std::vector<std::uint32_t>> keep(level.size());
+    std::vector<std::vector<std::uint32_t>> kids(level.size() * 8);
+    parallel_for(pool, level.size(), 1, [&](std::size_t b, std::size_t e) {
+      std::vector<std::pair<std::uint64_t, std::uint32_t>> keys;
+      for (std::size_t j = b; j < e; ++j) {
+        const OctreeNode nd = t.nodes[std::size_t(level[j].node)];
+        std::vector<std::uint32_t>& idx = level[j].idx;
+        if (idx.size() <= p.leaf_size || nd.level >= p.max_level) {
+          keep[j] = std::move(idx);
+          continue;
+        }
+        // sample cell and hash of every point; the first point of every
+        // cell after sorting stays in the node
+        double scale = double(g) / nd.size, half = nd.size / 2;
+        auto cell = [&](double v, double v0) {
+          return std::min<std::uint64_t>(g - 1, std::uint64_t(std::max(0.0, (v - v0) * scale)));
+        };
+        keys.resize(idx.size());
+        for (std::size_t k = 0; k < idx.size(); ++k) {
+          std::uint32_t i = idx[k];
+          std::uint64_t c = (cell(x[i], nd.x0) * g + cell(y[i], nd.y0)) * g + cell(z[i], nd.z0);
+          keys[k] = {c << 32 | detail::point_hash(i), i};
+        }
+        std::sort(keys.begin(), keys.end());
+        std::uint64_t prev = UINT64_MAX;
+        for (const auto& kv : keys) {
+          std::uint32_t i = kv.second;
+          if (kv.first >> 32 != prev) {
+            prev = kv.first >> 32;
+            keep[j].push_back(i);
+            continue;
+          }
+          int oct = int(x[i] >= nd.x0 + half) | int(y[i] >= nd.y0 + half) << 1 |
+                    int(z[i] >= nd.z0 + half) << 2;
+          kids[j * 8 + std::size_t(oct)].push_back(i);
+        }
+        std::vector<std::uint32_t>().swap(idx);
+      }
+    });
+    std::vector<Pending> next;
+    for (std::size_t j = 0; j < level.size(); ++j) {
+      std::int32_t id = level[j].node;
+      kept[std::size_t(id)] = std::move(keep[j]);
+      for (int oct = 0; oct < 8; ++oct) {
+        std::vector<std::uint32_t>& c = kids[j * 8 + std::size_t(oct)];
+        if (c.empty()) continue;
+        OctreeNode parent = t.nodes[std::size_t(id)], child;
+        child.size = parent.size / 2;
+        child.x0 = parent.x0 + (oct & 1 ? child.size : 0);
+        child.y0 = parent.y0 + (oct & 2 ? child.size : 0);
+        child.z0 = parent.z0 + (oct & 4 ? child.size : 0);
+        child.level = parent.level + 1;
+        child.parent = id;
+        std::int32_t cid = std::int32_t(t.nodes.size());
+        t.nodes[std::size_t(id)].child[oct] = cid;
+        t.nodes.push_back(child);
+        kept.emplace_back();
+        next.push_back({cid, std::move(c)});
+      }
+    }
+    level = std::move(next);
+  }
+
+  t.start.assign(1, 0);
+  for (std::size_t k = 0; k < t.nodes.size(); ++k) {
+    t.nodes[k].count = kept[k].size();
+    t.order.insert(t.order.end(), kept[k].begin(), kept[k].end());
+    t.start.push_back(t.order.size());
+  }
+  return t;
+}
+
+// Write the points of the octree (the n-row columns it was built from) to
+// path and the node table to path + ".nodes":
+//   "TCHO" u32 version u32 grid u32 nnodes
+//   nnodes x (f64 x0, y0, z0, size, i32 level, parent, child[8], u64 count)
+inline void write_octree(const std::string& path, const std::vector<PointColumnInput>& columns,
+                         std::size_t n, const Octree& t, ThreadPool& pool) {
+  const PointColumnInput *cx, *cy;
+  detail::xy_columns(columns, cx, cy);
+  detail::write_point_groups(path, columns, n, *cx, *cy, t.order.data(), t.start, pool);
+  std::string nodes = path + ".nodes", tmp = nodes + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+    f.write("TCHO", 4);
+    detail::put_u32(f, 1);
+    detail::put_u32(f, std::uint32_t(t.grid));
+    detail::put_u32(f, std::uint32_t(t.nodes.size()));
+    for (const OctreeNode& nd : t.nodes) {
+      for (double v : {nd.x0, nd.y0, nd.z0, nd.size}) detail::put_f64(f, v);
+      detail::put_u32(f, std::uint32_t(nd.level));
+      detail::put_u32(f, std::uint32_t(nd.parent));
+      for (std::int32_t c : nd.child) detail::put_u32(f, std::uint32_t(c));
+      detail::put_u64(f, nd.count);
+    }
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+  }
+  std::remove(nodes.c_str()); // rename does not replace files on Windows
+  if (std::rename(tmp.c_str(), nodes.c_str()) != 0)
+    throw std::runtime_error("cannot move '" + tmp + "' to '" + nodes + "'");
+}
+
+// An octree file opened for viewing.
+class OctreeFile {
+public:
+  explicit OctreeFile(const std::string& path) : points_(path) {
+    std::string file = path + ".nodes";
+    MappedFile m(file);
+    const std::size_t rec = 4 * 8 + 10 * 4 + 8;
+    std::uint32_t version = 0, grid = 0, n = 0;
+    if (m.size() < 16 || std::memcmp(m.data(), "TCHO", 4) != 0)
+      throw std::runtime_error("'" + file + "' is no octree node file");
+    std::memcpy(&version, m.data() + 4, 4);
+    std::memcpy(&grid, m.data() + 8, 4);
+    std::memcpy(&n, m.data() + 12, 4);
+    if (version != 1) throw std::runtime_error("unsupported octree version in '" + file + "'");
+    if (m.size() != 16 + std::size_t(n) * rec || n != points_.nchunks())
+      throw std::runtime_error("corrupt octree '" + file + "'");
+    grid_ = int(grid);
+    nodes_.resize(n);
+    const std::uint8_t* p = m.data() + 16;
+    for (OctreeNode& nd : nodes_) {
+      std::memcpy(&nd.x0, p, 8);
+      std::memcpy(&nd.y0, p + 8, 8);
+      std::memcpy(&nd.z0, p + 16, 8);
+      std::memcpy(&nd.size, p + 24, 8);
+      std::memcpy(&nd.level, p + 32, 4);
+      std::memcpy(&nd.parent, p + 36, 4);
+      std::memcpy(nd.child, p + 40, 32);
+      std::memcpy(&nd.count, p + 72, 8);
+      p += rec;
+    }
+  }
+
+  const PointFile& points() const { return points_; }
+  const std::vector<OctreeNode>& nodes() const { return nodes_; }
+  int grid() const { return grid_; }
+
+private:
+  PointFile points_;
+  std::vector<OctreeNode> nodes_;
+  int grid_ = 0;
+};
+
+// Nodes to draw for a view. mvp is the column-major projection * model
+// matrix applied to coordinates relative to the corner of the root cube,
+// height the viewport height in pixels. Nodes whose sample spacing is
+// below min_pixels on screen are not refined further.
+inline std::vector<std::size_t> select_nodes(const std::vector<OctreeNode>& nodes, const double* mvp,
+                                             double height, std::uint64_t budget, double min_pixels,
+                                             int grid) {
+  std::vector<std::size_t> out;
+  if (nodes.empty()) return out;
+  const OctreeNode& root = nodes[0];
+  // screen extent of a node in pixels, < 0 if it is outside the frustum
+  auto extent = [&](const OctreeNode& nd) {
+    double lo[2] = {1e300, 1e300}, hi[2] = {-1e300, -1e300};
+    int outside[6] = {0, 0, 0, 0, 0, 0};
+    bool behind = false;
+    for (int k = 0; k < 8; ++k) {
+      double v[3] = {nd.x0 - root.x0 + (k & 1 ? nd.size : 0), nd.y0 - root.y0 + (k & 2 ? nd.size : 0),
+                     nd.z0 - root.z0 + (k & 4 ? nd.size : 0)};
+      double c[4];
+      for (int r = 0; r < 4; ++r) c[r] = mvp[r] * v[0] + mvp[4 + r] * v[1] + mvp[8 + r] * v[2] + mvp[12 + r];
+      for (int a = 0; a < 3; ++a) {
+        outside[2 * a] += c[a] < -c[3];
+        outside[2 * a + 1] += c[a] > c[3];
+      }
+      if (c[3] <= 0) {
+        behind = true;
+        continue;
+      }
+      for (int a = 0; a < 2; ++a) {
+        lo[a] = std::min(lo[a], c[a] / c[3]);
+        hi[a] = std::max(hi[a], c[a] / c[3]);
+      }
+    }
+    for (int o : outside)
+      if (o == 8) return -1.0;
+    if (behind) return std::numeric_limits<double>::infinity(); // the camera is inside it
+    return std::max(hi[0] - lo[0], hi[1] - lo[1]) * height / 2;
+  };
+  std::priority_queue<std::pair<double, std::size_t>> queue;
+  double e0 = extent(nodes[0]);
+  if (e0 >= 0) queue.push({e0, 0});
+  std::uint64_t used = 0;
+  while (!queue.empty()) {
+    std::pair<double, std::size_t> top = queue.top();
+    queue.pop();
+    const OctreeNode& nd = nodes[top.second];
+    if (used + nd.count > budget && !out.empty()) break;
+    used += nd.count;
+    out.push_back(top.second);
+    if (top.first / grid < min_pixels) continue; // finer samples would not show
+    for (std::int32_t c : nd.child) {
+      if (c < 0) continue;
+      double e = extent(nodes[std::size_t(c)]);
+      if (e >= 0) queue.push({e, std::size_t(c)});
+    }
+  }
+  return out;
+}
+
+} // namespace tch
@@ -0,0 +1,253 @@
+// Pit-free CHM: fill NaN holes and data pits of a max CHM.
+//
+// A max CHM has pits (cells whose highest return went deep into a crown)
+// and holes (cells without returns), both of which pull plot means down.
+// Every pass of the filter replaces
+//   - a pit, a cell more than dz below the median of its 3 x 3 window,
+//     by that median, and
+//   - a hole with at least min_valid non-NaN neighbours (of 8) by the
+//     median of those neighbours,
+// reading the previous pass only, so a hole closes by one cell per pass
+// from its rim; with min_valid = 5 the outer edge of the data never grows.
+// The median of 9 is a min/max network, run 8 cells at a time with AVX2
+// where the whole window is valid; the scalar code is the reference.
+//
+// The grid is processed in tile x tile pieces in parallel, each with a
+// halo of `passes` cells (the reach of the filter) read around it, so the
+// tiles are independent and the result is identical to one untiled run.
+// The same tiling filters a disk-backed Mosaic block by block.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#ifndef TCH_HAVE_AVX2_KERNEL
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#endif
+
+#include "grid.h"
+#include "mosaic.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct PitFreeParams {
+  float dz = 2;      // depth below the window median that makes a pit
+  int passes = 3;    // holes up to 2 * passes cells across are closed
+  int min_valid = 5; // neighbours a hole needs to be filled
+  int tile = 256;
+};
+
+namespace detail {
+
+inline void sort2(float& a, float& b) {
+  float lo = std::min(a, b), hi = std::max(a, b);
+  a = lo;
+  b = hi;
+}
+
+// median of 9 finite values (19 compare-exchanges)
+inline float median9(float p[9]) {
+  sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+  sort2(p[0], p[1]); sort2(p[3], p[4]); sort2(p[6], p[7]);
+  sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+  sort2(p[0], p[3]); sort2(p[5], p[8]); sort2(p[4], p[7]);
+  sort2(p[3], p[6]); sort2(p[1], p[4]); sort2(p[2], p[5]);
+  sort2(p[4], p[7]); sort2(p[4], p[2]); sort2(p[6], p[4]);
+  sort2(p[4], p[2]);
+  return p[4];
+}
+
+// median of n <= 9 values (insertion sort)
+inline float median_of(float* v, int n) {
+  for (int i = 1; i < n; ++i)
+    for (int j = i; j > 0 && v[j - 1] > v[j]; --j) std::swap(v[j - 1], v[j]);
+  return n % 2 ? v[n / 2] : 0.5f * (v[n / 2 - 1] + v[n / 2]);
+}
+
+// new value of the cell at in[0] of a buffer with row stride `stride`
+inline float pit_free_cell(const float* in, std::ptrdiff_t stride, const PitFreeParams& p) {
+  const float* up = in - stride;
+  const float* dn = in + stride;
+  float w[9] = {up[-1], up[0], up[1], in[-1], in[0], in[1], dn[-1], dn[0], dn[1]};
+  float v = in[0];
+  bool finite = true;
+  for (float x : w) finite = finite && !std::isnan(x);
+  if (finite) {
+    float m = median9(w);
+    return v < m - p.dz ? m : v;
+  }
+  float nb[9];
+  int cnt = 0;
+  for (int k = 0; k < 9; ++k)
+    if (k != 4 && !std::isnan(w[k])) nb[cnt++] = w[k];
+  if (cnt < p.min_valid) return v;
+  if (std::isnan(v)) return median_of(nb, cnt);
+  nb[cnt++] = v;
+  float m = median_of(nb, cnt);
+  return v < m - p.dz ? m : v;
+}
+
+#if defined(TCH_HAVE_AVX2_KERNEL)
+__attribute__((target("avx2"))) inline void sort2_avx2(__m256& a, __m256& b) {
+  __m256 lo = _mm256_min_ps(a, b);
+  b = _mm256_max_ps(a, b);
+  a = lo;
+}
+
+// cells [0, n) of one row; lanes with a NaN in their window go scalar
+__attribute__((target("avx2"))) inline void pit_free_row_avx2(const float* in, float* out,
+                                                               std::ptrdiff_t stride, int n,
+                                                               const PitFreeParams& p) {
+  const __m256 dz = _mm256_set1_ps(p.dz);
+  int c = 0;
+  for (; c + 8 <= n; c += 8) {
+    const float* up = in + c - stride;
+    const float* mid = in + c;
+    const float* dn = in + c + stride;
+    __m256 w[9] = {_mm256_loadu_ps(up - 1),  _mm256_loadu_ps(up),  _mm256_loadu_ps(up + 1),
+                   _mm256_loadu_ps(mid - 1), _mm256_loadu_ps(mid), _mm256_loadu_ps(mid + 1),
+                   _mm256_loadu_ps(dn - 1),  _mm256_loadu_ps(dn),  _mm256_loadu_ps(dn + 1)};
+    __m256 nan = _mm256_cmp_ps(w[0], w[0], _CMP_UNORD_Q);
+    for (int k = 1; k < 9; ++k) nan = _mm256_or_ps(nan, _mm256_cmp_ps(w[k], w[k], _CMP_UNORD_Q));
+    int bad = _mm256_movemask_ps(nan);
+    __m256 v = w[4];
+    sort2_avx2(w[1], w[2]); sort2_avx2(w[4], w[5]); sort2_avx2(w[7], w[8]);
+    sort2_avx2(w[0], w[1]); sort2_avx2(w[3], w[4]); sort2_avx2(w[6], w[7]);
+    sort2_avx2(w[1], w[2]); sort2_avx2(w[4], w[5]); sort2_avx2(w[7], w[8]);
+    sort2_avx2(w[0], w[3]); sort2_avx2(w[5], w[8]); sort2_avx2(w[4], w[7]);
+    sort2_avx2(w[3], w[6]); sort2_avx2(w[1], w[4]); sort2_avx2(w[2], w[5]);
+    sort2_avx2(w[4], w[7]); sort2_avx2(w[4], w[2]); sort2_avx2(w[6], w[4]);
+    sort2_avx2(w[4], w[2]);
+    __m256 pit = _mm256_cmp_ps(v, _mm256_sub_ps(w[4], dz), _CMP_LT_OQ);
+    _mm256_storeu_ps(out + c, _mm256_blendv_ps(v, w[4], pit));
+    for (int l = 0; l < 8; ++l)
+      if (bad >> l & 1) out[c + l] = pit_free_cell(in + c + l, stride, p);
+  }
+  for (; c < n; ++c) out[c] = pit_free_cell(in + c, stride, p);
+}
+#endif
+
+inline void pit_free_row(const float* in, float* out, std::ptrdiff_t stride, int n,
+                         const PitFreeParams& p) {
+#if defined(TCH_HAVE_AVX2_KERNEL)
+  if (__builtin_cpu_supports("avx2")) return pit_free_row_avx2(in, out, stride, n, p);
+#endif
+  for (int c = 0; c < n; ++c) out[c] = pit_free_cell(in + c, stride, p);
+}
+
+// All passes over a h x w window held in a (h + 2) x (w + 2) buffer with a
+// NaN border; the result is left in buf. The outer `passes` cells of the
+// window are only as good as what was read around them.
+inline void pit_free_window(std::vector<float>& buf, std::vector<float>& tmp, int h, int w,
+                            const PitFreeParams& p) {
+  std::ptrdiff_t stride = w + 2;
+  tmp.assign(buf.size(), std::numeric_limits<float>::quiet_NaN());
+  for (int pass = 0; pass < p.passes; ++pass) {
+    for (int r = 1; r <= h; ++r)
+      pit_free_row(&buf[std::size_t(r * stride + 1)], &tmp[std::size_t(r * stride + 1)], stride, w, p);
+    buf.swap(tmp);
+  }
+}
+
+inline void check_pit_free(const PitFreeParams& p) {
+  if (p.passes < 1 || p.passes > 64) throw std::invalid_argument("passes must be in 1..64");
+  if (p.min_valid < 1 || p.min_valid > 8) throw std::invalid_argument("min_valid must be in 1..8");
+  if (!(p.dz >= 0)) throw std::invalid_argument("dz must be >= 0");
+  if (p.tile < 16) throw std::invalid_argument("tile must be >= 16");
+}
+
+// Run the filter over an nrow x ncol raster in tiles:
+// read(row0, col0, h, w, dst, stride) fills a window (NaN outside the
+// raster), write(row0, col0, h, w, src, stride) takes the filtered core.
+template <class Read, class Write>
+void pit_free_tiled(int nrow, int ncol, const PitFreeParams& p, ThreadPool& pool, Read read,
+                    Write write) {
+  check_pit_free(p);
+  const int t = p.tile, halo = p.passes;
+  std::size_t ntx = std::size_t((ncol + t - 1) / t), nty = std::size_t((nrow + t - 1) / t);
+  parallel_for(pool, ntx * nty, 1, [&](std::size_t first, std::size_t last) {
+    std::vector<float> buf, tmp;
+    for (std::size_t k = first; k < last; ++k) {
+      int r0 = int(k / ntx) * t, c0 = int(k % ntx) * t;
+      int h = std::min(t, nrow - r0), w = std::min(t, ncol - c0);
+      int wh = h + 2 * halo, ww = w + 2 * halo;
+      std::ptrdiff_t stride = ww + 2;
+      buf.assign(std::size_t(wh + 2) * std::size_t(stride), std::numeric_limits<float>::quiet_NaN());
+      read(r0 - halo, c0 - halo, wh, ww, &buf[std::size_t(stride + 1)], stride);
+      pit_free_window(buf, tmp, wh, ww, p);
+      write(r0, c0, h, w, &buf[std::size_t((halo + 1) * stride + halo + 1)], stride);
+    }
+  });
+}
+
+} // namespace detail
+
+inline Grid<float> pit_free(const Grid<float>& g, const PitFreeParams& p, ThreadPool& pool) {
+  const GridSpec& s = g.spec;
+  Grid<float> out(s, std::numeric_limits<float>::quiet_NaN());
+  detail::pit_free_tiled(
+      s.nrow, s.ncol, p, pool,
+      [&](int r0, int c0, int h, int w, float* dst, std::ptrdiff_t stride) {
+        for (int r = std::max(r0, 0); r < std::min(r0 + h, s.nrow); ++r) {
+          int a = std::max(c0, 0), b = std::min(c0 + w, s.ncol);
+          if (a < b) std::copy(&g.values[std::size_t(r) * s.ncol + a], &g.values[std::size_t(r) * s.ncol + b],
+                               dst + (r - r0) * stride + (a - c0));
+        }
+      },
+      [&](int r0, int c0, int h, int w, const float* src, std::ptrdiff_t stride) {
+        for (int r = 0; r < h; ++r)
+          std::copy(src + r * stride, src + r * stride + w, &out.values[std::size_t(r0 + r) * s.ncol + c0]);
+      });
+  return out;
+}
+
+// the filtered mosaic in a new scratch file at path, one block per tile
+inline std::unique_ptr<Mosaic> pit_free(const Mosaic& m, const std::string& path, PitFreeParams p,
+                                        ThreadPool& pool) {
+  const int bs = Mosaic::kBlock;
+  if (p.passes > bs) throw std::invalid_argument("passes must not exceed the mosaic block size");
+  p.tile = bs;
+  const GridSpec& s = m.spec();
+  std::unique_ptr<Mosaic> out(new Mosaic(s, path));
+  detail::pit_free_tiled(
+      s.nrow, s.ncol, p, pool,
+      [&](int r0, int c0, int h, int w, float* dst, std::ptrdiff_t stride) {
+        std::vector<float> cells(std::size_t(bs) * bs);
+        // the blocks under the rows and columns of the window inside the grid
+        int rlast = std::min(r0 + h, s.nrow) - 1, clast = std::min(c0 + w, s.ncol) - 1;
+        for (int by = std::max(r0, 0) / bs; by <= rlast / bs; ++by)
+          for (int bx = std::max(c0, 0) / bs; bx <= clast / bs; ++bx) {
+            m.read_block(by, bx, cells.data());
+            int ra = std::max(r0, by * bs), rb = std::min({r0 + h, (by + 1) * bs, s.nrow});
+            int ca = std::max(c0, bx * bs), cb = std::min({c0 + w, (bx + 1) * bs, s.ncol});
+            for (int r = ra; r < rb; ++r)
+              std::copy(&cells[std::size_t(r - by * bs) * bs + std::size_t(ca - bx * bs)],
+                        &cells[std::size_t(r - by * bs) * bs + std::size_t(cb - bx * bs)],
+                        dst + (r - r0) * stride + (ca - c0));
+          }
+      },
+      [&](int r0, int c0, int h, int w, const float* src, std::ptrdiff_t stride) {
+        std::vector<float> cells(std::size_t(bs) * bs, std::numeric_limits<float>::quiet_NaN());
+        bool any = false;
+        for (int r = 0; r < h; ++r)
+          for (int c = 0; c < w; ++c) {
+            float v = src[r * stride + c];
+            cells[std::size_t(r) * bs + std::size_t(c)] = v;
+            any = any || !std::isnan(v);
+          }
+        if (any) out->write_block(r0 / bs, c0 / bs, cells.data());
+      });
+  return out;
+}
+
+} // namespace tch
@@ -0,0 +1,273 @@
+// Planar neighbourhoods (replacement for lidR's shp_plane()).
+//
+// For every row of a k-NN adjacency the covariance of the neighbourhood is
+// formed and its eigenvalues a1 >= a2 >= a3 are computed in closed form
+// (the trigonometric solution of the characteristic cubic); the point is
+// planar if a2 > th1 * a3 and th2 * a2 > a1, as in lidR. A filter such as
+// ~Classification != 2 is applied by building the adjacency on the kept
+// points only (knn_adjacency with a query subset), so the kernel runs over
+// compacted rows without a per-point test.
+//
+// Rows are processed in batches of 8: the neighbour offsets from the
+// query point are gathered into a lane-interleaved (SoA) buffer and the
+// covariances and eigenvalues are computed across the 8 lanes, the latter
+// in an AVX2 kernel when the CPU has one. Everything is double: the
+// planarity tests compare eigenvalues that differ by orders of magnitude.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#ifndef TCH_HAVE_AVX2_KERNEL
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#endif
+
+#include "knn.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+namespace detail {
+
+const int kPlaneLanes = 8;
+
+// covariances (xx, xy, xz, yy, yz, zz) of up to 8 rows, lane by lane
+struct CovarianceBatch {
+  double c[6][kPlaneLanes];
+  std::uint32_t n[kPlaneLanes];
+};
+
+template <class X, class Y, class Z>
+void covariance_batch(X x, Y y, Z z, const Neighbours& nb, std::size_t row0, int lanes,
+                      std::vector<double>& soa, CovarianceBatch& out) {
+  const int L = kPlaneLanes, k = nb.k;
+  soa.assign(std::size_t(4) * k * L, 0.0); // dx, dy, dz, weight per neighbour and lane
+  double* dx = soa.data();
+  double* dy = dx + std::size_t(k) * L;
+  double* dz = dy + std::size_t(k) * L;
+  double* w = dz + std::size_t(k) * L;
+  for (int l = 0; l < L; ++l) {
+    out.n[l] = 0;
+    if (l >= lanes) continue;
+    std::size_t r = row0 + std::size_t(l);
+    std::uint32_t p = nb.rows[r];
+    const std::uint32_t* nbr = nb.begin(r);
+    std::size_t cnt = std::min<std::size_t>(nb.count(r), std::size_t(k));
+    out.n[l] = std::uint32_t(cnt);
+    // relative to the query point, so the sums do not carry the map
+    // coordinates
+    for (std::size_t j = 0; j < cnt; ++j) {
+      dx[j * L + l] = x[nbr[j]] - x[p];
+      dy[j * L + l] = y[nbr[j]] - y[p];
+      dz[j * L + l] = z[nbr[j]] - z[p];
+      w[j * L + l] = 1;
+    }
+  }
+  double mx[L] = {}, my[L] = {}, mz[L] = {}, inv[L], inv1[L];
+  for (int l = 0; l < L; ++l) {
+    inv[l] = out.n[l] ? 1.0 / out.n[l] : 0;
+    inv1[l] = out.n[l] > 1 ? 1.0 / (out.n[l] - 1) : 0;
+  }
+  for (int j = 0; j < k; ++j)
+    for (int l = 0; l < L; ++l) {
+      mx[l] += dx[j * L + l];
+      my[l] += dy[j * L + l];
+      mz[l] += dz[j * L + l];
+    }
+  for (int l = 0; l < L; ++l) {
+    mx[l] *= inv[l];
+    my[l] *= inv[l];
+    mz[l] *= inv[l];
+  }
+  for (int c = 0; c < 6; ++c)
+    for (int l = 0; l < L; ++l) out.c[c][l] = 0;
+  // two pass: centred on the neighbourhood mean, divided by n - 1 like
+  // the covariance of princomp()
+  for (int j = 0; j < k; ++j)
+    for (int l = 0; l < L; ++l) {
+      double ww = w[j * L + l];
+      double a = (dx[j * L + l] - mx[l]) * ww, b = (dy[j * L + l] - my[l]) * ww,
+             c = (dz[j * L + l] - mz[l]) * ww;
+      out.c[0][l] += a * a;
+      out.c[1][l] += a * b;
+      out.c[2][l] += a * c;
+      out.c[3][l] += b * b;
+      out.c[4][l] += b * c;
+      out.c[5][l] += c * c;
+    }
+  for (int c = 0; c < 6; ++c)
+    for (int l = 0; l < L; ++l) out.c[c][l] *= inv1[l];
+}
+
+// eigenvalues e[0] >= e[1] >= e[2] of the symmetric matrix
+// (a00 a01 a02; a11 a12; a22)
+inline void sym3_eigenvalues(double a00, double a01, double a02, double a11, double a12,
+                             double a22, double* e) {
+  double q = (a00 + a11 + a22) / 3;
+  double b00 = a00 - q, b11 = a11 - q, b22 = a22 - q;
+  double p2 = b00 * b00 + b11 * b11 + b22 * b22 + 2 * (a01 * a01 + a02 * a02 + a12 * a12);
+  double p = std::sqrt(p2 / 6);
+  if (!(p > 0)) {
+    e[0] = e[1] = e[2] = q;
+    return;
+  }
+  // r = det((A - q I) / p) / 2
+  double det = b00 * (b11 * b22 - a12 * a12) - a01 * (a01 * b22 - a12 * a02) +
+               a02 * (a01 * a12 - b11 * a02);
+  double r = std::min(1.0, std::max(-1.0, det / (2 * p * p * p)));
+  double phi = std::acos(r) / 3, c = std::cos(phi), s = std::sin(phi);
+  // cos(phi + 2 pi / 3) = -c / 2 - s sqrt(3) / 2
+  e[0] = q + 2 * p * c;
+  e[2] = q + p * (-c - 1.7320508075688772935 * s);
+  e[1] = 3 * q - e[0] - e[2];
+}
+
+inline void plane_eigen_scalar(const CovarianceBatch& b, double e[3][kPlaneLanes]) {
+  for (int l = 0; l < kPlaneLanes; ++l) {
+    double v[3];
+    sym3_eigenvalues(b.c[0][l], b.c[1][l], b.c[2][l], b.c[3][l], b.c[4][l], b.c[5][l], v);
+    for (int i = 0; i < 3; ++i) e[i][l] = v[i];
+  }
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+// Cephes asin for x in [-1, 1]
+__attribute__((target("avx2,fma"))) inline __m256d asin_avx2(__m256d x) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d a = _mm256_andnot_pd(sign, x);
+  // |x| > 0.625: asin = pi/2 - 2 asin(sqrt((1 - a) / 2)) via R/S
+  __m256d zz = _mm256_sub_pd(_mm256_set1_pd(1.0), a);
+  __m256d r = _mm256_set1_pd(2.967721961301243206100E-3);
+  r = _mm256_fmadd_pd(r, zz, _mm256_set1_pd(-5.634242780008963776856E-1));
+  r = _mm256_fmadd_pd(r, zz, _mm256_set1_pd(6.968710824104713396794E0));
+  r = _mm256_fmadd_pd(r, zz, _mm256_set1_pd(-2.556901049652824852289E1));
+  r = _mm256_fmadd_pd(r, zz, _mm256_set1_pd(2.853665548261061424989E1));
+  __m256d s = _mm256_add_pd(zz, _mm256_set1_pd(-2.194779531642920639778E1));
+  s = _mm256_fmadd_pd(s, zz, _mm256_set1_pd(1.470656354026814941758E2));
+  s = _mm256_fmadd_pd(s, zz, _mm256_set1_pd(-3.838770957603691357202E2));
+  s = _mm256_fmadd_pd(s, zz, _mm256_set1_pd(3.424398657913078477438E2));
+  __m256d pl = _mm256_div_pd(_mm256_mul_pd(zz, r), s);
+  __m256d sq = _mm256_sqrt_pd(_mm256_add_pd(zz, zz));
+  const __m256d pio4 = _mm256_set1_pd(7.85398163397448309616E-1);
+  __m256d big = _mm256_sub_pd(pio4, sq);
+  big = _mm256_sub_pd(big, _mm256_fmsub_pd(sq, pl, _mm256_set1_pd(6.123233995736765886130E-17)));
+  big = _mm256_add_pd(big, pio4);
+  // |x| <= 0.625: asin = a + a z P(z) / Q(z), z = a^2
+  __m256d z = _mm256_mul_pd(a, a);
+  __m256d pp = _mm256_set1_pd(4.253011369004428248960E-3);
+  pp = _mm256_fmadd_pd(pp, z, _mm256_set1_pd(-6.019598008014123785661E-1));
+  pp = _mm256_fmadd_pd(pp, z, _mm256_set1_pd(5.444622390564711410273E0));
+  pp = _mm256_fmadd_pd(pp, z, _mm256_set1_pd(-1.626247967210700244449E1));
+  pp = _mm256_fmadd_pd(pp, z, _mm256_set1_pd(1.956261983317594739197E1));
+  pp = _mm256_fmadd_pd(pp, z, _mm256_set1_pd(-8.198089802484824371615E0));
+  __m256d qq = _mm256_add_pd(z, _mm256_set1_pd(-1.474091372988853791896E1));
+  qq = _mm256_fmadd_pd(qq, z, _mm256_set1_pd(7.049610280856842141659E1));
+  qq = _mm256_fmadd_pd(qq, z, _mm256_set1_pd(-1.471791292232726029859E2));
+  qq = _mm256_fmadd_pd(qq, z, _mm256_set1_pd(1.395105614657485689735E2));
+  qq = _mm256_fmadd_pd(qq, z, _mm256_set1_pd(-4.918853881490881290097E1));
+  __m256d small = _mm256_fmadd_pd(a, _mm256_div_pd(_mm256_mul_pd(z, pp), qq), a);
+  __m256d y = _mm256_blendv_pd(small, big, _mm256_cmp_pd(a, _mm256_set1_pd(0.625), _CMP_GT_OQ));
+  return _mm256_or_pd(y, _mm256_and_pd(sign, x));
+}
+
+// cos and sin of x in [0, pi/3] by their Taylor series (error < 1e-16)
+__attribute__((target("avx2,fma"))) inline void sincos_small_avx2(__m256d x, __m256d& c,
+                                                                   __m256d& s) {
+  __m256d x2 = _mm256_mul_pd(x, x);
+  c = _mm256_set1_pd(1.0 / 20922789888000.0); // 1/16!
+  s = _mm256_set1_pd(1.0 / 355687428096000.0); // 1/17!
+  const double cc[] = {-1.0 / 87178291200.0, 1.0 / 479001600.0, -1.0 / 3628800.0, 1.0 / 40320.0,
+                       -1.0 / 720.0, 1.0 / 24.0, -1.0 / 2.0, 1.0};
+  const double sc[] = {-1.0 / 1307674368000.0, 1.0 / 6227020800.0, -1.0 / 39916800.0,
+                       1.0 / 362880.0, -1.0 / 5040.0, 1.0 / 120.0, -1.0 / 6.0, 1.0};
+  for (int i = 0; i < 8; ++i) {
+    c = _mm256_fmadd_pd(c, x2, _mm256_set1_pd(cc[i]));
+    s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(sc[i]));
+  }
+  s = _mm256_mul_pd(s, x);
+}
+
+__attribute__((target("avx2,fma"))) inline void plane_eigen_avx2(const CovarianceBatch& b,
+                                                                  double e[3][kPlaneLanes]) {
+  const __m256d third = _mm256_set1_pd(1.0 / 3), two = _mm256_set1_pd(2.0);
+  const __m256d one = _mm256_set1_pd(1.0), mone = _mm256_set1_pd(-1.0);
+  for (int h = 0; h < kPlaneLanes; h += 4) {
+    __m256d a00 = _mm256_loadu_pd(&b.c[0][h]), a01 = _mm256_loadu_pd(&b.c[1][h]);
+    __m256d a02 = _mm256_loadu_pd(&b.c[2][h]), a11 = _mm256_loadu_pd(&b.c[3][h]);
+    __m256d a12 = _mm256_loadu_pd(&b.c[4][h]), a22 = _mm256_loadu_pd(&b.c[5][h]);
+    __m256d q = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(a00, a11), a22), third);
+    __m256d b00 = _mm256_sub_pd(a00, q), b11 = _mm256_sub_pd(a11, q), b22 = _mm256_sub_pd(a22, q);
+    __m256d off = _mm256_fmadd_pd(a01, a01, _mm256_fmadd_pd(a02, a02, _mm256_mul_pd(a12, a12)));
+    __m256d p2 = _mm256_fmadd_pd(b00, b00, _mm256_fmadd_pd(b11, b11, _mm256_mul_pd(b22, b22)));
+    p2 = _mm256_fmadd_pd(two, off, p2);
+    __m256d p = _mm256_sqrt_pd(_mm256_div_pd(p2, _mm256_set1_pd(6.0)));
+    __m256d ok = _mm256_cmp_pd(p, _mm256_setzero_pd(), _CMP_GT_OQ);
+    __m256d m0 = _mm256_fmsub_pd(b11, b22, _mm256_mul_pd(a12, a12));
+    __m256d m1 = _mm256_fmsub_pd(a01, b22, _mm256_mul_pd(a12, a02));
+    __m256d m2 = _mm256_fmsub_pd(a01, a12, _mm256_mul_pd(b11, a02));
+    __m256d det = _mm256_fmadd_pd(a02, m2, _mm256_fmsub_pd(b00, m0, _mm256_mul_pd(a01, m1)));
+    __m256d p3 = _mm256_mul_pd(_mm256_mul_pd(p, p), p);
+    // lanes with p = 0 divide by 1 and are replaced below
+    __m256d r = _mm256_div_pd(det, _mm256_mul_pd(two, _mm256_blendv_pd(one, p3, ok)));
+    r = _mm256_min_pd(one, _mm256_max_pd(mone, r));
+    // phi = acos(r) / 3 = (pi/2 - asin(r)) / 3
+    __m256d phi = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.57079632679489661923), asin_avx2(r)),
+                                third);
+    __m256d c, s;
+    sincos_small_avx2(phi, c, s);
+    __m256d e0 = _mm256_fmadd_pd(_mm256_mul_pd(two, p), c, q);
+    __m256d e2 = _mm256_fmadd_pd(
+        p, _mm256_fnmadd_pd(_mm256_set1_pd(1.7320508075688772935), s, _mm256_sub_pd(_mm256_setzero_pd(), c)),
+        q);
+    __m256d e1 = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(3.0), q), e0), e2);
+    _mm256_storeu_pd(&e[0][h], _mm256_blendv_pd(q, e0, ok));
+    _mm256_storeu_pd(&e[1][h], _mm256_blendv_pd(q, e1, ok));
+    _mm256_storeu_pd(&e[2][h], _mm256_blendv_pd(q, e2, ok));
+  }
+}
+#endif
+
+} // namespace detail
+
+// planar (0/1) for the point of every row of nb into out (indexed by
+// point); rows with fewer than 3 neighbours are not planar. The
+// coordinates are const double* or quantized columns.
+template <class X, class Y, class Z>
+void segment_planes(X x, Y y, Z z, const Neighbours& nb, double th1, double th2,
+                    std::int32_t* out, ThreadPool& pool) {
+  StageTimer timer(TimedStage::ShpPlane);
+  const std::size_t L = detail::kPlaneLanes;
+  std::size_t nbatch = (nb.size() + L - 1) / L;
+#ifdef TCH_HAVE_AVX2_KERNEL
+  static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  parallel_for(pool, nbatch, 512, [&](std::size_t first, std::size_t last) {
+    std::vector<double> soa;
+    detail::CovarianceBatch cov;
+    double e[3][detail::kPlaneLanes];
+    std::uint64_t planar = 0;
+    for (std::size_t bi = first; bi < last; ++bi) {
+      std::size_t row0 = bi * L;
+      int lanes = int(std::min(L, nb.size() - row0));
+      detail::covariance_batch(x, y, z, nb, row0, lanes, soa, cov);
+#ifdef TCH_HAVE_AVX2_KERNEL
+      if (avx2) detail::plane_eigen_avx2(cov, e);
+      else
+#endif
+        detail::plane_eigen_scalar(cov, e);
+      for (int l = 0; l < lanes; ++l)
+        planar += out[nb.rows[row0 + std::size_t(l)]] =
+            cov.n[l] >= 3 && e[1][l] > th1 * e[2][l] && th2 * e[1][l] > e[0][l];
+    }
+    count(Counter::PointsPlanar, planar);
+  });
+}
+
+} // namespace tch
@@ -0,0 +1,231 @@
+// Plot-level join of inventory trees and CHM cells on a shared plot grid.
+//
+// Trees (summed AGB) and CHM cells (mean height) are reduced onto the same
+// res x res plots of one origin in a single pass, replacing the two
+// group-bys, the sort and the positional cbind that relied on both tables
+// having the same plots in the same order. Plots are keyed by
+//   id = floor((y - y0) / res) * ncols + floor((x - x0) / res) + 1
+// as with spatial_index(), but in 64 bits, so national grids fit.
+//
+// No sort over the inputs is needed: every block of inputs is reduced into
+// its own small hash table, the table entries are split into partitions by
+// key hash and every partition is merged in parallel, in block order. The
+// sums therefore do not depend on the number of threads. Only the plots
+// themselves are sorted by id at the end.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace tch {
+
+struct PlotLayout {
+  double x0 = 0, y0 = 0, res = 50;
+  std::int64_t ncols = 0, nrows = 0;
+
+  // 0-based plot key of (x, y), -1 outside the layout (or NaN)
+  std::int64_t key(double x, double y) const {
+    double fc = std::floor((x - x0) / res), fr = std::floor((y - y0) / res);
+    if (!(fc >= 0 && fc < double(ncols) && fr >= 0 && fr < double(nrows))) return -1;
+    return std::int64_t(fr) * ncols + std::int64_t(fc);
+  }
+};
+
+// layout from the origin (x0, y0) up to (maxx, maxy)
+inline PlotLayout plot_layout(double x0, double y0, double maxx, double maxy, double res) {
+  if (!(res > 0)) throw std::invalid_argument("res must be positive");
+  if (!(maxx >= x0 && maxy >= y0)) throw std::invalid_argument("nothing to join above the origin");
+  PlotLayout l;
+  l.x0 = x0;
+  l.y0 = y0;
+  l.res = res;
+  double nc = std::floor((maxx - x0) / res) + 1, nr = std::floor((maxy - y0) / res) + 1;
+  if (nc * nr > 9e15) throw std::invalid_argument("too many plots, use a coarser res");
+  l.ncols = std::int64_t(nc);
+  l.nrows = std::int64_t(nr);
+  return l;
+}
+
+struct PlotStats {
+  std::int64_t key = 0;
+  double agb = 0;    // sum over the trees (NaN AGB counts as 0)
+  double height = 0; // sum over the non-NaN CHM cells
+  std::uint32_t ntrees = 0, ncells = 0;
+
+  std::int64_t id() const { return key + 1; }
+  double tch() const { return ncells ? height / ncells : std::numeric_limits<double>::quiet_NaN(); }
+};
+
+struct PlotJoin {
+  std::vector<PlotStats> plots; // sorted by key; plots with trees or cells
+  std::size_t trees_outside = 0, cells_outside = 0;
+};
+
+// CHM heights as points or as the cells of a raster (row-major from the
+// top left, cell centres as coordinates like raster::rasterToPoints())
+struct HeightSource {
+  const double *x = nullptr, *y = nullptr, *z = nullptr;
+  std::size_t n = 0;
+  // raster cells when z is null
+  const double* values = nullptr;
+  int nrow = 0, ncol = 0;
+  double xmin = 0, ymax = 0, res = 1;
+
+  std::size_t size() const { return z ? n : std::size_t(nrow) * ncol; }
+  void at(std::size_t i, double& px, double& py, double& pz) const {
+    if (z) {
+      px = x[i];
+      py = y[i];
+      pz = z[i];
+      return;
+    }
+    std::size_t r = i / std::size_t(ncol), c = i % std::size_t(ncol);
+    px = xmin + (double(c) + 0.5) * res;
+    py = ymax - (double(r) + 0.5) * res;
+    pz = values[i];
+  }
+};
+
+namespace detail {
+
+inline std::uint64_t plot_hash(std::int64_t key) {
+  std::uint64_t h = std::uint64_t(key);
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+// open addressing table of PlotStats by key
+class PlotTable {
+public:
+  PlotStats& get(std::int64_t key) {
+    if (2 * (entries_.size() + 1) > slots_.size()) grow();
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t s = plot_hash(key) & mask;; s = (s + 1) & mask) {
+      std::int32_t e = slots_[s];
+      if (e < 0) {
+        slots_[s] = std::int32_t(entries_.size());
+        entries_.emplace_back();
+        entries_.back().key = key;
+        return entries_.back();
+      }
+      if (entries_[std::size_t(e)].key == key) return entries_[std::size_t(e)];
+    }
+  }
+
+  std::vector<PlotStats>& entries() { return entries_; }
+
+private:
+  void grow() {
+    slots_.assign(std::max<std::size_t>(64, 2 * slots_.size()), -1);
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t e = 0; e < entries_.size(); ++e) {
+      std::size_t s = plot_hash(entries_[e].key) & mask;
+      while (slots_[s] >= 0) s = (s + 1) & mask;
+      slots_[s] = std::int32_t(e);
+    }
+  }
+
+  std::vector<std::int32_t> slots_;
+  std::vector<PlotStats> entries_;
+};
+
+const std::size_t kJoinBlock = std::size_t(1) << 16; // inputs per local table
+const int kJoinPartitionBits = 6;
+
+inline std::size_t join_partition(std::int64_t key) {
+  return std::size_t(plot_hash(key) >> (64 - kJoinPartitionBits));
+}
+
+} // namespace detail
+
+// Reduce trees (x, y, agb) and heights onto the plots of layout.
+inline PlotJoin plot_join(const PlotLayout& layout, const double* tx, const double* ty,
+                          const double* agb, std::size_t ntrees, const HeightSource& heights,
+                          ThreadPool& pool) {
+  const std::size_t bs = detail::kJoinBlock, nparts = std::size_t(1) << detail::kJoinPartitionBits;
+  std::size_t ncells = heights.size();
+  std::size_t tblocks = (ntrees + bs - 1) / bs, nblocks = tblocks + (ncells + bs - 1) / bs;
+  // the entries of every block grouped by partition: part[k][p .. p + 1)
+  std::vector<std::vector<PlotStats>> local(nblocks);
+  std::vector<std::vector<std::uint32_t>> part(nblocks);
+  std::vector<std::size_t> outside(nblocks, 0);
+  parallel_for(pool, nblocks, 1, [&](std::size_t first, std::size_t last) {
+    for (std::size_t k = first; k < last; ++k) {
+      detail::PlotTable table;
+      if (k < tblocks) {
+        for (std::size_t i = k * bs, e = std::min(ntrees, i + bs); i < e; ++i) {
+          std::int64_t key = layout.key(tx[i], ty[i]);
+          if (key < 0) {
+            ++outside[k];
+            continue;
+          }
+          PlotStats& s = table.get(key);
+          if (!std::isnan(agb[i])) s.agb += agb[i];
+          ++s.ntrees;
+        }
+      } else {
+        for (std::size_t i = (k - tblocks) * bs, e = std::min(ncells, i + bs); i < e; ++i) {
+          double x, y, z;
+          heights.at(i, x, y, z);
+          if (std::isnan(z)) continue;
+          std::int64_t key = layout.key(x, y);
+          if (key < 0) {
+            ++outside[k];
+            continue;
+          }
+          PlotStats& s = table.get(key);
+          s.height += z;
+          ++s.ncells;
+        }
+      }
+      // counting sort of the entries by partition
+      const std::vector<PlotStats>& ent = table.entries();
+      std::vector<std::uint32_t>& off = part[k];
+      off.assign(nparts + 1, 0);
+      for (const PlotStats& s : ent) ++off[detail::join_partition(s.key) + 1];
+      for (std::size_t p = 0; p < nparts; ++p) off[p + 1] += off[p];
+      std::vector<std::uint32_t> fill(off.begin(), off.end() - 1);
+      local[k].resize(ent.size());
+      for (const PlotStats& s : ent) local[k][fill[detail::join_partition(s.key)]++] = s;
+    }
+  });
+
+  std::vector<std::vector<PlotStats>> merged(nparts);
+  parallel_for(pool, nparts, 1, [&](std::size_t first, std::size_t last) {
+    for (std::size_t p = first; p < last; ++p) {
+      detail::PlotTable table;
+      for (std::size_t k = 0; k < nblocks; ++k)
+        for (std::uint32_t j = part[k][p]; j < part[k][p + 1]; ++j) {
+          const PlotStats& s = local[k][j];
+          PlotStats& d = table.get(s.key);
+          d.agb += s.agb;
+          d.height += s.height;
+          d.ntrees += s.ntrees;
+          d.ncells += s.ncells;
+        }
+      merged[p] = std::move(table.entries());
+    }
+  });
+
+  PlotJoin out;
+  for (std::size_t k = 0; k < nblocks; ++k) (k < tblocks ? out.trees_outside : out.cells_outside) += outside[k];
+  std::size_t nplots = 0;
+  for (const auto& m : merged) nplots += m.size();
+  out.plots.reserve(nplots);
+  for (const auto& m : merged) out.plots.insert(out.plots.end(), m.begin(), m.end());
+  std::sort(out.plots.begin(), out.plots.end(),
+            [](const PlotStats& a, const PlotStats& b) { return a.key < b.key; });
+  return out;
+}
+
+} // namespace tch
@@ -0,0 +1,304 @@
+// Plot-level point cloud metrics in one pass (the per-metric data.table
+// group-bys by spatial index of section 3.2).
+//
+// Every point is bucketed by its calc.spatial.index() id and a set of
+// metrics is accumulated per cell: height statistics, percentiles, MCH,
+// cover fractions and return-based fractions. Percentiles come from a
+// streaming sketch per cell: a histogram of fixed-width height bins over
+// the height range of the input (precision wide, 0.1 m by default) plus
+// the first few heights, so sparse cells are exact (type 7, as R). The
+// memory per cell does not depend on the point density and, unlike
+// marker based sketches such as P², the result does not depend on the
+// order of the points (scan lines, ground before canopy); the error is
+// within one bin. All percentiles of a cell share its histogram.
+//
+// The cells are split into contiguous id ranges (partitions) and the
+// points are scattered by partition with a stable parallel counting sort;
+// every partition is then streamed by one task, which keeps histograms
+// only for its own occupied cells. The results do not depend on the
+// thread count.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace tch {
+
+enum class MetricKind { Count, Min, Max, Mean, Sd, Quantile, Mch, Cover, CoverAll, First, Single, Last };
+
+struct Metric {
+  MetricKind kind = MetricKind::Mean;
+  double prob = 0; // Quantile
+  std::string name;
+
+  bool needs_returns() const {
+    return kind == MetricKind::Cover || kind == MetricKind::First || kind == MetricKind::Single ||
+           kind == MetricKind::Last;
+  }
+};
+
+// "n", "zmin", "zmax", "zmean", "zsd", "pNN" (NN in [0, 100], e.g. p95 or
+// p99.5), "median", "mch" (mean height of the points at or above the
+// canopy threshold), "cover" (fraction of the first returns above it),
+// "cover_all" (the same over all returns), "first", "single" and "last"
+// (fractions of first, single and last returns)
+inline Metric parse_metric(const std::string& name) {
+  static const struct { const char* name; MetricKind kind; } names[] = {
+      {"n", MetricKind::Count},        {"zmin", MetricKind::Min},      {"zmax", MetricKind::Max},
+      {"zmean", MetricKind::Mean},     {"zsd", MetricKind::Sd},        {"mch", MetricKind::Mch},
+      {"cover", MetricKind::Cover},    {"cover_all", MetricKind::CoverAll},
+      {"first", MetricKind::First},    {"single", MetricKind::Single}, {"last", MetricKind::Last}};
+  Metric m;
+  m.name = name;
+  for (const auto& n : names)
+    if (name == n.name) {
+      m.kind = n.kind;
+      return m;
+    }
+  if (name == "median") {
+    m.kind = MetricKind::Quantile;
+    m.prob = 0.5;
+    return m;
+  }
+  if (name.size() > 1 && name[0] == 'p') {
+    char* end = nullptr;
+    double pct = std::strtod(name.c_str() + 1, &end);
+    if (end && *end == '\0' && pct >= 0 && pct <= 100) {
+      m.kind = MetricKind::Quantile;
+      m.prob = pct / 100;
+      return m;
+    }
+  }
+  throw std::invalid_argument("unknown metric '" + name + "'");
+}
+
+struct MetricInput {
+  const double* z = nullptr;
+  const std::int32_t* id = nullptr; // 1-based cell ids, NA (or <= 0) left out
+  const std::int32_t* return_number = nullptr;
+  const std::int32_t* number_of_returns = nullptr;
+  std::size_t n = 0;
+  std::int64_t ncells = 0; // the largest id
+  double above = 2;        // canopy threshold of mch and the covers
+  double precision = 0.1;  // bin width of the percentile histograms
+};
+
+// the cells with points (sorted by id) and one column per metric
+struct PlotMetrics {
+  std::vector<std::int32_t> id;
+  std::vector<std::vector<double>> columns;
+};
+
+namespace detail {
+
+struct CellAcc {
+  std::uint32_t n = 0, canopy = 0, canopy_all = 0, first = 0, single = 0, last = 0;
+  double min = std::numeric_limits<double>::infinity(), max = -std::numeric_limits<double>::infinity();
+  double mean = 0, m2 = 0, canopy_sum = 0;
+};
+
+const std::size_t kExactHeights = 8;  // heights kept per cell next to the histogram
+const std::size_t kMaxHeightBins = 4096; // wider bins than the precision beyond
+
+// the rank-th smallest (0-based) of a cell's heights, interpolated within
+// its bin as if the heights of the bin were spread evenly over it
+inline double histogram_rank(const std::uint32_t* bins, std::size_t nbins, double lo, double width,
+                             double rank) {
+  double below = 0;
+  for (std::size_t b = 0; b < nbins; ++b) {
+    if (bins[b] == 0) continue;
+    if (rank < below + bins[b]) return lo + (double(b) + (rank - below + 0.5) / bins[b]) * width;
+    below += bins[b];
+  }
+  return lo + double(nbins) * width;
+}
+
+// type 7 quantile from the histogram (or from the exact heights while
+// there are no more than kExactHeights), clamped to the exact range
+inline double sketch_quantile(const std::uint32_t* bins, std::size_t nbins, double lo, double width,
+                              const double* exact, const CellAcc& a, double prob) {
+  double h = double(a.n - 1) * prob;
+  std::size_t r = std::size_t(std::floor(h));
+  if (a.n <= kExactHeights) {
+    double sorted[kExactHeights];
+    std::copy(exact, exact + a.n, sorted);
+    std::sort(sorted, sorted + a.n);
+    return r + 1 < a.n ? sorted[r] + (h - r) * (sorted[r + 1] - sorted[r]) : sorted[r];
+  }
+  double v = histogram_rank(bins, nbins, lo, width, double(r));
+  if (r + 1 < a.n) v += (h - r) * (histogram_rank(bins, nbins, lo, width, double(r + 1)) - v);
+  return std::min(a.max, std::max(a.min, v));
+}
+
+const int kMetricPartitionBits = 6;
+const std::size_t kMetricBlock = std::size_t(1) << 16;
+
+} // namespace detail
+
+inline PlotMetrics plot_metrics(const MetricInput& in, const std::vector<Metric>& metrics,
+                                ThreadPool& pool) {
+  if (in.n > UINT32_MAX) throw std::invalid_argument("too many points for the metric engine");
+  bool returns = false;
+  std::vector<double> probs;
+  for (const Metric& m : metrics) {
+    returns = returns || m.needs_returns();
+    if (m.kind == MetricKind::Quantile) probs.push_back(m.prob);
+  }
+  if (returns && !(in.return_number && in.number_of_returns))
+    throw std::invalid_argument("return metrics need ReturnNumber and NumberOfReturns");
+  const std::size_t ncells = std::size_t(std::max<std::int64_t>(in.ncells, 0)), nq = probs.size();
+  const std::size_t nparts = std::min<std::size_t>(std::size_t(1) << detail::kMetricPartitionBits,
+                                                   std::max<std::size_t>(ncells, 1));
+  auto part_of = [&](std::int32_t id) { return std::size_t(id - 1) * nparts / ncells; };
+  auto valid = [&](std::size_t i) {
+    return in.id[i] > 0 && std::size_t(in.id[i]) <= ncells && !std::isnan(in.z[i]);
+  };
+
+  // stable counting sort of the point indices by partition
+  const std::size_t bs = detail::kMetricBlock, nblocks = (in.n + bs - 1) / bs;
+  std::vector<std::uint32_t> count(nblocks * nparts, 0);
+  const double inf = std::numeric_limits<double>::infinity();
+  std::vector<double> zlo(nblocks, inf), zhi(nblocks, -inf);
+  parallel_for(pool, nblocks, 1, [&](std::size_t first, std::size_t last) {
+    for (std::size_t k = first; k < last; ++k)
+      for (std::size_t i = k * bs, e = std::min(in.n, i + bs); i < e; ++i)
+        if (valid(i)) {
+          ++count[k * nparts + part_of(in.id[i])];
+          zlo[k] = std::min(zlo[k], in.z[i]);
+          zhi[k] = std::max(zhi[k], in.z[i]);
+        }
+  });
+  std::vector<std::size_t> part_start(nparts + 1, 0), offset(nblocks * nparts);
+  std::size_t total = 0;
+  for (std::size_t p = 0; p < nparts; ++p) {
+    part_start[p] = total;
+    for (std::size_t k = 0; k < nblocks; ++k) {
+      offset[k * nparts + p] = total;
+      total += count[k * nparts + p];
+    }
+  }
+  part_start[nparts] = total;
+  std::vector<std::uint32_t> order(total);
+  parallel_for(pool, nblocks, 1, [&](std::size_t first, std::size_t last) {
+    for (std::size_t k = first; k < last; ++k) {
+      std::size_t* fill = &offset[k * nparts];
+      for (std::size_t i = k * bs, e = std::min(in.n, i + bs); i < e; ++i)
+        if (valid(i)) order[fill[part_of(in.id[i])]++] = std::uint32_t(i);
+    }
+  });
+
+  // histogram layout over the height range of all points
+  double lo = inf, hi = -inf;
+  for (std::size_t k = 0; k < nblocks; ++k) {
+    lo = std::min(lo, zlo[k]);
+    hi = std::max(hi, zhi[k]);
+  }
+  if (nq > 0 && !(in.precision > 0)) throw std::invalid_argument("precision must be positive");
+  double width = in.precision;
+  std::size_t nbins = 1;
+  if (nq > 0 && hi > lo) {
+    nbins = std::size_t(std::floor((hi - lo) / width)) + 1;
+    if (nbins > detail::kMaxHeightBins) {
+      nbins = detail::kMaxHeightBins;
+      width = (hi - lo) / double(nbins - 1);
+    }
+  }
+
+  // stream every partition into its cells
+  std::vector<detail::CellAcc> acc(ncells);
+  std::vector<double> quantiles(ncells * nq);
+  parallel_for(pool, nparts, 1, [&](std::size_t first, std::size_t last) {
+    for (std::size_t p = first; p < last; ++p) {
+      // cells [c0, c1) of the partition; sketches for the occupied ones
+      std::size_t c0 = (p * ncells + nparts - 1) / nparts, c1 = ((p + 1) * ncells + nparts - 1) / nparts;
+      std::vector<std::int32_t> slot(nq > 0 ? c1 - c0 : 0, -1);
+      std::vector<std::uint32_t> bins;
+      std::vector<double> exact;
+      for (std::size_t j = part_start[p]; j < part_start[p + 1]; ++j) {
+        std::uint32_t i = order[j];
+        std::size_t c = std::size_t(in.id[i]) - 1;
+        detail::CellAcc& a = acc[c];
+        double z = in.z[i];
+        ++a.n;
+        double d = z - a.mean;
+        a.mean += d / a.n;
+        a.m2 += d * (z - a.mean);
+        a.min = std::min(a.min, z);
+        a.max = std::max(a.max, z);
+        bool canopy = z >= in.above;
+        if (canopy) {
+          ++a.canopy_all;
+          a.canopy_sum += z;
+        }
+        if (returns) {
+          std::int32_t rn = in.return_number[i], nr = in.number_of_returns[i];
+          if (rn == 1) {
+            ++a.first;
+            if (canopy) ++a.canopy;
+          }
+          if (nr == 1) ++a.single;
+          if (rn == nr) ++a.last;
+        }
+        if (nq == 0) continue;
+        std::int32_t& s = slot[c - c0];
+        if (s < 0) {
+          s = std::int32_t(exact.size() / detail::kExactHeights);
+          bins.resize(bins.size() + nbins, 0);
+          exact.resize(exact.size() + detail::kExactHeights);
+        }
+        if (a.n <= detail::kExactHeights) exact[std::size_t(s) * detail::kExactHeights + a.n - 1] = z;
+        std::size_t b = std::min(nbins - 1, std::size_t((z - lo) / width));
+        ++bins[std::size_t(s) * nbins + b];
+      }
+      for (std::size_t c = c0; c < c1 && nq > 0; ++c) {
+        std::int32_t s = slot[c - c0];
+        if (s < 0) continue;
+        for (std::size_t q = 0; q < nq; ++q)
+          quantiles[c * nq + q] =
+              detail::sketch_quantile(&bins[std::size_t(s) * nbins], nbins, lo, width,
+                                      &exact[std::size_t(s) * detail::kExactHeights], acc[c], probs[q]);
+      }
+    }
+  });
+
+  PlotMetrics out;
+  out.columns.resize(metrics.size());
+  const double na = std::numeric_limits<double>::quiet_NaN();
+  for (std::size_t c = 0; c < ncells; ++c) {
+    const detail::CellAcc& a = acc[c];
+    if (a.n == 0) continue;
+    out.id.push_back(std::int32_t(c + 1));
+    std::size_t q = 0;
+    for (std::size_t m = 0; m < metrics.size(); ++m) {
+      double v = na;
+      switch (metrics[m].kind) {
+      case MetricKind::Count: v = a.n; break;
+      case MetricKind::Min: v = a.min; break;
+      case MetricKind::Max: v = a.max; break;
+      case MetricKind::Mean: v = a.mean; break;
+      case MetricKind::Sd: v = a.n > 1 ? std::sqrt(a.m2 / (a.n - 1)) : na; break;
+      case MetricKind::Quantile: v = quantiles[c * nq + q++]; break;
+      // no canopy point: a canopy height of 0
+      case MetricKind::Mch: v = a.canopy_all ? a.canopy_sum / a.canopy_all : 0; break;
+      case MetricKind::Cover: v = a.first ? double(a.canopy) / a.first : na; break;
+      case MetricKind::CoverAll: v = double(a.canopy_all) / a.n; break;
+      case MetricKind::First: v = double(a.first) / a.n; break;
+      case MetricKind::Single: v = double(a.single) / a.n; break;
+      case MetricKind::Last: v = double(a.last) / a.n; break;
+      }
+      out.columns[m].push_back(v);
+    }
+  }
+  return out;
+}
+
+} // namespace tch
@@ -0,0 +1,554 @@
+// Columnar point cloud files (.tchp) with a spatial chunk index.
+//
+// Points are grouped into square chunks of chunk_size map units (in their
+// original order within a chunk) and every column of every chunk is its
+// own block, so reading maps the file and a window read decodes only the
+// blocks of chunks whose bounding box intersects the window.
+//
+// Doubles that are quantized (LAS integers * scale + offset, or decimals
+// with at most 6 digits as in the RDS exports) are stored as their
+// integers, like integer and logical columns; other doubles as their bit
+// patterns, which for slowly changing values such as GPS times still have
+// small deltas. Integer streams are cut into runs of 1024 values and each run is
+// delta (zigzag) or frame-of-reference coded, whichever needs fewer bits,
+// and bit packed. Every file decodes to its input bit for bit; quantization
+// is only used where it was verified to be lossless, bit patterns compared,
+// so a column with -0.0 (which decodes as 0.0) stays raw.
+//
+// Layout (little endian):
+//   "TCHP" u32 version u64 npoints u32 ncols u32 nchunks
+//   ncols x (u32 kind, u32 len, name, f64 scale, f64 offset)
+//   nchunks x (u64 npoints, f64 xmin, ymin, xmax, ymax, ncols x (u64 offset, u64 bytes))
+//   blocks
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chunks.h"
+#include "grid.h"
+#include "las_reader.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+enum class PointColumnKind : std::uint32_t {
+  Raw = 0,     // double, from its bit pattern
+  Scaled = 1,  // double = q * scale + offset
+  Decimal = 2, // double = q / scale, scale = 10^digits
+  Int32 = 3,
+  Logical = 4,
+};
+
+struct PointColumnSpec {
+  std::string name;
+  PointColumnKind kind = PointColumnKind::Raw;
+  double scale = 1, offset = 0;
+
+  bool integer() const { return kind == PointColumnKind::Int32 || kind == PointColumnKind::Logical; }
+};
+
+// a column to write: double values (with an optional LAS scale/offset to
+// try first) or int32 values (integers or R logicals)
+struct PointColumnInput {
+  std::string name;
+  const double* dbl = nullptr;
+  const std::int32_t* i32 = nullptr;
+  bool logical = false;
+  double scale = 0, offset = 0;
+};
+
+namespace detail {
+
+const std::size_t kPackRun = 1024;
+
+inline double decode_scaled(std::int64_t q, double scale, double offset) {
+  return double(q) * scale + offset;
+}
+
+// how to store a double column losslessly
+inline PointColumnSpec choose_encoding(const PointColumnInput& c, std::size_t n) {
+  PointColumnSpec s;
+  s.name = c.name;
+  if (c.i32) {
+    s.kind = c.logical ? PointColumnKind::Logical : PointColumnKind::Int32;
+    return s;
+  }
+  const double lim = 4e18; // keep quantized values and their deltas in int64
+  auto lossless = [&](auto quantize, auto decode) {
+    for (std::size_t i = 0; i < n; ++i) {
+      double q = quantize(c.dbl[i]);
+      if (!(std::fabs(q) < lim)) return false;
+      double v = decode(std::int64_t(q));
+      if (std::memcmp(&v, &c.dbl[i], sizeof v) != 0) return false;
+    }
+    return true;
+  };
+  if (c.scale > 0) {
+    double sc = c.scale, off = c.offset;
+    if (lossless([&](double v) { return std::nearbyint((v - off) / sc); },
+                 [&](std::int64_t q) { return decode_scaled(q, sc, off); })) {
+      s.kind = PointColumnKind::Scaled;
+      s.scale = sc;
+      s.offset = off;
+      return s;
+    }
+  }
+  double p = 1;
+  for (int digits = 0; digits <= 6; ++digits, p *= 10) {
+    if (lossless([&](double v) { return std::nearbyint(v * p); },
+                 [&](std::int64_t q) { return double(q) / p; })) {
+      s.kind = PointColumnKind::Decimal;
+      s.scale = p;
+      return s;
+    }
+  }
+  return s;
+}
+
+inline std::int64_t quantize(const PointColumnSpec& s, double v) {
+  return std::int64_t(s.kind == PointColumnKind::Scaled ? std::nearbyint((v - s.offset) / s.scale)
+                                                        : std::nearbyint(v * s.scale));
+}
+
+inline int bit_width(std::uint64_t v) {
+  int w = 0;
+  while (v) {
+    ++w;
+    v >>= 1;
+  }
+  return w;
+}
+
+inline std::uint64_t zigzag(std::uint64_t v) { return (v << 1) ^ (0 - (v >> 63)); }
+inline std::uint64_t unzigzag(std::uint64_t v) { return (v >> 1) ^ (0 - (v & 1)); }
+
+// runs of (u8 mode, u8 width, i64 base, packed words); mode 0 stores
+// q - base (base = min), mode 1 zigzag deltas (base = first value).
+// Differences wrap around in 64 bits, so any int64 values round trip.
+inline void pack_ints(const std::int64_t* q, std::size_t n, std::vector<std::uint8_t>& out) {
+  std::vector<std::uint64_t> ufor(kPackRun), udelta(kPackRun);
+  for (std::size_t b = 0; b < n; b += kPackRun) {
+    std::size_t m = std::min(kPackRun, n - b);
+    const std::int64_t* v = q + b;
+    std::int64_t mn = *std::min_element(v, v + m);
+    std::uint64_t for_max = 0, delta_max = 0;
+    udelta[0] = 0;
+    for (std::size_t i = 0; i < m; ++i) {
+      ufor[i] = std::uint64_t(v[i]) - std::uint64_t(mn);
+      for_max = std::max(for_max, ufor[i]);
+      if (i > 0) {
+        udelta[i] = zigzag(std::uint64_t(v[i]) - std::uint64_t(v[i - 1]));
+        delta_max = std::max(delta_max, udelta[i]);
+      }
+    }
+    int wf = bit_width(for_max), wd = bit_width(delta_max);
+    bool delta = wd < wf;
+    int w = delta ? wd : wf;
+    std::int64_t base = delta ? v[0] : mn;
+    const std::uint64_t* u = delta ? udelta.data() : ufor.data();
+    out.push_back(std::uint8_t(delta));
+    out.push_back(std::uint8_t(w));
+    const std::uint8_t* pb = reinterpret_cast<const std::uint8_t*>(&base);
+    out.insert(out.end(), pb, pb + 8);
+    std::vector<std::uint64_t> words((m * std::size_t(w) + 63) / 64, 0);
+    for (std::size_t i = 0; i < m && w > 0; ++i) {
+      std::size_t bit = i * std::size_t(w), k = bit >> 6, off = bit & 63;
+      words[k] |= u[i] << off;
+      if (off + std::size_t(w) > 64) words[k + 1] |= u[i] >> (64 - off);
+    }
+    const std::uint8_t* pw = reinterpret_cast<const std::uint8_t*>(words.data());
+    out.insert(out.end(), pw, pw + words.size() * 8);
+  }
+}
+
+// inverse of pack_ints for n values; false if the block is malformed
+inline bool unpack_ints(const std::uint8_t* p, std::uint64_t bytes, std::size_t n, std::int64_t* q) {
+  const std::uint8_t* end = p + bytes;
+  for (std::size_t b = 0; b < n; b += kPackRun) {
+    std::size_t m = std::min(kPackRun, n - b);
+    if (end - p < 10) return false;
+    bool delta = p[0] != 0;
+    int w = p[1];
+    std::int64_t base;
+    std::memcpy(&base, p + 2, 8);
+    p += 10;
+    std::size_t nwords = (m * std::size_t(w) + 63) / 64;
+    if (w > 64 || std::size_t(end - p) < nwords * 8) return false;
+    const std::uint64_t mask = w == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << w) - 1;
+    std::int64_t* v = q + b;
+    std::uint64_t prev = std::uint64_t(base);
+    for (std::size_t i = 0; i < m; ++i) {
+      std::uint64_t u = 0;
+      if (w > 0) {
+        std::size_t bit = i * std::size_t(w), k = bit >> 6, off = bit & 63;
+        std::uint64_t lo;
+        std::memcpy(&lo, p + k * 8, 8);
+        u = lo >> off;
+        if (off + std::size_t(w) > 64) {
+          std::uint64_t hi;
+          std::memcpy(&hi, p + (k + 1) * 8, 8);
+          u |= hi << (64 - off);
+        }
+        u &= mask;
+      }
+      if (i > 0 || !delta) prev = delta ? prev + unzigzag(u) : std::uint64_t(base) + u;
+      v[i] = std::int64_t(prev);
+    }
+    p += nwords * 8;
+  }
+  return true;
+}
+
+inline void put_u32(std::ofstream& f, std::uint32_t v) { f.write(reinterpret_cast<const char*>(&v), 4); }
+inline void put_u64(std::ofstream& f, std::uint64_t v) { f.write(reinterpret_cast<const char*>(&v), 8); }
+inline void put_f64(std::ofstream& f, double v) { f.write(reinterpret_cast<const char*>(&v), 8); }
+
+// Write the points of n-row columns to path as chunks: chunk k holds the
+// rows order[start[k] .. start[k + 1]) in that order. cx and cy are the X
+// and Y columns the chunk bounds are taken from.
+inline void write_point_groups(const std::string& path, const std::vector<PointColumnInput>& columns,
+                               std::size_t n, const PointColumnInput& cx, const PointColumnInput& cy,
+                               const std::uint32_t* order, const std::vector<std::size_t>& start,
+                               ThreadPool& pool) {
+  std::vector<PointColumnSpec> specs(columns.size());
+  for (std::size_t j = 0; j < columns.size(); ++j)
+    pool.submit([&, j] { specs[j] = choose_encoding(columns[j], n); });
+  pool.wait();
+
+  const std::size_t ncols = columns.size(), ngroups = start.size() - 1;
+  std::vector<std::vector<std::uint8_t>> blocks(ngroups * ncols);
+  std::vector<double> bounds(ngroups * 4);
+  parallel_for(pool, ngroups, 1, [&](std::size_t b, std::size_t e) {
+    std::vector<std::int64_t> q;
+    for (std::size_t k = b; k < e; ++k) {
+      const std::uint32_t* idx = order + start[k];
+      std::size_t count = start[k + 1] - start[k];
+      double* bb = &bounds[4 * k];
+      bb[0] = bb[1] = std::numeric_limits<double>::infinity();
+      bb[2] = bb[3] = -bb[0];
+      for (std::size_t j = 0; j < count; ++j) {
+        double x = cx.dbl[idx[j]], y = cy.dbl[idx[j]];
+        if (std::isnan(x) || std::isnan(y)) continue;
+        bb[0] = std::min(bb[0], x); bb[1] = std::min(bb[1], y);
+        bb[2] = std::max(bb[2], x); bb[3] = std::max(bb[3], y);
+      }
+      q.resize(count);
+      for (std::size_t c = 0; c < ncols; ++c) {
+        const PointColumnInput& in = columns[c];
+        const PointColumnSpec& s = specs[c];
+        std::vector<std::uint8_t>& out = blocks[k * ncols + c];
+        for (std::size_t j = 0; j < count; ++j) {
+          if (in.i32) q[j] = in.i32[idx[j]];
+          else if (s.kind == PointColumnKind::Raw) std::memcpy(&q[j], &in.dbl[idx[j]], 8);
+          else q[j] = quantize(s, in.dbl[idx[j]]);
+        }
+        pack_ints(q.data(), count, out);
+      }
+    }
+  });
+
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+    f.write("TCHP", 4);
+    put_u32(f, 1);
+    put_u64(f, start.back());
+    put_u32(f, std::uint32_t(ncols));
+    put_u32(f, std::uint32_t(ngroups));
+    std::uint64_t head = 4 + 4 + 8 + 4 + 4;
+    for (const PointColumnSpec& s : specs) {
+      put_u32(f, std::uint32_t(s.kind));
+      put_u32(f, std::uint32_t(s.name.size()));
+      f.write(s.name.data(), std::streamsize(s.name.size()));
+      put_f64(f, s.scale);
+      put_f64(f, s.offset);
+      head += 4 + 4 + s.name.size() + 16;
+    }
+    std::uint64_t off = head + ngroups * (8 + 32 + ncols * 16);
+    for (std::size_t k = 0; k < ngroups; ++k) {
+      put_u64(f, start[k + 1] - start[k]);
+      for (int i = 0; i < 4; ++i) put_f64(f, bounds[4 * k + i]);
+      for (std::size_t c = 0; c < ncols; ++c) {
+        put_u64(f, off);
+        put_u64(f, blocks[k * ncols + c].size());
+        off += blocks[k * ncols + c].size();
+      }
+    }
+    for (const std::vector<std::uint8_t>& b : blocks)
+      f.write(reinterpret_cast<const char*>(b.data()), std::streamsize(b.size()));
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+  }
+  std::remove(path.c_str()); // rename does not replace files on Windows
+  if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    throw std::runtime_error("cannot move '" + tmp + "' to '" + path + "'");
+}
+
+// the double columns X and Y of a point cloud
+inline void xy_columns(const std::vector<PointColumnInput>& columns, const PointColumnInput*& cx,
+                       const PointColumnInput*& cy) {
+  cx = cy = nullptr;
+  for (const PointColumnInput& c : columns) {
+    if (c.name == "X" && c.dbl) cx = &c;
+    if (c.name == "Y" && c.dbl) cy = &c;
+  }
+  if (!cx || !cy) throw std::invalid_argument("a point cloud needs double columns X and Y");
+}
+
+} // namespace detail
+
+// Write n points to path, chunked on the columns X and Y.
+inline void write_point_file(const std::string& path, const std::vector<PointColumnInput>& columns,
+                             std::size_t n, double chunk_size, ThreadPool& pool) {
+  const PointColumnInput *cx, *cy;
+  detail::xy_columns(columns, cx, cy);
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points for one file");
+
+  // chunk keys; points without coordinates go to the first chunk
+  GridSpec layout = grid_spec_covering(cx->dbl, cy->dbl, n, chunk_size);
+  std::vector<std::int32_t> key(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    double x = cx->dbl[i], y = cy->dbl[i];
+    key[i] = std::isnan(x) || std::isnan(y) ? 0 : layout.row_of(y) * layout.ncol + layout.col_of(x);
+  }
+  ChunkPlan plan = plan_chunks_from_keys(key.data(), n, layout);
+  // members are laid out chunk after chunk, so the non-empty chunks are
+  // consecutive groups of them
+  std::vector<std::size_t> start{0};
+  for (const Chunk& ch : plan.chunks)
+    if (ch.ncore > 0) start.push_back(ch.begin + ch.ncore);
+  detail::write_point_groups(path, columns, n, *cx, *cy, plan.members.data(), start, pool);
+}
+
+// Columns of a LAS/LAZ file as written by write_point_file, with the
+// lidR attribute names; the coordinates keep the file's scale and offset.
+inline std::vector<PointColumnInput> las_point_columns(const LasColumns& c, const LasHeader& h) {
+  std::vector<PointColumnInput> cols;
+  auto dbl = [&](const char* name, const std::vector<double>& v, double scale, double offset) {
+    if (v.size() == c.size()) cols.push_back({name, v.data(), nullptr, false, scale, offset});
+  };
+  auto i32 = [&](const char* name, const std::vector<std::int32_t>& v) {
+    if (v.size() == c.size()) cols.push_back({name, nullptr, v.data(), false, 0, 0});
+  };
+  dbl("X", c.x, h.scale[0], h.offset[0]);
+  dbl("Y", c.y, h.scale[1], h.offset[1]);
+  dbl("Z", c.z, h.scale[2], h.offset[2]);
+  dbl("gpstime", c.gpstime, 0, 0);
+  i32("Intensity", c.intensity);
+  i32("ReturnNumber", c.return_number);
+  i32("NumberOfReturns", c.number_of_returns);
+  i32("Classification", c.classification);
+  return cols;
+}
+
+// A mapped .tchp file.
+class PointFile {
+public:
+  // the chunks a read touches and where their points go
+  struct ReadPlan {
+    std::vector<std::size_t> chunks;
+    std::vector<std::uint64_t> first; // output row of each chunk's first point
+    // rows kept of each chunk, empty if all of them are
+    std::vector<std::vector<std::uint32_t>> keep;
+    std::uint64_t n = 0;
+  };
+
+  explicit PointFile(const std::string& path) : path_(path), file_(path) {
+    const std::uint8_t* p = file_.data();
+    std::uint64_t pos = 0, size = file_.size();
+    auto need = [&](std::uint64_t k) {
+      if (size - pos < k) throw std::runtime_error("corrupt point file '" + path_ + "'");
+    };
+    auto u32 = [&] { need(4); std::uint32_t v; std::memcpy(&v, p + pos, 4); pos += 4; return v; };
+    auto u64 = [&] { need(8); std::uint64_t v; std::memcpy(&v, p + pos, 8); pos += 8; return v; };
+    auto f64 = [&] { need(8); double v; std::memcpy(&v, p + pos, 8); pos += 8; return v; };
+    need(4);
+    if (std::memcmp(p, "TCHP", 4) != 0) throw std::runtime_error("'" + path_ + "' is no point file");
+    pos = 4;
+    if (u32() != 1) throw std::runtime_error("unsupported point file version in '" + path_ + "'");
+    npoints_ = u64();
+    std::uint32_t ncols = u32(), nchunks = u32();
+    for (std::uint32_t c = 0; c < ncols; ++c) {
+      PointColumnSpec s;
+      s.kind = PointColumnKind(u32());
+      if (std::uint32_t(s.kind) > 4) throw std::runtime_error("corrupt point file '" + path_ + "'");
+      std::uint32_t len = u32();
+      need(len);
+      s.name.assign(reinterpret_cast<const char*>(p + pos), len);
+      pos += len;
+      s.scale = f64();
+      s.offset = f64();
+      specs_.push_back(s);
+    }
+    chunk_points_.resize(nchunks);
+    bounds_.resize(4 * std::size_t(nchunks));
+    blocks_.resize(std::size_t(nchunks) * ncols);
+    std::uint64_t total = 0;
+    for (std::uint32_t k = 0; k < nchunks; ++k) {
+      chunk_points_[k] = u64();
+      total += chunk_points_[k];
+      for (int i = 0; i < 4; ++i) bounds_[4 * k + i] = f64();
+      for (std::uint32_t c = 0; c < ncols; ++c) {
+        Block& b = blocks_[std::size_t(k) * ncols + c];
+        b.offset = u64();
+        b.bytes = u64();
+        if (b.offset > size || size - b.offset < b.bytes)
+          throw std::runtime_error("corrupt point file '" + path_ + "'");
+      }
+    }
+    if (total != npoints_) throw std::runtime_error("corrupt point file '" + path_ + "'");
+  }
+
+  std::uint64_t size() const { return npoints_; }
+  std::size_t nchunks() const { return chunk_points_.size(); }
+  const std::vector<PointColumnSpec>& columns() const { return specs_; }
+
+  int column(const std::string& name) const {
+    for (std::size_t c = 0; c < specs_.size(); ++c)
+      if (specs_[c].name == name) return int(c);
+    return -1;
+  }
+
+  // chunks intersecting the window (all without one); chunks only partly
+  // inside it have their X/Y decoded to find the rows to keep
+  ReadPlan plan(const Window* window, ThreadPool& pool) const {
+    ReadPlan rp;
+    for (std::size_t k = 0; k < nchunks(); ++k)
+      if (!window || window->intersects(&bounds_[4 * k])) rp.chunks.push_back(k);
+    rp.keep.resize(rp.chunks.size());
+    if (window) {
+      int cx = column("X"), cy = column("Y");
+      parallel_for(pool, rp.chunks.size(), 1, [&](std::size_t b, std::size_t e) {
+        std::vector<double> x, y;
+        for (std::size_t j = b; j < e; ++j) {
+          std::size_t k = rp.chunks[j];
+          const double* bb = &bounds_[4 * k];
+          if (bb[0] >= window->xmin && bb[2] <= window->xmax && bb[1] >= window->ymin &&
+              bb[3] <= window->ymax)
+            continue; // entirely inside
+          x.resize(chunk_points_[k]);
+          y.resize(chunk_points_[k]);
+          decode_block(k, std::size_t(cx), x.data());
+          decode_block(k, std::size_t(cy), y.data());
+          std::vector<std::uint32_t>& keep = rp.keep[j];
+          for (std::uint32_t i = 0; i < chunk_points_[k]; ++i)
+            if (window->contains(x[i], y[i])) keep.push_back(i);
+          if (keep.empty()) keep.push_back(UINT32_MAX); // marks "none"
+        }
+      });
+    }
+    rp.first.resize(rp.chunks.size());
+    for (std::size_t j = 0; j < rp.chunks.size(); ++j) {
+      rp.first[j] = rp.n;
+      rp.n += kept(rp, j);
+    }
+    return rp;
+  }
+
+  // all points of the given chunks, in that order
+  ReadPlan plan_chunks(const std::vector<std::size_t>& chunks) const {
+    ReadPlan rp;
+    rp.chunks = chunks;
+    rp.keep.resize(chunks.size());
+    rp.first.resize(chunks.size());
+    for (std::size_t j = 0; j < chunks.size(); ++j) {
+      if (chunks[j] >= nchunks()) throw std::out_of_range("no chunk " + std::to_string(chunks[j]));
+      rp.first[j] = rp.n;
+      rp.n += chunk_points_[chunks[j]];
+    }
+    return rp;
+  }
+
+  // Decode column c of the planned chunks into out (rp.n doubles, or
+  // int32 for integer columns).
+  void read(const ReadPlan& rp, std::size_t c, void* out, ThreadPool& pool) const {
+    bool integer = specs_[c].integer();
+    parallel_for(pool, rp.chunks.size(), 1, [&](std::size_t b, std::size_t e) {
+      std::vector<double> dtmp;
+      std::vector<std::int32_t> itmp;
+      for (std::size_t j = b; j < e; ++j) {
+        std::size_t k = rp.chunks[j];
+        const std::vector<std::uint32_t>& keep = rp.keep[j];
+        if (integer) {
+          std::int32_t* o = static_cast<std::int32_t*>(out) + rp.first[j];
+          if (keep.empty()) {
+            decode_block(k, c, o);
+            continue;
+          }
+          itmp.resize(chunk_points_[k]);
+          decode_block(k, c, itmp.data());
+          for (std::size_t i = 0; i < kept(rp, j); ++i) o[i] = itmp[keep[i]];
+        } else {
+          double* o = static_cast<double*>(out) + rp.first[j];
+          if (keep.empty()) {
+            decode_block(k, c, o);
+            continue;
+          }
+          dtmp.resize(chunk_points_[k]);
+          decode_block(k, c, dtmp.data());
+          for (std::size_t i = 0; i < kept(rp, j); ++i) o[i] = dtmp[keep[i]];
+        }
+      }
+    });
+  }
+
+private:
+  struct Block {
+    std::uint64_t offset = 0, bytes = 0;
+  };
+
+  std::size_t kept(const ReadPlan& rp, std::size_t j) const {
+    const std::vector<std::uint32_t>& keep = rp.keep[j];
+    if (keep.empty()) return std::size_t(chunk_points_[rp.chunks[j]]);
+    return keep[0] == UINT32_MAX ? 0 : keep.size();
+  }
+
+  template <class T>
+  void decode_block(std::size_t k, std::size_t c, T* out) const {
+    const PointColumnSpec& s = specs_[c];
+    const Block& b = blocks_[k * specs_.size() + c];
+    const std::uint8_t* p = file_.data() + b.offset;
+    std::size_t n = std::size_t(chunk_points_[k]);
+    std::vector<std::int64_t> q(n);
+    if (!detail::unpack_ints(p, b.bytes, n, q.data()))
+      throw std::runtime_error("corrupt point file '" + path_ + "'");
+    switch (s.kind) {
+    case PointColumnKind::Raw:
+      for (std::size_t i = 0; i < n; ++i) {
+        double v;
+        std::memcpy(&v, &q[i], 8);
+        out[i] = T(v);
+      }
+      break;
+    case PointColumnKind::Scaled:
+      for (std::size_t i = 0; i < n; ++i) out[i] = T(detail::decode_scaled(q[i], s.scale, s.offset));
+      break;
+    case PointColumnKind::Decimal:
+      for (std::size_t i = 0; i < n; ++i) out[i] = T(double(q[i]) / s.scale);
+      break;
+    default:
+      for (std::size_t i = 0; i < n; ++i) out[i] = T(q[i]);
+    }
+  }
+
+  std::string path_;
+  MappedFile file_;
+  std::uint64_t npoints_ = 0;
+  std::vector<PointColumnSpec> specs_;
+  std::vector<std::uint64_t> chunk_points_;
+  std::vector<double> bounds_;
+  std::vector<Block> blocks_; // nchunks x ncols
+};
+
+} // namespace tch
@@ -0,0 +1,246 @@
+// Power law prediction AGB = a * TCH^b over large grids.
+//
+// The prediction a * exp(b * log(x)), with NaN (R's NA) propagating, is
+// written to an output buffer and returned from R as a new vector; the
+// TCH input is never changed. The bands of a confidence or prediction
+// interval from the delta method are computed in the same pass:
+//   se^2 = g' V g (+ sigma^2 for a prediction interval),
+//   g = (x^b, a * x^b * log(x)), V = vcov(a, b)
+//   band = fit -/+ t * se
+// The AVX2 kernel evaluates log and exp with Cephes' rational
+// approximations (within a few ulp of the C library); zero, negative,
+// subnormal and non-finite inputs and results beyond the double range
+// take the scalar path, so their results are those of std::pow.
+//
+// A coefficient ensemble (bootstrap fits, see fit.h) gives the
+// uncertainty of the map per cell instead: the mean, standard deviation
+// and percentile band of the predictions of all members.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#ifndef TCH_HAVE_AVX2_KERNEL
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#endif
+
+#include "rasterize.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct PowerLaw {
+  double a = 1, b = 1;
+  // interval bands: vcov of (a, b), residual variance added to se^2 (0
+  // for a confidence interval) and the t quantile
+  double vaa = 0, vab = 0, vbb = 0, sigma2 = 0, t = 0;
+};
+
+namespace detail {
+
+inline void power_law_scalar(const PowerLaw& m, const double* x, double* y, double* lower,
+                             double* upper, std::size_t b, std::size_t e) {
+  for (std::size_t i = b; i < e; ++i) {
+    double xb = std::pow(x[i], m.b), fit = m.a * xb;
+    if (lower) {
+      double ga = xb, gb = fit * std::log(x[i]);
+      double se = std::sqrt(ga * ga * m.vaa + 2 * ga * gb * m.vab + gb * gb * m.vbb + m.sigma2);
+      lower[i] = fit - m.t * se;
+      upper[i] = fit + m.t * se;
+    }
+    y[i] = fit;
+  }
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+// Cephes log for normal positive doubles
+__attribute__((target("avx2,fma"))) inline __m256d log_avx2(__m256d x) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  // x = m * 2^e with m in [0.5, 1)
+  __m256i bits = _mm256_castpd_si256(x);
+  __m256i ebits = _mm256_srli_epi64(bits, 52);
+  __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+      _mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+      _mm256_set1_epi64x(0x3fe0000000000000LL)));
+  // exponent (< 2^11) to double via the 2^52 trick
+  const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+  __m256d e = _mm256_sub_pd(
+      _mm256_castsi256_pd(_mm256_or_si256(ebits, _mm256_castpd_si256(magic))), magic);
+  e = _mm256_sub_pd(e, _mm256_set1_pd(1022.0));
+  // m < sqrt(1/2): m = 2m - 1, e -= 1; else m = m - 1
+  __m256d small = _mm256_cmp_pd(m, _mm256_set1_pd(0.70710678118654752440), _CMP_LT_OQ);
+  e = _mm256_sub_pd(e, _mm256_and_pd(small, one));
+  m = _mm256_sub_pd(_mm256_add_pd(m, _mm256_and_pd(small, m)), one);
+  __m256d z = _mm256_mul_pd(m, m);
+  __m256d p = _mm256_set1_pd(1.01875663804580931796E-4);
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(4.97494994976747001425E-1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(4.70579119878881725854E0));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.44989225341610930846E1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(1.79368678507819816313E1));
+  p = _mm256_fmadd_pd(p, m, _mm256_set1_pd(7.70838733755885391666E0));
+  __m256d q = _mm256_add_pd(m, _mm256_set1_pd(1.12873587189167450590E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(4.52279145837532221105E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(8.29875266912776603211E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(7.11544750618563894466E1));
+  q = _mm256_fmadd_pd(q, m, _mm256_set1_pd(2.31251620126765340583E1));
+  __m256d y = _mm256_mul_pd(m, _mm256_div_pd(_mm256_mul_pd(z, p), q));
+  y = _mm256_fnmadd_pd(e, _mm256_set1_pd(2.121944400546905827679e-4), y);
+  y = _mm256_fnmadd_pd(z, _mm256_set1_pd(0.5), y);
+  return _mm256_fmadd_pd(e, _mm256_set1_pd(0.693359375), _mm256_add_pd(m, y));
+}
+
+// Cephes exp for |x| < 708
+__attribute__((target("avx2,fma"))) inline __m256d exp_avx2(__m256d x) {
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634073599)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  x = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125E-1), x);
+  x = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212E-6), x);
+  __m256d xx = _mm256_mul_pd(x, x);
+  __m256d p = _mm256_set1_pd(1.26177193074810590878E-4);
+  p = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(3.02994407707441961300E-2));
+  p = _mm256_fmadd_pd(p, xx, _mm256_set1_pd(9.99999999999999999910E-1));
+  p = _mm256_mul_pd(p, x);
+  __m256d q = _mm256_set1_pd(3.00198505138664455042E-6);
+  q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.52448340349684104192E-3));
+  q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.27265548208155028766E-1));
+  q = _mm256_fmadd_pd(q, xx, _mm256_set1_pd(2.00000000000000000009E0));
+  __m256d r = _mm256_fmadd_pd(_mm256_set1_pd(2.0), _mm256_div_pd(p, _mm256_sub_pd(q, p)),
+                              _mm256_set1_pd(1.0));
+  // r * 2^n: n to int64 via the 2^52 + 2^51 trick, then into the exponent
+  const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+  __m256i ni = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)),
+                                _mm256_castpd_si256(magic));
+  return _mm256_castsi256_pd(_mm256_add_epi64(_mm256_castpd_si256(r), _mm256_slli_epi64(ni, 52)));
+}
+
+__attribute__((target("avx2,fma"))) inline void power_law_avx2(const PowerLaw& m, const double* x,
+                                                               double* y, double* lower,
+                                                               double* upper, std::size_t b,
+                                                               std::size_t e) {
+  const __m256d a = _mm256_set1_pd(m.a), bb = _mm256_set1_pd(m.b);
+  const __m256d lo = _mm256_set1_pd(2.2250738585072014e-308), hi = _mm256_set1_pd(1.7976931348623157e308);
+  const __m256d lim = _mm256_set1_pd(700.0);
+  const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  std::size_t i = b;
+  for (; i + 4 <= e; i += 4) {
+    __m256d v = _mm256_loadu_pd(x + i);
+    __m256d ok = _mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ), _mm256_cmp_pd(v, hi, _CMP_LE_OQ));
+    if (_mm256_movemask_pd(ok) != 0xf) {
+      power_law_scalar(m, x, y, lower, upper, i, i + 4);
+      continue;
+    }
+    __m256d lx = log_avx2(v), t = _mm256_mul_pd(bb, lx);
+    if (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_and_pd(t, abs_mask), lim, _CMP_GT_OQ))) {
+      power_law_scalar(m, x, y, lower, upper, i, i + 4);
+      continue;
+    }
+    __m256d xb = exp_avx2(t), fit = _mm256_mul_pd(a, xb);
+    if (lower) {
+      __m256d gb = _mm256_mul_pd(fit, lx);
+      __m256d s = _mm256_set1_pd(m.sigma2);
+      s = _mm256_fmadd_pd(_mm256_mul_pd(xb, xb), _mm256_set1_pd(m.vaa), s);
+      s = _mm256_fmadd_pd(_mm256_mul_pd(xb, gb), _mm256_set1_pd(2 * m.vab), s);
+      s = _mm256_fmadd_pd(_mm256_mul_pd(gb, gb), _mm256_set1_pd(m.vbb), s);
+      __m256d w = _mm256_mul_pd(_mm256_set1_pd(m.t), _mm256_sqrt_pd(s));
+      _mm256_storeu_pd(lower + i, _mm256_sub_pd(fit, w));
+      _mm256_storeu_pd(upper + i, _mm256_add_pd(fit, w));
+    }
+    _mm256_storeu_pd(y + i, fit);
+  }
+  power_law_scalar(m, x, y, lower, upper, i, e);
+}
+#endif
+
+// a[k] * x^b[k] for the m members
+inline void ensemble_cell_scalar(const double* a, const double* b, std::size_t m, double x,
+                                 double* v) {
+  for (std::size_t k = 0; k < m; ++k) v[k] = a[k] * std::pow(x, b[k]);
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+__attribute__((target("avx2,fma"))) inline void ensemble_cell_avx2(const double* a, const double* b,
+                                                                   std::size_t m, double x,
+                                                                   double* v) {
+  if (!(x >= 2.2250738585072014e-308 && x <= 1.7976931348623157e308))
+    return ensemble_cell_scalar(a, b, m, x, v);
+  double lx[4];
+  _mm256_storeu_pd(lx, log_avx2(_mm256_set1_pd(x)));
+  const __m256d l = _mm256_set1_pd(lx[0]), lim = _mm256_set1_pd(700.0);
+  const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  std::size_t k = 0;
+  for (; k + 4 <= m; k += 4) {
+    __m256d t = _mm256_mul_pd(_mm256_loadu_pd(b + k), l);
+    if (_mm256_movemask_pd(_mm256_cmp_pd(_mm256_and_pd(t, abs_mask), lim, _CMP_GT_OQ))) {
+      ensemble_cell_scalar(a + k, b + k, 4, x, v + k);
+      continue;
+    }
+    _mm256_storeu_pd(v + k, _mm256_mul_pd(_mm256_loadu_pd(a + k), exp_avx2(t)));
+  }
+  ensemble_cell_scalar(a + k, b + k, m - k, x, v + k);
+}
+#endif
+
+} // namespace detail
+
+// Predictions of the m ensemble members (a[k], b[k]) for the n values of
+// x, summarized per value as mean, sd and the (1 -/+ level) / 2 quantiles;
+// NaN where x is NaN or a member's prediction is.
+inline void predict_power_law_ensemble(const double* a, const double* b, std::size_t m,
+                                       const double* x, std::size_t n, double level, double* mean,
+                                       double* sd, double* lower, double* upper, ThreadPool& pool) {
+#ifdef TCH_HAVE_AVX2_KERNEL
+  const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  parallel_for(pool, n, 1024, [&](std::size_t first, std::size_t last) {
+    std::vector<double> v(m);
+    for (std::size_t i = first; i < last; ++i) {
+      if (std::isnan(x[i]) || m == 0) {
+        mean[i] = sd[i] = lower[i] = upper[i] = nan;
+        continue;
+      }
+#ifdef TCH_HAVE_AVX2_KERNEL
+      if (avx2) detail::ensemble_cell_avx2(a, b, m, x[i], v.data());
+      else
+#endif
+        detail::ensemble_cell_scalar(a, b, m, x[i], v.data());
+      double s = 0, s2 = 0;
+      for (double p : v) s += p;
+      double mu = s / double(m);
+      for (double p : v) s2 += (p - mu) * (p - mu);
+      mean[i] = mu;
+      sd[i] = m > 1 ? std::sqrt(s2 / double(m - 1)) : nan;
+      if (std::isnan(mu)) {
+        lower[i] = upper[i] = nan;
+        continue;
+      }
+      lower[i] = quantile_type7(v.data(), v.data() + m, (1 - level) / 2);
+      upper[i] = quantile_type7(v.data(), v.data() + m, (1 + level) / 2);
+    }
+  });
+}
+
+// y = a * x^b for n values (y may be x); lower/upper (both or neither)
+// receive the interval bands
+inline void predict_power_law(const PowerLaw& m, const double* x, double* y, std::size_t n,
+                              double* lower, double* upper, ThreadPool& pool) {
+#ifdef TCH_HAVE_AVX2_KERNEL
+  const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  parallel_for(pool, n, 1 << 16, [&](std::size_t b, std::size_t e) {
+#ifdef TCH_HAVE_AVX2_KERNEL
+    if (avx2) return detail::power_law_avx2(m, x, y, lower, upper, b, e);
+#endif
+    detail::power_law_scalar(m, x, y, lower, upper, b, e);
+  });
+}
+
+} // namespace tch
@@ -0,0 +1,33 @@
+// Coordinates kept the way LAS stores them: int32 counts of the header's
+// scale from its offset.
+//
+// A QuantizedAxis indexes like a const double*: element i is converted
+// with the same expression LasReader uses for double columns, so a stage
+// reading a QuantizedAxis sees exactly the doubles it would read from
+// one, while the points take 4 instead of 8 bytes per coordinate in
+// memory. The stages that read coordinates (rasterize, CSF, shp_plane,
+// knnidw, the k-NN trees) are templates over the coordinate type, but
+// only TileArena and the rasterization of a read.cloud.native() cloud
+// instantiate them with QuantizedAxis; the exports behind the LAS based R
+// stages pass the double columns of the data.table.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tch {
+
+struct QuantizedAxis {
+  const std::int32_t* q = nullptr;
+  double scale = 1, offset = 0;
+
+  double operator[](std::size_t i) const { return q[i] * scale + offset; }
+};
+
+// bytes a stage reads per point from a column of type A
+template <class A>
+constexpr std::size_t coord_bytes = sizeof(double);
+template <>
+constexpr std::size_t coord_bytes<QuantizedAxis> = sizeof(std::int32_t);
+
+} // namespace tch
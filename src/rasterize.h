@@ -0,0 +1,234 @@
+// Point cloud to raster binning (replacement for
+// slidaRtools::raster.from.point.cloud).
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chunks.h"
+#include "grid.h"
+#include "metrics.h"
+#include "quantized.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+enum class Reducer { Max, Mean, Sum, Percentile };
+
+inline Reducer parse_reducer(const std::string& func) {
+  if (func == "max") return Reducer::Max;
+  if (func == "mean") return Reducer::Mean;
+  if (func == "sum") return Reducer::Sum;
+  if (func == "percentile" || func == "quantile") return Reducer::Percentile;
+  throw std::invalid_argument("unknown func '" + func + "', use 'max', 'mean', 'sum' or 'percentile'");
+}
+
+// same definition as R's quantile(type=7) on an unsorted range
+template <class T>
+double quantile_type7(T* first, T* last, double prob) {
+  std::size_t n = std::size_t(last - first);
+  if (n == 0) return std::numeric_limits<double>::quiet_NaN();
+  double h = (n - 1) * prob;
+  std::size_t lo = std::size_t(std::floor(h));
+  std::nth_element(first, first + lo, last);
+  double v = first[lo];
+  if (lo + 1 < n) {
+    T hi = *std::min_element(first + lo + 1, last);
+    v += (h - lo) * (hi - v);
+  }
+  return v;
+}
+
+namespace detail {
+
+// raster cell of point i, or -1 when it has a NaN coordinate or lies
+// outside the grid; the coordinates are const double* or QuantizedAxis
+template <class X, class Y, class Z>
+struct CellOfT {
+  X x;
+  Y y;
+  Z z;
+  const GridSpec& spec;
+  std::int64_t operator()(std::size_t i) const {
+    if (std::isnan(x[i]) || std::isnan(y[i]) || std::isnan(z[i])) return -1;
+    if (!spec.contains(x[i], y[i])) return -1;
+    return std::int64_t(spec.row_of(y[i])) * spec.ncol + spec.col_of(x[i]);
+  }
+};
+
+using CellOf = CellOfT<const double*, const double*, const double*>;
+
+// Reduce points point(0..m) into the cells of v. point maps a running
+// index to a point index, sum/cnt are the mean and sum accumulators.
+template <class Cell, class Z, class Point>
+void reduce_points(const Cell& cell_of, Z z, std::size_t m, Point point,
+                   Reducer reducer, double prob, float* v, double* sum, std::uint32_t* cnt) {
+  switch (reducer) {
+  case Reducer::Max:
+    for (std::size_t j = 0; j < m; ++j) {
+      std::size_t i = point(j);
+      std::int64_t c = cell_of(i);
+      if (c < 0) continue;
+      float zi = float(z[i]);
+      // NaN compares false, so empty cells take the first value
+      if (!(v[c] >= zi)) v[c] = zi;
+    }
+    break;
+
+  case Reducer::Mean:
+  case Reducer::Sum:
+    for (std::size_t j = 0; j < m; ++j) {
+      std::size_t i = point(j);
+      std::int64_t c = cell_of(i);
+      if (c < 0) continue;
+      sum[c] += z[i];
+      ++cnt[c];
+    }
+    break;
+
+  case Reducer::Percentile: {
+    // bucket Z per cell with a counting sort over the cells these points
+    // touch, then select the quantile of every bucket
+    std::int64_t lo = INT64_MAX, hi = -1;
+    for (std::size_t j = 0; j < m; ++j) {
+      std::int64_t c = cell_of(point(j));
+      if (c < 0) continue;
+      lo = std::min(lo, c);
+      hi = std::max(hi, c);
+    }
+    if (hi < 0) break;
+    std::vector<std::uint32_t> start(std::size_t(hi - lo) + 2, 0);
+    for (std::size_t j = 0; j < m; ++j) {
+      std::int64_t c = cell_of(point(j));
+      if (c >= 0) ++start[c - lo + 1];
+    }
+    for (std::size_t k = 1; k < start.size(); ++k) start[k] += start[k - 1];
+    std::vector<float> bucket(start.back());
+    std::vector<std::uint32_t> fill(start.begin(), start.end() - 1);
+    for (std::size_t j = 0; j < m; ++j) {
+      std::size_t i = point(j);
+      std::int64_t c = cell_of(i);
+      if (c >= 0) bucket[fill[c - lo]++] = float(z[i]);
+    }
+    for (std::size_t k = 0; k + 1 < start.size(); ++k)
+      if (start[k + 1] > start[k])
+        v[lo + std::int64_t(k)] =
+            float(quantile_type7(&bucket[start[k]], &bucket[start[k + 1]], prob));
+    break;
+  }
+  }
+}
+
+// layout of block x block cell groups, anchored at the top left corner
+inline GridSpec block_layout(const GridSpec& spec, int block) {
+  if (block < 1) throw std::invalid_argument("block size must be >= 1");
+  GridSpec layout = spec;
+  layout.res = spec.res * block;
+  layout.ncol = (spec.ncol + block - 1) / block;
+  layout.nrow = (spec.nrow + block - 1) / block;
+  layout.ymin = spec.ymax() - layout.nrow * layout.res;
+  return layout;
+}
+
+// group points by the block x block cell block they fall into; the block
+// of a point is derived from its cell with integer arithmetic, so a block
+// only ever touches its own cells
+template <class Cell>
+void plan_cell_blocks_into(ChunkPlan& plan, const Cell& cell_of, std::size_t n,
+                                  const GridSpec& spec, int block, ThreadPool& pool,
+                                  std::vector<std::int32_t>& key, std::vector<std::size_t>& fill) {
+  GridSpec layout = block_layout(spec, block);
+  key.resize(n);
+  parallel_for(pool, n, 1 << 16, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      std::int64_t c = cell_of(i);
+      key[i] = c < 0 ? -1
+                     : std::int32_t((c / spec.ncol) / block * layout.ncol + (c % spec.ncol) / block);
+    }
+  });
+  plan_chunks_from_keys_into(plan, key.data(), n, layout, fill);
+}
+
+template <class Cell>
+ChunkPlan plan_cell_blocks(const Cell& cell_of, std::size_t n, const GridSpec& spec,
+                                  int block, ThreadPool& pool) {
+  ChunkPlan plan;
+  std::vector<std::int32_t> key;
+  std::vector<std::size_t> fill;
+  plan_cell_blocks_into(plan, cell_of, n, spec, block, pool, key, fill);
+  return plan;
+}
+
+} // namespace detail
+
+// scratch of rasterize_into()
+struct RasterScratch {
+  std::vector<double> sum;
+  std::vector<std::uint32_t> cnt;
+  std::vector<std::int32_t> key;
+  std::vector<std::size_t> fill;
+  ChunkPlan plan;
+};
+
+// Bin points into a float grid. Cells without points are NaN. Points with
+// a NaN coordinate are skipped, points outside the grid are ignored.
+//
+// Without a pool, max, mean and sum run in a single streaming pass over the
+// points; the percentile reducer buckets Z values per cell (counting sort)
+// before selecting the quantile. With a pool, points are first grouped
+// into blocks of block x block cells, which are then reduced concurrently;
+// blocks own disjoint cells, so no locking is needed.
+//
+// rasterize_into() writes into out and keeps its buffers in s, both
+// reused from call to call; the coordinates may be quantized columns.
+template <class X, class Y, class Z>
+void rasterize_into(Grid<float>& out, X x, Y y, Z z, std::size_t n,
+                    const GridSpec& spec, Reducer reducer, double prob, ThreadPool* pool,
+                    int block, RasterScratch& s) {
+  if (reducer == Reducer::Percentile && !(prob >= 0 && prob <= 1))
+    throw std::invalid_argument("prob must be in [0, 1]");
+  StageTimer timer(TimedStage::Rasterize);
+  count(Counter::BytesRasterized, (coord_bytes<X> + coord_bytes<Y> + coord_bytes<Z>) * n);
+  out.spec = spec;
+  out.values.assign(spec.size(), std::numeric_limits<float>::quiet_NaN());
+  std::vector<double>& sum = s.sum;
+  std::vector<std::uint32_t>& cnt = s.cnt;
+  if (reducer == Reducer::Mean || reducer == Reducer::Sum) {
+    sum.assign(spec.size(), 0.0);
+    cnt.assign(spec.size(), 0);
+  }
+  detail::CellOfT<X, Y, Z> cell_of{x, y, z, spec};
+
+  if (!pool || pool->size() < 2) {
+    detail::reduce_points(cell_of, z, n, [](std::size_t j) { return j; }, reducer, prob,
+                          out.values.data(), sum.data(), cnt.data());
+  } else {
+    detail::plan_cell_blocks_into(s.plan, cell_of, n, spec, block, *pool, s.key, s.fill);
+    run_chunks(s.plan, *pool, [&](const Chunk& ch, const std::uint32_t* idx) {
+      detail::reduce_points(cell_of, z, ch.ncore, [idx](std::size_t j) { return idx[j]; },
+                            reducer, prob, out.values.data(), sum.data(), cnt.data());
+    });
+  }
+
+  if (reducer == Reducer::Mean || reducer == Reducer::Sum)
+    for (std::size_t c = 0; c < spec.size(); ++c)
+      if (cnt[c]) out.values[c] = float(reducer == Reducer::Sum ? sum[c] : sum[c] / cnt[c]);
+}
+
+inline Grid<float> rasterize(const double* x, const double* y, const double* z,
+                             std::size_t n, const GridSpec& spec, Reducer reducer,
+                             double prob = 0.95, ThreadPool* pool = nullptr,
+                             int block = 256) {
+  Grid<float> out;
+  RasterScratch s;
+  rasterize_into(out, x, y, z, n, spec, reducer, prob, pool, block, s);
+  return out;
+}
+
+} // namespace tch
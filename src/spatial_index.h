@@ -0,0 +1,193 @@
+// Spatial grid indices (replacement for slidaRtools::calc.spatial.index)
+// and counting-sort grouping by index.
+//
+// A point gets the 1-based id of the res x res cell it falls into,
+// counted row by row from the lower left corner (minx, miny):
+//   id = floor((y - miny) / res) * ncols + floor((x - minx) / res) + 1
+// or, in Morton (Z-order) mode, 1 + the bit interleave of column and row,
+// which keeps neighbouring cells close in memory. Points with a NaN
+// coordinate or outside the grid get NA (INT32_MIN, same as R's
+// NA_integer_).
+//
+// The x86 AVX2 and aarch64 NEON kernels are selected at run time/compile
+// time; the scalar loop is the reference and is written branch free so
+// compilers can vectorize it as well.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TCH_HAVE_AVX2_KERNEL 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TCH_HAVE_NEON_KERNEL 1
+#endif
+
+namespace tch {
+
+const std::int32_t kNaIndex = INT32_MIN;
+
+struct IndexGrid {
+  double minx = 0, miny = 0, res = 1;
+  std::int32_t ncols = 0, nrows = 0;
+  bool morton = false;
+
+  // number of possible ids (the largest id)
+  std::int64_t ncells() const {
+    if (!morton) return std::int64_t(ncols) * nrows;
+    std::uint32_t m = std::uint32_t(std::max(ncols, nrows) - 1), side = 1;
+    while (side <= m) side <<= 1;
+    return std::int64_t(side) * side;
+  }
+};
+
+inline IndexGrid index_grid(double minx, double miny, double maxx, double maxy, double res,
+                            bool morton) {
+  if (!(res > 0)) throw std::invalid_argument("res must be positive");
+  if (!(maxx >= minx && maxy >= miny)) throw std::invalid_argument("empty index extent");
+  IndexGrid g;
+  g.minx = minx;
+  g.miny = miny;
+  g.res = res;
+  double nc = std::floor((maxx - minx) / res) + 1, nr = std::floor((maxy - miny) / res) + 1;
+  // Morton ids interleave 15 bits of column and row, so the largest id,
+  // 2^30, stays a positive int32 (a 16th row bit would be the sign bit)
+  if (morton ? (nc > 32768 || nr > 32768) : nc * nr > double(INT32_MAX))
+    throw std::invalid_argument("too many grid cells for 32 bit ids, use a coarser res");
+  g.ncols = std::int32_t(nc);
+  g.nrows = std::int32_t(nr);
+  g.morton = morton;
+  return g;
+}
+
+// spread the low 16 bits of v to the even bit positions
+inline std::uint32_t morton_spread(std::uint32_t v) {
+  v &= 0xFFFF;
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+namespace detail {
+
+inline void spatial_index_scalar(const double* x, const double* y, std::size_t begin,
+                                 std::size_t end, const IndexGrid& g, std::int32_t* out) {
+  const std::int32_t ncols = g.ncols, nrows = g.nrows;
+  for (std::size_t i = begin; i < end; ++i) {
+    double fc = std::floor((x[i] - g.minx) / g.res), fr = std::floor((y[i] - g.miny) / g.res);
+    // NaN fails both comparisons, so it is treated as outside
+    bool ok = fc >= 0 && fc < ncols && fr >= 0 && fr < nrows;
+    std::int32_t c = ok ? std::int32_t(fc) : 0, r = ok ? std::int32_t(fr) : 0;
+    std::int32_t id = g.morton
+                          ? std::int32_t(morton_spread(std::uint32_t(c)) |
+                                         (morton_spread(std::uint32_t(r)) << 1)) + 1
+                          : r * ncols + c + 1;
+    out[i] = ok ? id : kNaIndex;
+  }
+}
+
+#ifdef TCH_HAVE_AVX2_KERNEL
+__attribute__((target("avx2"))) inline void
+spatial_index_avx2(const double* x, const double* y, std::size_t n, const IndexGrid& g,
+                   std::int32_t* out) {
+  const __m256d minx = _mm256_set1_pd(g.minx), miny = _mm256_set1_pd(g.miny);
+  const __m256d res = _mm256_set1_pd(g.res), zero = _mm256_setzero_pd();
+  const __m256d ncols_d = _mm256_set1_pd(g.ncols), nrows_d = _mm256_set1_pd(g.nrows);
+  const __m128i ncols = _mm_set1_epi32(g.ncols), one = _mm_set1_epi32(1);
+  const __m128i na = _mm_set1_epi32(kNaIndex);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d fc = _mm256_floor_pd(_mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(x + i), minx), res));
+    __m256d fr = _mm256_floor_pd(_mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(y + i), miny), res));
+    __m256d ok = _mm256_and_pd(
+        _mm256_and_pd(_mm256_cmp_pd(fc, zero, _CMP_GE_OQ), _mm256_cmp_pd(fc, ncols_d, _CMP_LT_OQ)),
+        _mm256_and_pd(_mm256_cmp_pd(fr, zero, _CMP_GE_OQ), _mm256_cmp_pd(fr, nrows_d, _CMP_LT_OQ)));
+    fc = _mm256_and_pd(fc, ok);
+    fr = _mm256_and_pd(fr, ok);
+    __m128i c = _mm256_cvttpd_epi32(fc), r = _mm256_cvttpd_epi32(fr);
+    __m128i id;
+    if (g.morton) {
+      alignas(16) std::int32_t cc[4], rr[4], ids[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(cc), c);
+      _mm_store_si128(reinterpret_cast<__m128i*>(rr), r);
+      for (int k = 0; k < 4; ++k)
+        ids[k] = std::int32_t(morton_spread(std::uint32_t(cc[k])) |
+                              (morton_spread(std::uint32_t(rr[k])) << 1)) + 1;
+      id = _mm_load_si128(reinterpret_cast<const __m128i*>(ids));
+    } else {
+      id = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(r, ncols), c), one);
+    }
+    // narrow the 4 x 64 bit mask to 4 x 32 bit and select NA outside
+    __m128i mask = _mm256_cvttpd_epi32(_mm256_and_pd(ok, _mm256_set1_pd(-1.0)));
+    mask = _mm_cmpeq_epi32(mask, _mm_set1_epi32(-1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_blendv_epi8(na, id, mask));
+  }
+  spatial_index_scalar(x, y, i, n, g, out);
+}
+#endif
+
+#ifdef TCH_HAVE_NEON_KERNEL
+inline void spatial_index_neon(const double* x, const double* y, std::size_t n, const IndexGrid& g,
+                               std::int32_t* out) {
+  if (g.morton) return spatial_index_scalar(x, y, 0, n, g, out);
+  const float64x2_t minx = vdupq_n_f64(g.minx), miny = vdupq_n_f64(g.miny), res = vdupq_n_f64(g.res);
+  const float64x2_t zero = vdupq_n_f64(0), ncols_d = vdupq_n_f64(g.ncols), nrows_d = vdupq_n_f64(g.nrows);
+  std::size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    float64x2_t fc = vrndmq_f64(vdivq_f64(vsubq_f64(vld1q_f64(x + i), minx), res));
+    float64x2_t fr = vrndmq_f64(vdivq_f64(vsubq_f64(vld1q_f64(y + i), miny), res));
+    uint64x2_t ok = vandq_u64(vandq_u64(vcgeq_f64(fc, zero), vcltq_f64(fc, ncols_d)),
+                              vandq_u64(vcgeq_f64(fr, zero), vcltq_f64(fr, nrows_d)));
+    int32x2_t c = vmovn_s64(vcvtq_s64_f64(fc)), r = vmovn_s64(vcvtq_s64_f64(fr));
+    int32x2_t id = vadd_s32(vmla_s32(c, r, vdup_n_s32(g.ncols)), vdup_n_s32(1));
+    vst1_s32(out + i, vbsl_s32(vmovn_u64(ok), id, vdup_n_s32(kNaIndex)));
+  }
+  spatial_index_scalar(x, y, i, n, g, out);
+}
+#endif
+
+} // namespace detail
+
+// ids for n points into out
+inline void spatial_index(const double* x, const double* y, std::size_t n, const IndexGrid& g,
+                          std::int32_t* out) {
+#if defined(TCH_HAVE_AVX2_KERNEL)
+  if (__builtin_cpu_supports("avx2")) return detail::spatial_index_avx2(x, y, n, g, out);
+#elif defined(TCH_HAVE_NEON_KERNEL)
+  return detail::spatial_index_neon(x, y, n, g, out);
+#endif
+  detail::spatial_index_scalar(x, y, 0, n, g, out);
+}
+
+// Group points by id with a stable counting sort: the points of id k are
+// order[start[k - 1] .. start[k]) (0-based positions), so per-cell
+// aggregations become contiguous segmented reductions. NA ids are left out.
+struct IndexGroups {
+  std::vector<std::uint32_t> order;
+  std::vector<std::uint32_t> start; // ncells + 1 offsets into order
+};
+
+inline IndexGroups group_by_index(const std::int32_t* id, std::size_t n, std::int64_t ncells) {
+  if (n > UINT32_MAX) throw std::invalid_argument("too many points to group");
+  IndexGroups g;
+  g.start.assign(std::size_t(ncells) + 1, 0);
+  for (std::size_t i = 0; i < n; ++i)
+    if (id[i] > 0 && id[i] <= ncells) ++g.start[std::size_t(id[i])];
+  for (std::size_t k = 1; k < g.start.size(); ++k) g.start[k] += g.start[k - 1];
+  g.order.resize(g.start.back());
+  std::vector<std::uint32_t> fill(g.start.begin(), g.start.end() - 1);
+  for (std::size_t i = 0; i < n; ++i)
+    if (id[i] > 0 && id[i] <= ncells) g.order[fill[std::size_t(id[i]) - 1]++] = std::uint32_t(i);
+  return g;
+}
+
+} // namespace tch
@@ -0,0 +1,274 @@
+// Content-addressed cache of pipeline stage outputs.
+//
+// A stage output is a table of equally long columns plus string metadata
+// (e.g. the extent of a raster). It is stored under a key: the hash of the
+// stage name, its parameters and the contents of its inputs, so a cached
+// result can only be found again for exactly the same inputs. A cache file
+// is a small header, the metadata, a column directory and the column data
+// at 64 byte aligned offsets; a hit maps the file and reads the columns in
+// place instead of deserializing anything.
+//
+// Layout (little endian):
+//   "TCHC" u32 version u64 nrows u32 ncols u32 nmeta
+//   nmeta x (u32 len, key, u32 len, value)
+//   ncols x (u32 type, u32 len, name, u64 offset, u64 bytes)
+//   column data
+// String columns are nrows int32 byte lengths (-1 for NA) followed by the
+// concatenated bytes.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.h"
+#include "metrics.h"
+
+namespace tch {
+
+// 64 bit hash of the stage keys and inputs. Bulk data is taken in 8 byte
+// words (the tail zero padded into one more), which is what makes hashing
+// input files of hundreds of MB cheap next to the stages they feed. Every
+// word goes through the splitmix64 finalizer together with the state, so
+// a change in any bit of a word, sign bits included, reaches all 64 bits
+// of the state (an FNV-1a step, xor and multiply, only carries it
+// upwards).
+class Hash64 {
+public:
+  void update(const void* data, std::size_t n) {
+    const std::uint8_t* p = static_cast<const std::uint8_t*>(data);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      std::uint64_t w;
+      std::memcpy(&w, p + i, 8);
+      h_ = mix(h_ ^ w);
+    }
+    if (i < n) {
+      std::uint64_t w = 0;
+      std::memcpy(&w, p + i, n - i);
+      h_ = mix(h_ ^ w ^ (std::uint64_t(n - i) << 56));
+    }
+  }
+  // length prefixed, so consecutive strings cannot run into each other
+  void update(const std::string& s) {
+    std::uint64_t n = s.size();
+    update(&n, sizeof n);
+    update(s.data(), s.size());
+  }
+  std::uint64_t value() const { return h_; }
+
+  static std::uint64_t mix(std::uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+  }
+
+private:
+  std::uint64_t h_ = 14695981039346656037ull;
+};
+
+inline std::string hash_hex(std::uint64_t h) {
+  char buf[17];
+  std::snprintf(buf, sizeof buf, "%016llx", static_cast<unsigned long long>(h));
+  return buf;
+}
+
+inline std::uint64_t hash_file(const std::string& path) {
+  MappedFile f(path);
+  Hash64 h;
+  std::uint64_t n = f.size();
+  h.update(&n, sizeof n);
+  h.update(f.data(), f.size());
+  return h.value();
+}
+
+enum class ColumnType : std::uint32_t { Double = 0, Int32 = 1, Logical = 2, String = 3 };
+
+// a column to write: `bytes` of raw data (see the layout above)
+struct TableColumn {
+  std::string name;
+  ColumnType type;
+  const void* data;
+  std::uint64_t bytes;
+};
+
+namespace detail {
+
+inline void put_u32(std::vector<std::uint8_t>& b, std::uint32_t v) {
+  const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(&v);
+  b.insert(b.end(), p, p + 4);
+}
+inline void put_u64(std::vector<std::uint8_t>& b, std::uint64_t v) {
+  const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(&v);
+  b.insert(b.end(), p, p + 8);
+}
+inline void put_str(std::vector<std::uint8_t>& b, const std::string& s) {
+  put_u32(b, std::uint32_t(s.size()));
+  b.insert(b.end(), s.begin(), s.end());
+}
+
+inline std::uint64_t align64(std::uint64_t v) { return (v + 63) & ~std::uint64_t(63); }
+
+} // namespace detail
+
+// Write a table to path. The file is written next to it first and renamed
+// into place, so an interrupted run never leaves a truncated cache entry.
+inline void write_table(const std::string& path, std::uint64_t nrows,
+                        const std::vector<std::pair<std::string, std::string>>& meta,
+                        const std::vector<TableColumn>& columns) {
+  std::vector<std::uint8_t> head;
+  head.insert(head.end(), {'T', 'C', 'H', 'C'});
+  detail::put_u32(head, 1);
+  detail::put_u64(head, nrows);
+  detail::put_u32(head, std::uint32_t(columns.size()));
+  detail::put_u32(head, std::uint32_t(meta.size()));
+  for (const auto& kv : meta) {
+    detail::put_str(head, kv.first);
+    detail::put_str(head, kv.second);
+  }
+  std::uint64_t dir_size = 0;
+  for (const TableColumn& c : columns) dir_size += 4 + 4 + c.name.size() + 8 + 8;
+  std::uint64_t off = detail::align64(head.size() + dir_size);
+  std::vector<std::uint64_t> offsets;
+  for (const TableColumn& c : columns) {
+    detail::put_u32(head, std::uint32_t(c.type));
+    detail::put_str(head, c.name);
+    detail::put_u64(head, off);
+    detail::put_u64(head, c.bytes);
+    offsets.push_back(off);
+    off = detail::align64(off + c.bytes);
+  }
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+    f.write(reinterpret_cast<const char*>(head.data()), std::streamsize(head.size()));
+    std::uint64_t pos = head.size();
+    const char zeros[64] = {};
+    for (std::size_t k = 0; k < columns.size(); ++k) {
+      f.write(zeros, std::streamsize(offsets[k] - pos));
+      f.write(static_cast<const char*>(columns[k].data), std::streamsize(columns[k].bytes));
+      pos = offsets[k] + columns[k].bytes;
+    }
+    if (!f) throw std::runtime_error("cannot write '" + tmp + "'");
+  }
+  std::remove(path.c_str()); // rename does not replace files on Windows
+  if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    throw std::runtime_error("cannot move '" + tmp + "' to '" + path + "'");
+  count(Counter::CacheWrites, 1);
+}
+
+// A mapped cache file; column data points into the mapping and stays valid
+// as long as the table lives.
+class MappedTable {
+public:
+  struct Column {
+    std::string name;
+    ColumnType type;
+    const std::uint8_t* data;
+    std::uint64_t bytes;
+  };
+
+  explicit MappedTable(const std::string& path) : file_(path) {
+    const std::uint8_t* p = file_.data();
+    std::uint64_t pos = 0, size = file_.size();
+    auto need = [&](std::uint64_t n) {
+      if (size - pos < n) throw std::runtime_error("corrupt cache file '" + path + "'");
+    };
+    auto u32 = [&] {
+      need(4);
+      std::uint32_t v;
+      std::memcpy(&v, p + pos, 4);
+      pos += 4;
+      return v;
+    };
+    auto u64 = [&] {
+      need(8);
+      std::uint64_t v;
+      std::memcpy(&v, p + pos, 8);
+      pos += 8;
+      return v;
+    };
+    auto str = [&] {
+      std::uint32_t n = u32();
+      need(n);
+      std::string s(reinterpret_cast<const char*>(p + pos), n);
+      pos += n;
+      return s;
+    };
+    need(4);
+    if (std::memcmp(p, "TCHC", 4) != 0) throw std::runtime_error("'" + path + "' is no cache file");
+    pos = 4;
+    if (u32() != 1) throw std::runtime_error("unsupported cache file version in '" + path + "'");
+    nrows_ = u64();
+    std::uint32_t ncols = u32(), nmeta = u32();
+    for (std::uint32_t k = 0; k < nmeta; ++k) {
+      std::string key = str();
+      meta_.emplace_back(key, str());
+    }
+    for (std::uint32_t k = 0; k < ncols; ++k) {
+      Column c;
+      c.type = ColumnType(u32());
+      c.name = str();
+      std::uint64_t off = u64();
+      c.bytes = u64();
+      if (off > size || size - off < c.bytes)
+        throw std::runtime_error("corrupt cache file '" + path + "'");
+      c.data = p + off;
+      columns_.push_back(c);
+    }
+    count(Counter::CacheHits, 1);
+  }
+
+  std::uint64_t nrows() const { return nrows_; }
+  const std::vector<std::pair<std::string, std::string>>& meta() const { return meta_; }
+  const std::vector<Column>& columns() const { return columns_; }
+
+private:
+  MappedFile file_;
+  std::uint64_t nrows_ = 0;
+  std::vector<std::pair<std::string, std::string>> meta_;
+  std::vector<Column> columns_;
+};
+
+// String column encoding: get(i) returns the bytes and length of value i
+// (length -1 for NA)
+template <class Get>
+std::vector<std::uint8_t> encode_strings(std::size_t n, Get get) {
+  std::vector<std::uint8_t> out(n * 4);
+  for (std::size_t i = 0; i < n; ++i) {
+    std::pair<const char*, std::int32_t> s = get(i);
+    std::memcpy(&out[i * 4], &s.second, 4);
+    if (s.second > 0) out.insert(out.end(), s.first, s.first + s.second);
+  }
+  return out;
+}
+
+// put(i, bytes, length) for every value of a string column (length -1 for
+// NA); false if the column is malformed
+template <class Put>
+bool decode_strings(const MappedTable::Column& c, std::uint64_t n, Put put) {
+  if (c.bytes < n * 4) return false;
+  const char* s = reinterpret_cast<const char*>(c.data + n * 4);
+  std::uint64_t left = c.bytes - n * 4;
+  for (std::uint64_t i = 0; i < n; ++i) {
+    std::int32_t len;
+    std::memcpy(&len, c.data + i * 4, 4);
+    if (len > 0 && std::uint64_t(len) > left) return false;
+    put(i, s, len);
+    if (len > 0) {
+      s += len;
+      left -= std::uint64_t(len);
+    }
+  }
+  return true;
+}
+
+} // namespace tch
@@ -0,0 +1,56 @@
+// Fused point cloud -> CHM -> TCH -> AGB kernel.
+//
+// Computes the max CHM at the base resolution, its block mean (TCH) over
+// fact x fact cells and the power law AGB = a * TCH^b in one go. Points
+// are grouped by the TCH cell they fall into and every group is reduced
+// while its fact x fact CHM block is still in cache, so no XYZ table of
+// CHM pixels is ever materialized.
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "aggregate.h"
+#include "chunks.h"
+#include "grid.h"
+#include "metrics.h"
+#include "rasterize.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct TchMap {
+  Grid<float> chm; // base resolution max CHM
+  Grid<float> tch; // mean CHM per fact x fact block
+  Grid<float> agb; // a * tch^b
+};
+
+inline TchMap map_tch(const double* x, const double* y, const double* z, std::size_t n,
+                      const GridSpec& spec, int fact, double a, double b, ThreadPool& pool) {
+  StageTimer timer(TimedStage::Rasterize);
+  count(Counter::BytesRasterized, 3 * sizeof(double) * n);
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  TchMap out;
+  out.chm = Grid<float>(spec, nan);
+  GridSpec coarse = detail::block_layout(spec, fact);
+  out.tch = Grid<float>(coarse, nan);
+  out.agb = Grid<float>(coarse, nan);
+
+  detail::CellOf cell_of{x, y, z, spec};
+  ChunkPlan plan = detail::plan_cell_blocks(cell_of, n, spec, fact, pool);
+  run_chunks(plan, pool, [&](const Chunk& ch, const std::uint32_t* idx) {
+    detail::reduce_points(cell_of, z, ch.ncore, [idx](std::size_t j) { return idx[j]; },
+                          Reducer::Max, 0, out.chm.values.data(), nullptr, nullptr);
+    int row = ch.id / coarse.ncol, col = ch.id % coarse.ncol;
+    // mean of the non-NaN CHM cells of the block, raster::aggregate(fun=mean)
+    float t = block_reduce(out.chm, fact, row, col, Reducer::Mean, 0, nullptr);
+    out.tch.at(row, col) = t;
+    out.agb.at(row, col) = float(a * std::pow(double(t), b));
+  });
+  return out;
+}
+
+} // namespace tch
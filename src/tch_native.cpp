@@ -0,0 +1,1417 @@
+// R entry points of the native TCH-to-biomass pipeline.
+//
+// Compiled with Rcpp::sourceCpp() from R/tch_native.R. The stages
+// themselves live in the headers next to this file and do not depend on
+// R; this file only converts between R objects and the native buffers.
+
+// [[Rcpp::plugins(cpp17)]]
+#include <Rcpp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "aggregate.h"
+#include "bench.h"
+#include "chunks.h"
+#include "csf.h"
+#include "fit.h"
+#include "geotiff.h"
+#include "grid.h"
+#include "integral.h"
+#include "knn.h"
+#include "las_reader.h"
+#include "mask.h"
+#include "metrics.h"
+#include "mosaic.h"
+#include "neighbourhood.h"
+#include "normalize.h"
+#include "octree.h"
+#include "pitfree.h"
+#include "planes.h"
+#include "plot_join.h"
+#include "plot_metrics.h"
+#include "point_file.h"
+#include "predict.h"
+#include "rasterize.h"
+#include "spatial_index.h"
+#include "stage_cache.h"
+#include "tch_map.h"
+#include "thread_pool.h"
+#include "tile_arena.h"
+
+using namespace Rcpp;
+
+#ifndef TCH_NO_METRICS
+// Count what the native code allocates (the stage headers are all
+// compiled into this file), for the native_allocs and native_alloc_bytes
+// counters. No stage allocates over-aligned types, so the align_val_t
+// forms stay the library's. The deletes are kept out of line, or GCC
+// takes the inlined free() for a mismatch with new.
+void* operator new(std::size_t n) {
+  tch::count(tch::Counter::NativeAllocs, 1);
+  tch::count(tch::Counter::NativeAllocBytes, n);
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t n) { return ::operator new(n); }
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+#endif
+
+namespace {
+
+// column of a data.frame/data.table as a double vector; no copy is made
+// when the column already is double
+NumericVector numeric_column(List data, const char* name) {
+  if (!data.containsElementNamed(name))
+    stop(std::string("point cloud has no column '") + name + "'");
+  return as<NumericVector>(data[name]);
+}
+
+// grid as list(values=<nrow x ncol matrix>, xmin, xmax, ymin, ymax), the
+// pieces raster::raster() needs
+List wrap_grid(const tch::Grid<float>& g) {
+  const tch::GridSpec& s = g.spec;
+  NumericMatrix m(s.nrow, s.ncol);
+  for (int r = 0; r < s.nrow; ++r)
+    for (int c = 0; c < s.ncol; ++c) m(r, c) = g.at(r, c);
+  return List::create(Named("values") = m,
+                      Named("xmin") = s.xmin, Named("xmax") = s.xmax(),
+                      Named("ymin") = s.ymin, Named("ymax") = s.ymax());
+}
+
+// persistent k-NN index of a point cloud: the XYZ tree and the cached
+// neighbour lists of every point
+struct KnnIndex {
+  tch::KdTree<3> tree;
+  tch::Neighbours nb;
+  std::size_t npoints = 0;
+};
+
+XPtr<KnnIndex> knn_index(SEXP index) {
+  XPtr<KnnIndex> p(index);
+  if (!p.get()) stop("invalid k-NN index, rebuild it with knn.index()");
+  return p;
+}
+
+// hash of an R vector or (nested) list: type, length, values and names
+void hash_sexp(tch::Hash64& h, SEXP x) {
+  std::uint32_t type = std::uint32_t(TYPEOF(x));
+  std::uint64_t n = std::uint64_t(Rf_xlength(x));
+  h.update(&type, sizeof type);
+  h.update(&n, sizeof n);
+  switch (TYPEOF(x)) {
+  case NILSXP: break;
+  case REALSXP: h.update(REAL(x), n * sizeof(double)); break;
+  case INTSXP: case LGLSXP: h.update(INTEGER(x), n * sizeof(int)); break;
+  case STRSXP:
+    for (std::uint64_t i = 0; i < n; ++i) {
+      SEXP s = STRING_ELT(x, R_xlen_t(i));
+      if (s == NA_STRING) {
+        std::uint64_t na = ~std::uint64_t(0);
+        h.update(&na, sizeof na);
+      } else {
+        h.update(std::string(Rf_translateCharUTF8(s)));
+      }
+    }
+    break;
+  case VECSXP:
+    for (std::uint64_t i = 0; i < n; ++i) hash_sexp(h, VECTOR_ELT(x, R_xlen_t(i)));
+    break;
+  default: stop("cannot hash an object of R type " + std::to_string(TYPEOF(x)));
+  }
+  SEXP names = Rf_getAttrib(x, R_NamesSymbol);
+  if (!Rf_isNull(names)) hash_sexp(h, names);
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+List cpp_rasterize(List data, double res, std::string func, double prob, int threads) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  tch::GridSpec spec = tch::grid_spec_covering(x.begin(), y.begin(), x.size(), res);
+  tch::ThreadPool pool(threads);
+  tch::Grid<float> g = tch::rasterize(x.begin(), y.begin(), z.begin(), x.size(), spec,
+                                      tch::parse_reducer(func), prob, &pool);
+  return wrap_grid(g);
+}
+
+// values row-major from the northern edge, as raster::getValues() returns them
+// [[Rcpp::export]]
+List cpp_aggregate_grid(NumericVector values, int nrow, int ncol, double xmin, double ymin,
+                        double res, int fact, std::string func, double prob, int threads) {
+  if (values.size() != R_xlen_t(nrow) * ncol) stop("values do not match nrow x ncol");
+  tch::GridSpec spec;
+  spec.xmin = xmin;
+  spec.ymin = ymin;
+  spec.res = res;
+  spec.ncol = ncol;
+  spec.nrow = nrow;
+  tch::Grid<float> g(spec, 0);
+  for (R_xlen_t i = 0; i < values.size(); ++i) g.values[std::size_t(i)] = float(values[i]);
+  tch::ThreadPool pool(threads);
+  return wrap_grid(tch::aggregate(g, fact, tch::parse_reducer(func), prob, pool));
+}
+
+// [[Rcpp::export]]
+DataFrame cpp_chunk_plan(List data, double size, double buffer) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  tch::ChunkPlan plan = tch::plan_chunks(x.begin(), y.begin(), x.size(), size, buffer);
+  std::size_t n = plan.chunks.size();
+  IntegerVector id(n), ncore(n), nbuffer(n);
+  NumericVector xmin(n), xmax(n), ymin(n), ymax(n);
+  for (std::size_t k = 0; k < n; ++k) {
+    const tch::Chunk& ch = plan.chunks[k];
+    id[k] = ch.id + 1;
+    xmin[k] = ch.xmin; xmax[k] = ch.xmax;
+    ymin[k] = ch.ymin; ymax[k] = ch.ymax;
+    ncore[k] = int(ch.ncore);
+    nbuffer[k] = int(ch.nbuffer);
+  }
+  return DataFrame::create(Named("ChunkID") = id, Named("xmin") = xmin, Named("xmax") = xmax,
+                           Named("ymin") = ymin, Named("ymax") = ymax,
+                           Named("ncore") = ncore, Named("nbuffer") = nbuffer);
+}
+
+namespace {
+
+tch::LasColumns read_las_columns(const tch::LasReader& reader, const std::string& file,
+                                 const tch::ColumnSelection& sel, Nullable<NumericVector> window,
+                                 tch::ThreadPool& pool) {
+  if (window.isNull()) return reader.read(sel, nullptr, &pool);
+  NumericVector w(window.get());
+  if (w.size() != 4) stop("window must be c(xmin, ymin, xmax, ymax)");
+  tch::Window win{w[0], w[1], w[2], w[3]};
+  return reader.read(sel, &win, &pool, tch::chunk_index(file, reader, &pool));
+}
+
+// quantized coordinates are converted here, on the way to R
+NumericVector coordinate_column(const tch::LasColumns& c, const tch::LasHeader& h, int d) {
+  const std::vector<double>& v = d == 0 ? c.x : d == 1 ? c.y : c.z;
+  if (!v.empty() || c.qx.empty()) return NumericVector(v.begin(), v.end());
+  tch::QuantizedAxis a = h.axis(d == 0 ? c.qx : d == 1 ? c.qy : c.qz, d);
+  NumericVector out(c.qx.size());
+  for (std::size_t i = 0; i < c.qx.size(); ++i) out[i] = a[i];
+  return out;
+}
+
+List las_columns_list(const tch::LasColumns& c, const tch::LasHeader& h,
+                      const tch::ColumnSelection& sel) {
+  List out = List::create(Named("X") = coordinate_column(c, h, 0),
+                          Named("Y") = coordinate_column(c, h, 1),
+                          Named("Z") = coordinate_column(c, h, 2));
+  if (sel.gpstime) out.push_back(NumericVector(c.gpstime.begin(), c.gpstime.end()), "gpstime");
+  if (sel.intensity) out.push_back(IntegerVector(c.intensity.begin(), c.intensity.end()), "Intensity");
+  if (sel.return_number)
+    out.push_back(IntegerVector(c.return_number.begin(), c.return_number.end()), "ReturnNumber");
+  if (sel.number_of_returns)
+    out.push_back(IntegerVector(c.number_of_returns.begin(), c.number_of_returns.end()), "NumberOfReturns");
+  if (sel.classification)
+    out.push_back(IntegerVector(c.classification.begin(), c.classification.end()), "Classification");
+  return out;
+}
+
+// a LAS/LAZ file read into quantized columns that stay on the C++ side
+struct Cloud {
+  tch::LasHeader header;
+  tch::ColumnSelection sel;
+  tch::LasColumns cols;
+
+  tch::QuantizedAxis axis(int d) const {
+    return header.axis(d == 0 ? cols.qx : d == 1 ? cols.qy : cols.qz, d);
+  }
+};
+
+XPtr<Cloud> cloud_handle(SEXP h) {
+  XPtr<Cloud> p(h);
+  if (!p.get()) stop("invalid point cloud, read it with read.cloud.native()");
+  return p;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+List cpp_read_las(std::string file, std::string select, Nullable<NumericVector> window, int threads) {
+  tch::LasReader reader(file);
+  tch::ColumnSelection sel = tch::ColumnSelection::parse(select);
+  tch::ThreadPool pool(threads);
+  return las_columns_list(read_las_columns(reader, file, sel, window, pool), reader.header(), sel);
+}
+
+// [[Rcpp::export]]
+SEXP cpp_cloud_read(std::string file, std::string select, Nullable<NumericVector> window,
+                    int threads) {
+  tch::LasReader reader(file);
+  XPtr<Cloud> p(new Cloud(), true);
+  p->header = reader.header();
+  p->sel = tch::ColumnSelection::parse(select);
+  p->sel.quantized = true;
+  tch::ThreadPool pool(threads);
+  p->cols = read_las_columns(reader, file, p->sel, window, pool);
+  p.attr("class") = "tch_cloud";
+  return p;
+}
+
+// points and bytes held, scale and offset of X, Y, Z
+// [[Rcpp::export]]
+List cpp_cloud_info(SEXP cloud) {
+  XPtr<Cloud> p = cloud_handle(cloud);
+  const tch::LasColumns& c = p->cols;
+  double bytes = double(sizeof(std::int32_t)) * (c.qx.size() + c.qy.size() + c.qz.size() +
+                                                 c.intensity.size() + c.return_number.size() +
+                                                 c.number_of_returns.size() + c.classification.size()) +
+                 double(sizeof(double)) * c.gpstime.size();
+  const tch::LasHeader& h = p->header;
+  return List::create(Named("points") = double(c.size()), Named("bytes") = bytes,
+                      Named("scale") = NumericVector(h.scale, h.scale + 3),
+                      Named("offset") = NumericVector(h.offset, h.offset + 3));
+}
+
+// the columns as cpp_read_las() returns them
+// [[Rcpp::export]]
+List cpp_cloud_data(SEXP cloud) {
+  XPtr<Cloud> p = cloud_handle(cloud);
+  return las_columns_list(p->cols, p->header, p->sel);
+}
+
+// [[Rcpp::export]]
+List cpp_cloud_rasterize(SEXP cloud, double res, std::string func, double prob, int threads) {
+  XPtr<Cloud> p = cloud_handle(cloud);
+  tch::QuantizedAxis x = p->axis(0), y = p->axis(1), z = p->axis(2);
+  std::size_t n = p->cols.size();
+  tch::GridSpec spec = tch::grid_spec_covering(x, y, n, res);
+  tch::ThreadPool pool(threads);
+  tch::Grid<float> g;
+  tch::RasterScratch s;
+  tch::rasterize_into(g, x, y, z, n, spec, tch::parse_reducer(func), prob, &pool, 256, s);
+  return wrap_grid(g);
+}
+
+// [[Rcpp::export]]
+int cpp_index_las(std::string file, int threads) {
+  tch::LasReader reader(file);
+  tch::ThreadPool pool(threads);
+  tch::write_chunk_index(file, reader, reader.chunk_bounds(&pool));
+  return int(reader.nchunks());
+}
+
+// AGB = a * x^b into a new vector; with vcov, also the interval bands
+// fit -/+ t * se. values is never written: getValues() of an in-memory
+// RasterLayer is the layer's own data, so predicting into it would turn
+// the caller's TCH into AGB
+// [[Rcpp::export]]
+List cpp_predict_power_law(NumericVector values, double a, double b, Nullable<NumericMatrix> vcov,
+                           double sigma2, double t, int threads) {
+  NumericVector x(values.begin(), values.end());
+  tch::PowerLaw m;
+  m.a = a;
+  m.b = b;
+  NumericVector lower, upper;
+  if (vcov.isNotNull()) {
+    NumericMatrix v(vcov.get());
+    if (v.nrow() != 2 || v.ncol() != 2) stop("vcov must be the 2 x 2 covariance of (a, b)");
+    m.vaa = v(0, 0);
+    m.vab = v(0, 1);
+    m.vbb = v(1, 1);
+    m.sigma2 = sigma2;
+    m.t = t;
+    lower = NumericVector(x.size());
+    upper = NumericVector(x.size());
+  }
+  tch::ThreadPool pool(threads);
+  bool bands = vcov.isNotNull();
+  tch::predict_power_law(m, x.begin(), x.begin(), x.size(), bands ? lower.begin() : nullptr,
+                         bands ? upper.begin() : nullptr, pool);
+  if (!bands) return List::create(Named("fit") = x);
+  return List::create(Named("fit") = x, Named("lwr") = lower, Named("upr") = upper);
+}
+
+// [[Rcpp::export]]
+List cpp_predict_power_law_ensemble(NumericVector values, NumericVector a, NumericVector b,
+                                    double level, int threads) {
+  if (a.size() != b.size()) stop("a and b differ in length");
+  R_xlen_t n = values.size();
+  NumericVector mean(n), sd(n), lower(n), upper(n);
+  tch::ThreadPool pool(threads);
+  tch::predict_power_law_ensemble(a.begin(), b.begin(), a.size(), values.begin(), n, level,
+                                  mean.begin(), sd.begin(), lower.begin(), upper.begin(), pool);
+  return List::create(Named("mean") = mean, Named("sd") = sd, Named("lwr") = lower,
+                      Named("upr") = upper);
+}
+
+namespace {
+
+std::vector<std::uint32_t> fit_observations(NumericVector x, NumericVector y) {
+  if (x.size() != y.size()) stop("x and y differ in length");
+  std::vector<std::uint32_t> obs = tch::valid_observations(x.begin(), y.begin(), x.size());
+  if (obs.size() < 3) stop("at least 3 observations with x > 0 are needed");
+  return obs;
+}
+
+List wrap_fit(const tch::PowerLawFit& f) {
+  return List::create(Named("a") = f.a, Named("b") = f.b, Named("rss") = f.rss,
+                      Named("iterations") = f.iterations, Named("converged") = f.converged);
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+DataFrame cpp_bootstrap_power_law(NumericVector x, NumericVector y, double a0, double b0,
+                                  int replicates, double seed, int max_iter, double tol,
+                                  int threads) {
+  std::vector<std::uint32_t> obs = fit_observations(x, y);
+  tch::LmParams p;
+  p.max_iter = max_iter;
+  p.tol = tol;
+  tch::PowerLawFit full = tch::fit_power_law(x.begin(), y.begin(), obs.data(), obs.size(), a0, b0, p);
+  if (!full.converged) stop("the fit on all observations did not converge");
+  tch::ThreadPool pool(threads);
+  std::vector<tch::PowerLawFit> fits = tch::bootstrap_power_law(
+      x.begin(), y.begin(), obs, full, std::size_t(replicates), std::uint64_t(seed), p, pool);
+  NumericVector a(fits.size()), b(fits.size()), rss(fits.size());
+  LogicalVector converged(fits.size());
+  for (std::size_t r = 0; r < fits.size(); ++r) {
+    a[r] = fits[r].a;
+    b[r] = fits[r].b;
+    rss[r] = fits[r].rss;
+    converged[r] = fits[r].converged;
+  }
+  DataFrame out = DataFrame::create(Named("a") = a, Named("b") = b, Named("rss") = rss,
+                                    Named("converged") = converged);
+  out.attr("fit") = wrap_fit(full);
+  return out;
+}
+
+// out-of-fold predictions as an n x repeats matrix (NA for observations
+// that cannot be fitted)
+// [[Rcpp::export]]
+List cpp_cv_power_law(NumericVector x, NumericVector y, double a0, double b0, int k, int repeats,
+                      double seed, int max_iter, double tol, int threads) {
+  std::vector<std::uint32_t> obs = fit_observations(x, y);
+  tch::LmParams p;
+  p.max_iter = max_iter;
+  p.tol = tol;
+  tch::PowerLawFit full = tch::fit_power_law(x.begin(), y.begin(), obs.data(), obs.size(), a0, b0, p);
+  tch::ThreadPool pool(threads);
+  tch::CrossValidation cv = tch::cross_validate_power_law(x.begin(), y.begin(), obs, full, k, repeats,
+                                                          std::uint64_t(seed), p, pool);
+  NumericMatrix pred(int(x.size()), repeats);
+  std::fill(pred.begin(), pred.end(), NA_REAL);
+  for (int rep = 0; rep < repeats; ++rep)
+    for (std::size_t j = 0; j < obs.size(); ++j)
+      pred(int(obs[j]), rep) = cv.pred[std::size_t(rep) * obs.size() + j];
+  NumericVector a(cv.fits.size()), b(cv.fits.size());
+  for (std::size_t t = 0; t < cv.fits.size(); ++t) {
+    a[t] = cv.fits[t].a;
+    b[t] = cv.fits[t].b;
+  }
+  return List::create(Named("pred") = pred, Named("a") = a, Named("b") = b,
+                      Named("fit") = wrap_fit(full));
+}
+
+// [[Rcpp::export]]
+List cpp_map_tch(List data, double res, int fact, double a, double b, int threads) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  tch::GridSpec spec = tch::grid_spec_covering(x.begin(), y.begin(), x.size(), res);
+  tch::ThreadPool pool(threads);
+  tch::TchMap m = tch::map_tch(x.begin(), y.begin(), z.begin(), x.size(), spec, fact, a, b, pool);
+  return List::create(Named("chm") = wrap_grid(m.chm), Named("tch") = wrap_grid(m.tch),
+                      Named("agb") = wrap_grid(m.agb));
+}
+
+// [[Rcpp::export]]
+IntegerVector cpp_spatial_index(NumericVector x, NumericVector y, double res, double minx,
+                                double miny, double maxx, double maxy, bool morton) {
+  if (x.size() != y.size()) stop("xcor and ycor differ in length");
+  tch::IndexGrid g = tch::index_grid(minx, miny, maxx, maxy, res, morton);
+  IntegerVector id(x.size());
+  tch::spatial_index(x.begin(), y.begin(), x.size(), g, id.begin());
+  id.attr("ncells") = double(g.ncells());
+  return id;
+}
+
+// [[Rcpp::export]]
+DataFrame cpp_aggregate_by_index(NumericVector values, IntegerVector id, std::string func) {
+  if (values.size() != id.size()) stop("values and index differ in length");
+  std::int64_t ncells = 0;
+  for (int v : id) ncells = std::max<std::int64_t>(ncells, v);
+  tch::IndexGroups g = tch::group_by_index(id.begin(), id.size(), ncells);
+  bool mean = func == "mean", sum = func == "sum", max = func == "max";
+  if (!mean && !sum && !max) stop("func must be 'mean', 'sum' or 'max'");
+  std::vector<int> out_id;
+  std::vector<double> out_value;
+  for (std::int64_t k = 0; k < ncells; ++k) {
+    std::uint32_t b = g.start[k], e = g.start[k + 1];
+    if (b == e) continue;
+    // segmented reduction over the contiguous members of cell k + 1
+    double acc = max ? R_NegInf : 0;
+    std::size_t n = 0;
+    for (std::uint32_t j = b; j < e; ++j) {
+      double v = values[g.order[j]];
+      if (ISNAN(v)) continue;
+      acc = max ? std::max(acc, v) : acc + v;
+      ++n;
+    }
+    out_id.push_back(int(k + 1));
+    out_value.push_back(n == 0 ? (sum ? 0 : NA_REAL) : (mean ? acc / n : acc));
+  }
+  return DataFrame::create(Named("ID") = IntegerVector(out_id.begin(), out_id.end()),
+                           Named("value") = NumericVector(out_value.begin(), out_value.end()));
+}
+
+// Metrics of the points of every cell id (1-based, NA ignored) of data
+// (Z, plus ReturnNumber and NumberOfReturns for return metrics): a
+// data.frame with ID and one column per metric, cells with points only.
+// [[Rcpp::export]]
+DataFrame cpp_plot_metrics(List data, IntegerVector id, CharacterVector metrics, double above,
+                           double precision, int threads) {
+  NumericVector z = numeric_column(data, "Z");
+  if (id.size() != z.size()) stop("index and point cloud differ in length");
+  std::vector<tch::Metric> ms;
+  bool returns = false;
+  for (R_xlen_t m = 0; m < metrics.size(); ++m) {
+    ms.push_back(tch::parse_metric(std::string(metrics[m])));
+    returns = returns || ms.back().needs_returns();
+  }
+  tch::MetricInput in;
+  in.z = z.begin();
+  in.id = id.begin();
+  in.n = std::size_t(z.size());
+  for (int v : id) in.ncells = std::max<std::int64_t>(in.ncells, v);
+  in.above = above;
+  in.precision = precision;
+  IntegerVector rn, nr;
+  if (returns) {
+    if (!data.containsElementNamed("ReturnNumber") || !data.containsElementNamed("NumberOfReturns"))
+      stop("return metrics need the columns ReturnNumber and NumberOfReturns");
+    rn = as<IntegerVector>(data["ReturnNumber"]);
+    nr = as<IntegerVector>(data["NumberOfReturns"]);
+    in.return_number = rn.begin();
+    in.number_of_returns = nr.begin();
+  }
+  tch::ThreadPool pool(threads);
+  tch::PlotMetrics pm = tch::plot_metrics(in, ms, pool);
+  List out(ms.size() + 1);
+  CharacterVector names(ms.size() + 1);
+  out[R_xlen_t(0)] = IntegerVector(pm.id.begin(), pm.id.end());
+  names[R_xlen_t(0)] = "ID";
+  for (std::size_t m = 0; m < ms.size(); ++m) {
+    out[R_xlen_t(m + 1)] = NumericVector(pm.columns[m].begin(), pm.columns[m].end());
+    names[R_xlen_t(m + 1)] = ms[m].name;
+  }
+  out.attr("names") = names;
+  return DataFrame(out);
+}
+
+// values row-major from the northern edge, as raster::getValues() returns them
+// [[Rcpp::export]]
+List cpp_pit_free(NumericVector values, int nrow, int ncol, double xmin, double ymin, double res,
+                  double dz, int passes, int min_valid, int threads) {
+  if (values.size() != R_xlen_t(nrow) * ncol) stop("values do not match nrow x ncol");
+  tch::GridSpec spec;
+  spec.xmin = xmin;
+  spec.ymin = ymin;
+  spec.res = res;
+  spec.ncol = ncol;
+  spec.nrow = nrow;
+  tch::Grid<float> g(spec, 0);
+  for (R_xlen_t i = 0; i < values.size(); ++i) g.values[std::size_t(i)] = float(values[i]);
+  tch::PitFreeParams p;
+  p.dz = float(dz);
+  p.passes = passes;
+  p.min_valid = min_valid;
+  tch::ThreadPool pool(threads);
+  return wrap_grid(tch::pit_free(g, p, pool));
+}
+
+namespace {
+
+XPtr<tch::IntegralImage> integral_handle(SEXP h) {
+  XPtr<tch::IntegralImage> p(h);
+  if (!p.get()) stop("invalid integral image, rebuild it with integral.image()");
+  return p;
+}
+
+} // namespace
+
+// summed-area tables of a CHM, values row-major from the northern edge
+// [[Rcpp::export]]
+SEXP cpp_integral_image(NumericVector values, int nrow, int ncol, double xmin, double ymin, double res,
+                        int threads) {
+  if (values.size() != R_xlen_t(nrow) * ncol) stop("values do not match nrow x ncol");
+  tch::GridSpec spec;
+  spec.xmin = xmin;
+  spec.ymin = ymin;
+  spec.res = res;
+  spec.ncol = ncol;
+  spec.nrow = nrow;
+  tch::Grid<float> g(spec, 0);
+  for (R_xlen_t i = 0; i < values.size(); ++i) g.values[std::size_t(i)] = float(values[i]);
+  tch::ThreadPool pool(threads);
+  XPtr<tch::IntegralImage> p(new tch::IntegralImage(g, pool), true);
+  p.attr("class") = "tch_integral";
+  return p;
+}
+
+// TCH of fact x fact blocks with edges through the cell corner nearest (x0, y0)
+// [[Rcpp::export]]
+List cpp_integral_tch(SEXP integral, int fact, double x0, double y0, int threads) {
+  XPtr<tch::IntegralImage> ii = integral_handle(integral);
+  tch::ThreadPool pool(threads);
+  return wrap_grid(tch::block_means(*ii, tch::block_layout_at(ii->spec(), fact, x0, y0), pool));
+}
+
+// TCH of the rectangles [xmin, xmax) x [ymin, ymax), by cell centres
+// [[Rcpp::export]]
+NumericVector cpp_integral_query(SEXP integral, NumericVector xmin, NumericVector xmax, NumericVector ymin,
+                                 NumericVector ymax) {
+  XPtr<tch::IntegralImage> ii = integral_handle(integral);
+  R_xlen_t n = xmin.size();
+  if (xmax.size() != n || ymin.size() != n || ymax.size() != n) stop("the rectangle bounds differ in length");
+  NumericVector out(n);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    double v = ii->mean_in(xmin[i], xmax[i], ymin[i], ymax[i]);
+    out[i] = std::isnan(v) ? NA_REAL : v;
+  }
+  return out;
+}
+
+// c(xmin, ymin, res, nrow, ncol, bytes) of an integral image
+// [[Rcpp::export]]
+NumericVector cpp_integral_info(SEXP integral) {
+  XPtr<tch::IntegralImage> ii = integral_handle(integral);
+  const tch::GridSpec& s = ii->spec();
+  return NumericVector::create(Named("xmin") = s.xmin, Named("ymin") = s.ymin, Named("res") = s.res,
+                               Named("nrow") = s.nrow, Named("ncol") = s.ncol,
+                               Named("bytes") = double(ii->bytes()));
+}
+
+// Join trees (X, Y and the value column) and CHM heights onto the plots
+// of one grid. heights is a point table (X, Y, Z) or a raster as
+// list(values, nrow, ncol, xmin, ymax, res); origin c(x0, y0) defaults to
+// the lower left corner of both.
+// [[Rcpp::export]]
+List cpp_plot_join(List trees, std::string value, List heights, double res, NumericVector origin,
+                   int threads) {
+  NumericVector tx = numeric_column(trees, "X"), ty = numeric_column(trees, "Y");
+  NumericVector agb = numeric_column(trees, value.c_str());
+  tch::HeightSource hs;
+  NumericVector hx, hy, hz, hv;
+  const double inf = std::numeric_limits<double>::infinity();
+  double minx = inf, miny = inf, maxx = -inf, maxy = -inf;
+  auto extend = [&](const NumericVector& x, const NumericVector& y) {
+    for (R_xlen_t i = 0; i < x.size(); ++i) {
+      if (ISNAN(x[i]) || ISNAN(y[i])) continue;
+      minx = std::min(minx, x[i]); maxx = std::max(maxx, x[i]);
+      miny = std::min(miny, y[i]); maxy = std::max(maxy, y[i]);
+    }
+  };
+  extend(tx, ty);
+  if (heights.containsElementNamed("values")) {
+    hv = as<NumericVector>(heights["values"]);
+    hs.values = hv.begin();
+    hs.nrow = as<int>(heights["nrow"]);
+    hs.ncol = as<int>(heights["ncol"]);
+    hs.xmin = as<double>(heights["xmin"]);
+    hs.ymax = as<double>(heights["ymax"]);
+    hs.res = as<double>(heights["res"]);
+    if (R_xlen_t(hs.size()) != hv.size()) stop("CHM values do not match nrow x ncol");
+    if (hs.size() > 0) {
+      // the corner of the raster and its last cell centres
+      minx = std::min(minx, hs.xmin); maxx = std::max(maxx, hs.xmin + (hs.ncol - 0.5) * hs.res);
+      miny = std::min(miny, hs.ymax - hs.nrow * hs.res); maxy = std::max(maxy, hs.ymax - 0.5 * hs.res);
+    }
+  } else {
+    hx = numeric_column(heights, "X");
+    hy = numeric_column(heights, "Y");
+    hz = numeric_column(heights, "Z");
+    hs.x = hx.begin();
+    hs.y = hy.begin();
+    hs.z = hz.begin();
+    hs.n = hz.size();
+    extend(hx, hy);
+  }
+  if (origin.size() == 2) {
+    minx = origin[0];
+    miny = origin[1];
+  } else if (origin.size() != 0) {
+    stop("origin must be c(x0, y0)");
+  }
+  if (!(maxx >= minx)) stop("no trees or CHM cells to join");
+  tch::PlotLayout layout = tch::plot_layout(minx, miny, maxx, maxy, res);
+  tch::ThreadPool pool(threads);
+  tch::PlotJoin j = tch::plot_join(layout, tx.begin(), ty.begin(), agb.begin(), tx.size(), hs, pool);
+  std::size_t n = j.plots.size();
+  NumericVector id(n), sum(n), tch(n);
+  IntegerVector ntrees(n), ncells(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    const tch::PlotStats& p = j.plots[i];
+    id[i] = double(p.id());
+    sum[i] = p.agb;
+    tch[i] = p.tch();
+    ntrees[i] = int(p.ntrees);
+    ncells[i] = int(p.ncells);
+  }
+  SEXP spat_id = id;
+  if (double(layout.ncols) * layout.nrows <= INT32_MAX) spat_id = as<IntegerVector>(id);
+  DataFrame plots = DataFrame::create(Named("SpatID") = spat_id, Named(value.c_str()) = sum,
+                                      Named("TCH") = tch, Named("ntrees") = ntrees,
+                                      Named("ncells") = ncells);
+  return List::create(Named("plots") = plots, Named("origin") = NumericVector{layout.x0, layout.y0},
+                      Named("ncols") = double(layout.ncols),
+                      Named("trees_outside") = double(j.trees_outside),
+                      Named("cells_outside") = double(j.cells_outside));
+}
+
+// k-NN index of all points, or with subset (a logical vector) of the kept
+// points only: the tree holds them and the neighbour lists are theirs
+// [[Rcpp::export]]
+SEXP cpp_knn_index(List data, int k, Nullable<LogicalVector> subset, int threads) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  const double* coords[3] = {x.begin(), y.begin(), z.begin()};
+  tch::ThreadPool pool(threads);
+  XPtr<KnnIndex> p(new KnnIndex, true);
+  p->npoints = x.size();
+  if (subset.isNotNull()) {
+    LogicalVector keep(subset.get());
+    if (keep.size() != x.size()) stop("subset and data differ in length");
+    std::vector<std::uint32_t> rows;
+    for (R_xlen_t i = 0; i < keep.size(); ++i)
+      if (keep[i] == 1) rows.push_back(std::uint32_t(i));
+    p->tree = tch::KdTree<3>(coords, x.size(), rows.data(), rows.size());
+    p->nb = tch::knn_adjacency(p->tree, coords, x.size(), k, pool, rows.data(), rows.size());
+  } else {
+    p->tree = tch::KdTree<3>(coords, x.size());
+    p->nb = tch::knn_adjacency(p->tree, coords, x.size(), k, pool);
+  }
+  p.attr("class") = "tch_knn";
+  p.attr("k") = k;
+  p.attr("npoints") = double(x.size());
+  return p;
+}
+
+// [[Rcpp::export]]
+IntegerMatrix cpp_knn_neighbours(SEXP index) {
+  XPtr<KnnIndex> p = knn_index(index);
+  const tch::Neighbours& nb = p->nb;
+  IntegerMatrix m(int(nb.size()), nb.k);
+  for (std::size_t r = 0; r < nb.size(); ++r)
+    for (int j = 0; j < nb.k; ++j)
+      m(int(r), j) = std::size_t(j) < nb.count(r) ? int(nb.begin(r)[j]) + 1 : NA_INTEGER;
+  return m;
+}
+
+// planar flag of every point from the covariance of its neighbours;
+// points without a row in the index (filtered out) are FALSE
+// [[Rcpp::export]]
+LogicalVector cpp_segment_planes(SEXP index, List data, double th1, double th2, int threads) {
+  XPtr<KnnIndex> p = knn_index(index);
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  if (std::size_t(x.size()) != p->npoints) stop("the k-NN index was built on a different point cloud");
+  LogicalVector planar(x.size(), 0);
+  tch::ThreadPool pool(threads);
+  tch::segment_planes(x.begin(), y.begin(), z.begin(), p->nb, th1, th2, planar.begin(), pool);
+  return planar;
+}
+
+// [[Rcpp::export]]
+List cpp_neighbour_fraction(SEXP index, LogicalVector flag, double threshold, int threads) {
+  XPtr<KnnIndex> p = knn_index(index);
+  if (std::size_t(flag.size()) != p->npoints)
+    stop("the k-NN index was built on a different point cloud");
+  std::size_t n = p->npoints;
+  // the fractions exactly as compared with the threshold, so a label can
+  // be recomputed from them for another threshold
+  NumericVector frac(n, NA_REAL);
+  IntegerVector label(n, NA_INTEGER);
+  tch::ThreadPool pool(threads);
+  tch::neighbour_fraction(p->nb, flag.begin(), threshold, frac.begin(), label.begin(), pool);
+  return List::create(Named("fraction") = frac, Named("label") = label);
+}
+
+// [[Rcpp::export]]
+LogicalVector cpp_csf_ground(List data, LogicalVector use, double class_threshold,
+                             double cloth_resolution, int rigidness, int iterations,
+                             double time_step, double tile, double buffer, int threads) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  if (use.size() != x.size()) stop("use and the point cloud differ in length");
+  tch::CsfParams p;
+  p.class_threshold = class_threshold;
+  p.cloth_resolution = cloth_resolution;
+  p.rigidness = rigidness;
+  p.iterations = iterations;
+  p.time_step = time_step;
+  p.tile = tile;
+  p.buffer = buffer;
+  tch::ThreadPool pool(threads);
+  LogicalVector ground(x.size());
+  std::vector<int> steps = tch::csf_ground(x.begin(), y.begin(), z.begin(), x.size(), use.begin(),
+                                           p, pool, ground.begin());
+  // steps every cloth piece ran, to check how early they converged
+  ground.attr("steps") = IntegerVector(steps.begin(), steps.end());
+  return ground;
+}
+
+// [[Rcpp::export]]
+List cpp_normalize_dtm(List data, IntegerVector classification, IntegerVector use_class,
+                       double res, int k, double p, double rmax, int check, int threads) {
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  std::size_t n = x.size();
+  if (std::size_t(classification.size()) != n)
+    stop("Classification and the point cloud differ in length");
+  std::vector<std::uint32_t> ground;
+  for (std::size_t i = 0; i < n; ++i)
+    if (!ISNAN(z[i]) && std::find(use_class.begin(), use_class.end(), classification[i]) != use_class.end())
+      ground.push_back(std::uint32_t(i));
+  if (ground.empty()) stop("no ground points, classify the ground first");
+  tch::IdwParams ip;
+  ip.k = k;
+  ip.p = p;
+  ip.rmax = rmax;
+  tch::ThreadPool pool(threads);
+  tch::GroundIdw idw(x.begin(), y.begin(), z.begin(), ground.data(), ground.size(), n, ip);
+  tch::GridSpec spec = tch::grid_spec_covering(x.begin(), y.begin(), n, res);
+  tch::Grid<double> dtm = tch::idw_dtm(idw, spec, pool);
+  NumericVector zn(z.begin(), z.end());
+  tch::subtract_dtm(dtm, x.begin(), y.begin(), zn.begin(), n, pool);
+  tch::DtmError e = tch::dtm_error(dtm, idw, x.begin(), y.begin(), n, std::size_t(std::max(check, 0)), pool);
+  return List::create(Named("Z") = zn,
+                      Named("error") = List::create(Named("n") = double(e.n),
+                                                    Named("max") = e.max_abs,
+                                                    Named("mean") = e.mean_abs,
+                                                    Named("rmse") = e.rmse,
+                                                    Named("q99") = e.q99));
+}
+
+// [[Rcpp::export]]
+double cpp_mask_heights(List data, CharacterVector columns, NumericVector values, double fill,
+                        int threads) {
+  if (columns.size() != values.size()) stop("every rule needs one attribute and one value");
+  if (!data.containsElementNamed("Z") || TYPEOF(data["Z"]) != REALSXP)
+    stop("point cloud has no double column 'Z'");
+  // written through in place, like data.table::set()
+  NumericVector z = data["Z"];
+  std::vector<tch::MaskRule> rules;
+  for (R_xlen_t j = 0; j < columns.size(); ++j) {
+    std::string name(columns[j]);
+    if (!data.containsElementNamed(name.c_str()))
+      stop("point cloud has no column '" + name + "'");
+    SEXP col = data[name];
+    if (Rf_xlength(col) != z.size()) stop("column '" + name + "' has the wrong length");
+    tch::MaskRule r;
+    r.value = values[j];
+    if (TYPEOF(col) == REALSXP) r.real = REAL(col);
+    else if (TYPEOF(col) == INTSXP || TYPEOF(col) == LGLSXP) r.int32 = INTEGER(col);
+    else stop("column '" + name + "' is not numeric or logical");
+    rules.push_back(r);
+  }
+  tch::ThreadPool pool(threads);
+  return double(tch::mask_heights(z.begin(), z.size(), rules, fill, pool));
+}
+
+// [[Rcpp::export]]
+std::string cpp_hash_file(std::string path) {
+  return tch::hash_hex(tch::hash_file(path));
+}
+
+// [[Rcpp::export]]
+std::string cpp_hash_data(SEXP x) {
+  tch::Hash64 h;
+  hash_sexp(h, x);
+  return tch::hash_hex(h.value());
+}
+
+// [[Rcpp::export]]
+std::string cpp_cache_key(CharacterVector parts) {
+  tch::Hash64 h;
+  for (R_xlen_t i = 0; i < parts.size(); ++i) h.update(std::string(parts[i]));
+  return tch::hash_hex(h.value());
+}
+
+// [[Rcpp::export]]
+void cpp_cache_write(std::string path, List columns, CharacterVector meta) {
+  std::vector<std::pair<std::string, std::string>> kv;
+  if (meta.size() > 0) {
+    CharacterVector keys = meta.names();
+    for (R_xlen_t k = 0; k < meta.size(); ++k)
+      kv.emplace_back(std::string(keys[k]), std::string(meta[k]));
+  }
+  CharacterVector names = columns.names();
+  R_xlen_t n = columns.size() ? Rf_xlength(VECTOR_ELT(columns, 0)) : 0;
+  std::vector<tch::TableColumn> cols;
+  std::vector<std::vector<std::uint8_t>> strings;
+  strings.reserve(columns.size()); // cols point into it
+  for (R_xlen_t j = 0; j < columns.size(); ++j) {
+    SEXP col = columns[j];
+    std::string name(names[j]);
+    if (Rf_xlength(col) != n) stop("column '" + name + "' has the wrong length");
+    std::uint64_t m = std::uint64_t(n);
+    switch (TYPEOF(col)) {
+    case REALSXP: cols.push_back({name, tch::ColumnType::Double, REAL(col), m * sizeof(double)}); break;
+    case INTSXP: cols.push_back({name, tch::ColumnType::Int32, INTEGER(col), m * sizeof(int)}); break;
+    case LGLSXP: cols.push_back({name, tch::ColumnType::Logical, LOGICAL(col), m * sizeof(int)}); break;
+    case STRSXP:
+      strings.push_back(tch::encode_strings(m, [col](std::size_t i) {
+        SEXP s = STRING_ELT(col, R_xlen_t(i));
+        if (s == NA_STRING) return std::pair<const char*, std::int32_t>(nullptr, -1);
+        const char* c = Rf_translateCharUTF8(s);
+        return std::pair<const char*, std::int32_t>(c, std::int32_t(std::strlen(c)));
+      }));
+      cols.push_back({name, tch::ColumnType::String, strings.back().data(), strings.back().size()});
+      break;
+    default:
+      stop("column '" + name + "' cannot be cached, only numeric, integer, logical and character columns can");
+    }
+  }
+  tch::write_table(path, std::uint64_t(n), kv, cols);
+}
+
+// [[Rcpp::export]]
+List cpp_cache_read(std::string path) {
+  tch::MappedTable t(path);
+  std::uint64_t n = t.nrows();
+  const auto& columns = t.columns();
+  List out(columns.size());
+  CharacterVector names(columns.size());
+  for (std::size_t j = 0; j < columns.size(); ++j) {
+    const tch::MappedTable::Column& c = columns[j];
+    names[j] = c.name;
+    std::uint64_t width = c.type == tch::ColumnType::Double ? sizeof(double) : sizeof(int);
+    if (c.type != tch::ColumnType::String && c.bytes != n * width)
+      stop("corrupt cache file '" + path + "'");
+    // one copy from the mapped pages into the R vector
+    switch (c.type) {
+    case tch::ColumnType::Double: {
+      NumericVector v(n);
+      std::memcpy(v.begin(), c.data, c.bytes);
+      out[j] = v;
+      break;
+    }
+    case tch::ColumnType::Int32: {
+      IntegerVector v(n);
+      std::memcpy(v.begin(), c.data, c.bytes);
+      out[j] = v;
+      break;
+    }
+    case tch::ColumnType::Logical: {
+      LogicalVector v(n);
+      std::memcpy(v.begin(), c.data, c.bytes);
+      out[j] = v;
+      break;
+    }
+    case tch::ColumnType::String: {
+      CharacterVector v(n);
+      bool ok = tch::decode_strings(c, n, [&v](std::uint64_t i, const char* s, std::int32_t len) {
+        SET_STRING_ELT(v, R_xlen_t(i), len < 0 ? NA_STRING : Rf_mkCharLenCE(s, len, CE_UTF8));
+      });
+      if (!ok) stop("corrupt cache file '" + path + "'");
+      out[j] = v;
+      break;
+    }
+    default: stop("corrupt cache file '" + path + "'");
+    }
+  }
+  out.attr("names") = names;
+  CharacterVector meta(t.meta().size()), keys(t.meta().size());
+  for (std::size_t k = 0; k < t.meta().size(); ++k) {
+    keys[k] = t.meta()[k].first;
+    meta[k] = t.meta()[k].second;
+  }
+  meta.attr("names") = keys;
+  out.attr("meta") = meta;
+  return out;
+}
+
+namespace {
+
+// the columns of a data.frame/data.table as point file columns (no copies)
+std::vector<tch::PointColumnInput> point_columns(List data, R_xlen_t& n) {
+  CharacterVector names = data.names();
+  n = data.size() ? Rf_xlength(VECTOR_ELT(data, 0)) : 0;
+  std::vector<tch::PointColumnInput> cols;
+  for (R_xlen_t j = 0; j < data.size(); ++j) {
+    SEXP col = data[j];
+    std::string name(names[j]);
+    if (Rf_xlength(col) != n) stop("column '" + name + "' has the wrong length");
+    // the file has no place for levels, and the codes alone would read
+    // back as a different column
+    if (Rf_isFactor(col))
+      stop("column '" + name + "' is a factor and cannot be stored; convert it with as.integer() "
+           "and keep its levels apart");
+    switch (TYPEOF(col)) {
+    case REALSXP: cols.push_back({name, REAL(col), nullptr, false, 0, 0}); break;
+    case INTSXP: cols.push_back({name, nullptr, INTEGER(col), false, 0, 0}); break;
+    case LGLSXP: cols.push_back({name, nullptr, LOGICAL(col), true, 0, 0}); break;
+    default: stop("column '" + name + "' cannot be stored, only numeric, integer and logical columns can");
+    }
+  }
+  return cols;
+}
+
+// decode the planned rows of the columns cols of f into R vectors
+List read_point_columns(const tch::PointFile& f, const std::vector<std::size_t>& cols,
+                        const tch::PointFile::ReadPlan& plan, tch::ThreadPool& pool) {
+  List out(cols.size());
+  CharacterVector names(cols.size());
+  R_xlen_t n = R_xlen_t(plan.n);
+  for (std::size_t j = 0; j < cols.size(); ++j) {
+    const tch::PointColumnSpec& s = f.columns()[cols[j]];
+    names[j] = s.name;
+    if (s.kind == tch::PointColumnKind::Logical) {
+      LogicalVector v(n);
+      f.read(plan, cols[j], v.begin(), pool);
+      out[j] = v;
+    } else if (s.kind == tch::PointColumnKind::Int32) {
+      IntegerVector v(n);
+      f.read(plan, cols[j], v.begin(), pool);
+      out[j] = v;
+    } else {
+      NumericVector v(n);
+      f.read(plan, cols[j], v.begin(), pool);
+      out[j] = v;
+    }
+  }
+  out.attr("names") = names;
+  return out;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+void cpp_write_points(List data, std::string path, double chunk_size, int threads) {
+  R_xlen_t n;
+  std::vector<tch::PointColumnInput> cols = point_columns(data, n);
+  tch::ThreadPool pool(threads);
+  tch::write_point_file(path, cols, std::size_t(n), chunk_size, pool);
+}
+
+// [[Rcpp::export]]
+void cpp_las_to_points(std::string file, std::string path, double chunk_size, int threads) {
+  tch::LasReader reader(file);
+  tch::ThreadPool pool(threads);
+  tch::LasColumns c = reader.read(tch::ColumnSelection::parse("*"), nullptr, &pool);
+  tch::write_point_file(path, tch::las_point_columns(c, reader.header()), c.size(), chunk_size, pool);
+}
+
+// [[Rcpp::export]]
+List cpp_read_points(std::string path, Nullable<CharacterVector> select,
+                     Nullable<NumericVector> window, int threads) {
+  tch::PointFile f(path);
+  std::vector<std::size_t> cols;
+  if (select.isNotNull()) {
+    CharacterVector sel(select.get());
+    for (R_xlen_t j = 0; j < sel.size(); ++j) {
+      int c = f.column(std::string(sel[j]));
+      if (c < 0) stop("no column '" + std::string(sel[j]) + "' in '" + path + "'");
+      cols.push_back(std::size_t(c));
+    }
+  } else {
+    for (std::size_t c = 0; c < f.columns().size(); ++c) cols.push_back(c);
+  }
+  tch::ThreadPool pool(threads);
+  tch::PointFile::ReadPlan plan;
+  if (window.isNotNull()) {
+    NumericVector w(window.get());
+    if (w.size() != 4) stop("window must be c(xmin, ymin, xmax, ymax)");
+    if (f.column("X") < 0 || f.column("Y") < 0) stop("'" + path + "' has no X and Y columns");
+    tch::Window win{w[0], w[1], w[2], w[3]};
+    plan = f.plan(&win, pool);
+  } else {
+    plan = f.plan(nullptr, pool);
+  }
+  // columns are decoded straight into the R vectors
+  return read_point_columns(f, cols, plan, pool);
+}
+
+// Octree LOD file of a point cloud (all columns) at path, see octree.h.
+// [[Rcpp::export]]
+List cpp_octree_build(List data, std::string path, int leaf_size, int grid, int threads) {
+  R_xlen_t n;
+  std::vector<tch::PointColumnInput> cols = point_columns(data, n);
+  NumericVector x = numeric_column(data, "X"), y = numeric_column(data, "Y"), z = numeric_column(data, "Z");
+  tch::OctreeParams p;
+  p.grid = grid;
+  p.leaf_size = std::size_t(leaf_size);
+  tch::ThreadPool pool(threads);
+  tch::Octree t = tch::build_octree(x.begin(), y.begin(), z.begin(), std::size_t(n), p, pool);
+  tch::write_octree(path, cols, std::size_t(n), t, pool);
+  int depth = 0;
+  for (const tch::OctreeNode& nd : t.nodes) depth = std::max(depth, nd.level + 1);
+  return List::create(Named("nodes") = int(t.nodes.size()), Named("points") = double(t.order.size()),
+                      Named("levels") = depth);
+}
+
+// [[Rcpp::export]]
+List cpp_octree_las(std::string file, std::string path, int leaf_size, int grid, int threads) {
+  tch::LasReader reader(file);
+  tch::ThreadPool pool(threads);
+  tch::LasColumns c = reader.read(tch::ColumnSelection::parse("*"), nullptr, &pool);
+  tch::OctreeParams p;
+  p.grid = grid;
+  p.leaf_size = std::size_t(leaf_size);
+  tch::Octree t = tch::build_octree(c.x.data(), c.y.data(), c.z.data(), c.size(), p, pool);
+  tch::write_octree(path, tch::las_point_columns(c, reader.header()), c.size(), t, pool);
+  int depth = 0;
+  for (const tch::OctreeNode& nd : t.nodes) depth = std::max(depth, nd.level + 1);
+  return List::create(Named("nodes") = int(t.nodes.size()), Named("points") = double(t.order.size()),
+                      Named("levels") = depth);
+}
+
+namespace {
+
+XPtr<tch::OctreeFile> octree_handle(SEXP h) {
+  XPtr<tch::OctreeFile> p(h);
+  if (!p.get()) stop("the octree has been closed");
+  return p;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+SEXP cpp_octree_open(std::string path) {
+  XPtr<tch::OctreeFile> p(new tch::OctreeFile(path), true);
+  p.attr("class") = "tch_octree";
+  return p;
+}
+
+// the root cube c(x0, y0, z0, size); drawn coordinates are relative to its corner
+// [[Rcpp::export]]
+NumericVector cpp_octree_root(SEXP octree) {
+  const tch::OctreeNode& r = octree_handle(octree)->nodes()[0];
+  return NumericVector::create(r.x0, r.y0, r.z0, r.size);
+}
+
+// 1-based ids of the nodes to draw for the column-major 4 x 4 projection *
+// model matrix mvp
+// [[Rcpp::export]]
+IntegerVector cpp_octree_select(SEXP octree, NumericVector mvp, double height, double budget,
+                                double min_pixels) {
+  if (mvp.size() != 16) stop("mvp must be a 4 x 4 matrix");
+  XPtr<tch::OctreeFile> t = octree_handle(octree);
+  std::vector<std::size_t> sel = tch::select_nodes(t->nodes(), mvp.begin(), height,
+                                                   std::uint64_t(budget), min_pixels, t->grid());
+  IntegerVector out(sel.size());
+  for (std::size_t j = 0; j < sel.size(); ++j) out[j] = int(sel[j]) + 1;
+  return out;
+}
+
+// X, Y, Z (relative to the root corner) of the nodes plus the palette
+// index 1..ncolors of column `color` over range (NA where it is NA;
+// range = numeric(0) takes the range of the root sample)
+// [[Rcpp::export]]
+List cpp_octree_read(SEXP octree, IntegerVector nodes, std::string color, NumericVector range,
+                     int ncolors, int threads) {
+  XPtr<tch::OctreeFile> t = octree_handle(octree);
+  const tch::PointFile& f = t->points();
+  std::vector<std::size_t> chunks;
+  for (int k : nodes) chunks.push_back(std::size_t(k - 1));
+  tch::PointFile::ReadPlan plan = f.plan_chunks(chunks);
+  tch::ThreadPool pool(threads);
+  std::vector<std::size_t> cols;
+  for (const char* name : {"X", "Y", "Z"}) cols.push_back(std::size_t(f.column(name)));
+  int cc = -1;
+  if (!color.empty()) {
+    cc = f.column(color);
+    if (cc < 0) stop("the octree has no column '" + color + "'");
+    cols.push_back(std::size_t(cc));
+  }
+  List xyz = read_point_columns(f, cols, plan, pool);
+  const tch::OctreeNode& root = t->nodes()[0];
+  NumericVector x = xyz["X"], y = xyz["Y"], z = xyz["Z"];
+  for (double& w : x) w -= root.x0;
+  for (double& w : y) w -= root.y0;
+  for (double& w : z) w -= root.z0;
+  if (cc < 0) return List::create(Named("X") = x, Named("Y") = y, Named("Z") = z);
+  if (range.size() == 0) {
+    // the range over the root sample, the same for every view
+    List sample = read_point_columns(f, {std::size_t(cc)}, f.plan_chunks({0}), pool);
+    NumericVector r = as<NumericVector>(sample[R_xlen_t(0)]);
+    double lo = R_PosInf, hi = R_NegInf;
+    for (double w : r)
+      if (!ISNAN(w)) {
+        lo = std::min(lo, w);
+        hi = std::max(hi, w);
+      }
+    range = NumericVector::create(lo, hi > lo ? hi : lo + 1);
+  }
+  if (range.size() != 2 || !(range[1] > range[0])) stop("range must be c(lo, hi) with lo < hi");
+  // decoded on its own, so not shifted when color is X, Y or Z
+  NumericVector v = as<NumericVector>(xyz[R_xlen_t(3)]);
+  IntegerVector idx(v.size());
+  double scale = ncolors / (range[1] - range[0]);
+  for (R_xlen_t i = 0; i < v.size(); ++i)
+    idx[i] = ISNAN(v[i]) ? NA_INTEGER
+                         : 1 + int(std::min(double(ncolors - 1), std::max(0.0, (v[i] - range[0]) * scale)));
+  return List::create(Named("X") = x, Named("Y") = y, Named("Z") = z, Named("color") = idx);
+}
+
+namespace {
+
+XPtr<tch::Mosaic> mosaic_handle(SEXP m) {
+  XPtr<tch::Mosaic> p(m);
+  if (!p.get()) stop("the mosaic has been written or released");
+  return p;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+NumericVector cpp_las_extent(std::string file) {
+  const tch::LasHeader& h = tch::LasReader(file).header();
+  return NumericVector::create(h.xmin, h.xmax, h.ymin, h.ymax);
+}
+
+// [[Rcpp::export]]
+SEXP cpp_mosaic_create(NumericVector extent, double res, std::string scratch) {
+  if (extent.size() != 4) stop("extent must be c(xmin, xmax, ymin, ymax)");
+  tch::GridSpec spec = tch::grid_spec_of_extent(extent[0], extent[1], extent[2], extent[3], res);
+  XPtr<tch::Mosaic> p(new tch::Mosaic(spec, scratch), true);
+  p.attr("class") = "tch_mosaic";
+  return p;
+}
+
+// [[Rcpp::export]]
+void cpp_mosaic_add_points(SEXP mosaic, List data, int threads) {
+  XPtr<tch::Mosaic> m = mosaic_handle(mosaic);
+  NumericVector x = numeric_column(data, "X");
+  NumericVector y = numeric_column(data, "Y");
+  NumericVector z = numeric_column(data, "Z");
+  tch::ThreadPool pool(threads);
+  m->add_points(x.begin(), y.begin(), z.begin(), x.size(), pool);
+}
+
+// values row-major from the northern edge, as raster::getValues() returns them
+// [[Rcpp::export]]
+void cpp_mosaic_add_grid(SEXP mosaic, NumericVector values, double xmin, double ymax, double res,
+                         int nrow, int ncol, int threads) {
+  XPtr<tch::Mosaic> m = mosaic_handle(mosaic);
+  if (values.size() != R_xlen_t(nrow) * ncol) stop("values do not match nrow x ncol");
+  tch::GridSpec spec;
+  spec.res = res;
+  spec.xmin = xmin;
+  spec.ymin = ymax - nrow * spec.res;
+  spec.ncol = ncol;
+  spec.nrow = nrow;
+  tch::Grid<float> g(spec, 0);
+  for (R_xlen_t i = 0; i < values.size(); ++i) g.values[std::size_t(i)] = float(values[i]);
+  tch::ThreadPool pool(threads);
+  m->merge_max(g, pool);
+}
+
+// the pit-free mosaic, in a new scratch file
+// [[Rcpp::export]]
+SEXP cpp_mosaic_pit_free(SEXP mosaic, std::string scratch, double dz, int passes, int min_valid,
+                         int threads) {
+  XPtr<tch::Mosaic> m = mosaic_handle(mosaic);
+  tch::PitFreeParams p;
+  p.dz = float(dz);
+  p.passes = passes;
+  p.min_valid = min_valid;
+  tch::ThreadPool pool(threads);
+  XPtr<tch::Mosaic> out(tch::pit_free(*m, scratch, p, pool).release(), true);
+  out.attr("class") = "tch_mosaic";
+  return out;
+}
+
+// [[Rcpp::export]]
+List cpp_mosaic_aggregate(SEXP mosaic, int fact, std::string func, double prob, int threads) {
+  XPtr<tch::Mosaic> m = mosaic_handle(mosaic);
+  tch::ThreadPool pool(threads);
+  return wrap_grid(tch::aggregate(*m, fact, tch::parse_reducer(func), prob, pool));
+}
+
+namespace {
+
+tch::GeoTiffOptions geotiff_options(const std::string& compression, int level, int epsg,
+                                    bool geographic) {
+  tch::GeoTiffOptions o;
+  o.compression = tch::parse_compression(compression);
+  o.level = level;
+  o.epsg = epsg;
+  o.geographic = geographic;
+  return o;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+void cpp_mosaic_write(SEXP mosaic, std::string path, std::string compression, int level, int epsg,
+                      bool geographic, int threads) {
+  XPtr<tch::Mosaic> m = mosaic_handle(mosaic);
+  tch::ThreadPool pool(threads);
+  tch::write_cog(*m, path, pool, geotiff_options(compression, level, epsg, geographic));
+  m.release(); // frees the scratch file
+}
+
+// values row-major from the northern edge, as raster::getValues() returns them
+// [[Rcpp::export]]
+void cpp_write_geotiff(NumericVector values, int nrow, int ncol, double xmin, double ymin, double res,
+                       std::string path, std::string compression, int level, int epsg,
+                       bool geographic, int threads) {
+  if (values.size() != R_xlen_t(nrow) * ncol) stop("values do not match nrow x ncol");
+  tch::GridSpec spec;
+  spec.xmin = xmin;
+  spec.ymin = ymin;
+  spec.res = res;
+  spec.ncol = ncol;
+  spec.nrow = nrow;
+  tch::Grid<float> g(spec, 0);
+  for (R_xlen_t i = 0; i < values.size(); ++i) g.values[std::size_t(i)] = float(values[i]);
+  tch::ThreadPool pool(threads);
+  tch::write_geotiff(g, path, pool, geotiff_options(compression, level, epsg, geographic));
+}
+
+namespace {
+
+XPtr<tch::TileArena> arena_handle(SEXP a) {
+  XPtr<tch::TileArena> p(a);
+  if (!p.get()) stop("invalid tile arena, create it with tile.arena()");
+  return p;
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+double cpp_las_npoints(std::string file) {
+  return double(tch::LasReader(file).header().npoints);
+}
+
+// point buffers reused by every tile run through it, sized for npoints
+// [[Rcpp::export]]
+SEXP cpp_tile_arena(double npoints) {
+  XPtr<tch::TileArena> p(new tch::TileArena(), true);
+  if (npoints > 0) p->reserve(std::size_t(npoints));
+  p.attr("class") = "tch_arena";
+  return p;
+}
+
+// [[Rcpp::export]]
+List cpp_tile_chm(SEXP arena, std::string file, double res, double class_threshold,
+                  double cloth_resolution, int rigidness, int iterations, double time_step,
+                  double tile, double buffer, bool last_returns, int k, double th1, double th2,
+                  double building_threshold, int idw_k, double idw_p, double idw_rmax, double chunk,
+                  double chunk_buffer, int threads) {
+  XPtr<tch::TileArena> a = arena_handle(arena);
+  tch::TileParams p;
+  p.csf.class_threshold = class_threshold;
+  p.csf.cloth_resolution = cloth_resolution;
+  p.csf.rigidness = rigidness;
+  p.csf.iterations = iterations;
+  p.csf.time_step = time_step;
+  p.csf.tile = tile;
+  p.csf.buffer = buffer;
+  p.last_returns = last_returns;
+  p.k = k;
+  p.th1 = th1;
+  p.th2 = th2;
+  p.building_threshold = building_threshold;
+  p.idw.k = idw_k;
+  p.idw.p = idw_p;
+  p.idw.rmax = idw_rmax;
+  p.res = res;
+  p.chunk = chunk;
+  p.chunk_buffer = chunk_buffer;
+  tch::ThreadPool pool(threads);
+  const tch::Grid<float>& chm = a->process(file, p, pool);
+  NumericVector seconds(tch::TileArena::kStages);
+  CharacterVector stages(tch::TileArena::kStages);
+  for (int s = 0; s < tch::TileArena::kStages; ++s) {
+    seconds[s] = a->seconds(s);
+    stages[s] = tch::TileArena::stage_name(s);
+  }
+  seconds.names() = stages;
+  return List::create(Named("chm") = wrap_grid(chm), Named("seconds") = seconds,
+                      Named("points") = double(a->columns().size()),
+                      Named("tiles") = double(a->tiles()), Named("grows") = double(a->grows()),
+                      Named("bytes") = double(a->capacity_bytes()));
+}
+
+// counters and per-stage calls and seconds since the last reset
+// [[Rcpp::export]]
+List cpp_metrics() {
+  NumericVector counters(tch::kCounters);
+  CharacterVector cnames(tch::kCounters);
+  for (int c = 0; c < tch::kCounters; ++c) {
+    counters[c] = double(tch::counter_value(tch::Counter(c)));
+    cnames[c] = tch::counter_name(tch::Counter(c));
+  }
+  counters.names() = cnames;
+  CharacterVector stage(tch::kTimedStages);
+  NumericVector calls(tch::kTimedStages), seconds(tch::kTimedStages);
+  for (int s = 0; s < tch::kTimedStages; ++s) {
+    stage[s] = tch::stage_label(tch::TimedStage(s));
+    calls[s] = double(tch::stage_calls(tch::TimedStage(s)));
+    seconds[s] = tch::stage_seconds(tch::TimedStage(s));
+  }
+  return List::create(Named("counters") = counters,
+                      Named("stages") = DataFrame::create(Named("stage") = stage, Named("calls") = calls,
+                                                          Named("seconds") = seconds,
+                                                          Named("stringsAsFactors") = false));
+}
+
+// [[Rcpp::export]]
+void cpp_metrics_reset() {
+  tch::reset_metrics();
+}
+
+// [[Rcpp::export]]
+void cpp_metrics_tracing(bool on) {
+  tch::set_tracing(on);
+}
+
+// [[Rcpp::export]]
+std::string cpp_metrics_prometheus(std::string labels) {
+  return tch::metrics_prometheus(labels);
+}
+
+// [[Rcpp::export]]
+std::string cpp_metrics_trace(std::string name) {
+  return tch::metrics_chrome_trace(name);
+}
+
+// current and peak resident set size in bytes (NA where not known)
+// [[Rcpp::export]]
+NumericVector cpp_bench_memory() {
+  double rss = double(tch::current_rss_bytes()), peak = double(tch::peak_rss_bytes());
+  return NumericVector::create(Named("rss") = rss > 0 ? rss : NA_REAL,
+                               Named("peak_rss") = peak > 0 ? peak : NA_REAL);
+}
+
+// [[Rcpp::export]]
+bool cpp_bench_reset_peak() {
+  return tch::reset_peak_rss();
+}
+
+// [[Rcpp::export]]
+List cpp_bench_synthetic_tile(double npoints, double size, double seed) {
+  if (!(npoints >= 1) || !(size >= 50)) stop("a synthetic tile needs points and a size of 50 m or more");
+  tch::SyntheticTile t = tch::synthetic_tile(std::size_t(npoints), size, std::uint64_t(seed));
+  return List::create(Named("X") = NumericVector(t.x.begin(), t.x.end()),
+                      Named("Y") = NumericVector(t.y.begin(), t.y.end()),
+                      Named("Z") = NumericVector(t.z.begin(), t.z.end()),
+                      Named("ReturnNumber") = IntegerVector(t.return_number.begin(), t.return_number.end()),
+                      Named("NumberOfReturns") = IntegerVector(t.number_of_returns.begin(), t.number_of_returns.end()),
+                      Named("Classification") = IntegerVector(int(t.size()), 1));
+}
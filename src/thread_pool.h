@@ -0,0 +1,194 @@
+// Work-stealing thread pool for the native pipeline stages.
+//
+// Every worker owns a task deque. Tasks submitted from a worker go to its
+// own deque and are popped LIFO (cache-warm); idle workers steal FIFO from
+// the other deques. No R API may be called from a task.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tch {
+
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  // threads = 0 uses all hardware threads
+  explicit ThreadPool(unsigned threads = 0) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i) queues_.emplace_back(new Queue);
+    for (unsigned i = 0; i < threads; ++i) workers_.emplace_back([this, i] { run(i); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& w : workers_) w.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  unsigned size() const { return unsigned(workers_.size()); }
+
+  // index of the calling thread among the workers, -1 for other threads
+  int worker() const { return current_worker(); }
+
+  void submit(Task task) {
+    int self = current_worker();
+    std::size_t q = self >= 0 ? std::size_t(self) : next_++ % queues_.size();
+    {
+      std::lock_guard<std::mutex> lk(queues_[q]->m);
+      queues_[q]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      ++queued_;
+      ++pending_;
+    }
+    wake_.notify_one();
+  }
+
+  // block until every submitted task has finished; rethrows the first
+  // exception a task raised. Must not be called from inside a task.
+  void wait() {
+    std::unique_lock<std::mutex> lk(m_);
+    done_.wait(lk, [this] { return pending_ == 0; });
+    if (error_) {
+      std::exception_ptr e = error_;
+      error_ = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  struct WorkerId {
+    const ThreadPool* pool = nullptr;
+    int index = -1;
+  };
+  static WorkerId& worker_id() {
+    static thread_local WorkerId id;
+    return id;
+  }
+  int current_worker() const {
+    const WorkerId& id = worker_id();
+    return id.pool == this ? id.index : -1;
+  }
+
+  bool pop(std::size_t self, Task& out) {
+    {
+      Queue& q = *queues_[self];
+      std::lock_guard<std::mutex> lk(q.m);
+      if (!q.tasks.empty()) {
+        out = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+      }
+    }
+    for (std::size_t k = 1; k < queues_.size(); ++k) {
+      Queue& q = *queues_[(self + k) % queues_.size()];
+      std::lock_guard<std::mutex> lk(q.m);
+      if (!q.tasks.empty()) {
+        out = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(unsigned self) {
+    worker_id().pool = this;
+    worker_id().index = int(self);
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lk(m_);
+        wake_.wait(lk, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) return;
+        --queued_;
+      }
+      Task task;
+      // a task is queued somewhere, keep stealing until we get one
+      while (!pop(self, task)) std::this_thread::yield();
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (!error_) error_ = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lk(m_);
+      if (--pending_ == 0) done_.notify_all();
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex m_;
+  std::condition_variable wake_, done_;
+  std::size_t queued_ = 0, pending_ = 0;
+  std::atomic<std::size_t> next_{0};
+  bool stop_ = false;
+  std::exception_ptr error_;
+};
+
+// One T per worker of a pool plus one for the thread that submits, e.g.
+// scratch buffers a stage keeps across chunks and tiles: T's own storage
+// is reused instead of being allocated for every task.
+template <class T>
+class PerWorker {
+public:
+  PerWorker() = default;
+  explicit PerWorker(const ThreadPool& pool) { resize(pool); }
+
+  void resize(const ThreadPool& pool) {
+    if (slots_.size() < std::size_t(pool.size()) + 1) slots_.resize(std::size_t(pool.size()) + 1);
+  }
+  // the calling thread's T; resize() must have been called for pool
+  T& local(const ThreadPool& pool) {
+    int w = pool.worker();
+    return slots_[w < 0 ? slots_.size() - 1 : std::size_t(w)];
+  }
+  std::vector<T>& all() { return slots_; }
+  const std::vector<T>& all() const { return slots_; }
+
+private:
+  std::vector<T> slots_;
+};
+
+// run fn(begin, end) over [0, n) in blocks of at least grain items
+template <class Fn>
+void parallel_for(ThreadPool& pool, std::size_t n, std::size_t grain, Fn fn) {
+  if (n == 0) return;
+  std::size_t blocks = std::max<std::size_t>(1, std::min<std::size_t>(
+      pool.size() * 4, (n + grain - 1) / std::max<std::size_t>(grain, 1)));
+  std::size_t step = (n + blocks - 1) / blocks;
+  if (blocks == 1) {
+    fn(std::size_t(0), n);
+    return;
+  }
+  for (std::size_t b = 0; b < n; b += step) {
+    std::size_t e = std::min(n, b + step);
+    pool.submit([=, &fn] { fn(b, e); });
+  }
+  pool.wait();
+}
+
+} // namespace tch
@@ -0,0 +1,275 @@
+// Point stages of the Eberswalde pipeline for tiles processed back to back,
+// on buffers that live as long as the arena.
+//
+// In R every stage of section 2 returns a new LAS or adds a column
+// (classify_ground, segment_shapes, add_attribute, normalize_height), so
+// the point table is copied or grown at every step of every tile. A
+// TileArena reads a tile into its own columns and runs ground
+// classification (CSF on the last returns), planes (shp_plane on the
+// non-ground points), buildings (share of planar neighbours), the DTM
+// normalization, the masking of buildings and planes and the max CHM on
+// them, writing every attribute in place. All buffers, the point and cell
+// sized ones and the scratch of the stages (trees, neighbour lists, cloth
+// pieces, chunk plans), are vectors that are only ever resized: they grow
+// to the largest tile and keep their capacity, so once the largest tile
+// has been seen (or reserve() was called) the next tiles do not allocate
+// them again. grows() counts the tiles that needed more capacity.
+//
+// The stages that index the points, planes, buildings and the DTM, run
+// chunk by chunk (chunks.h): the k-NN trees and neighbour lists are built
+// over one chunk and its buffer and only the core points keep their
+// labels, and the DTM cells of a chunk are interpolated from the ground
+// points within rmax of them. One chunk at a time, so their scratch is
+// bounded by the chunk, not the tile, and every chunk uses all threads.
+// CSF runs on its own cloth pieces. Still sized by the tile are the point
+// columns and labels (about 40 bytes a point), the rasterization keys and
+// the rasters. As equally distant neighbours are ordered by point index
+// (knn.h), the DTM is the one of the whole tile, and so are the labels
+// unless a point's k nearest neighbours reach beyond the chunk buffer.
+//
+// X and Y stay quantized as in the file (quantized.h) and so does the Z
+// the k-NN trees index; only Z, which is normalized in place, is also
+// kept as doubles. The stages read the same doubles as from a double
+// read, so the CHM is the same.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chunks.h"
+#include "csf.h"
+#include "grid.h"
+#include "knn.h"
+#include "las_reader.h"
+#include "mask.h"
+#include "neighbourhood.h"
+#include "normalize.h"
+#include "planes.h"
+#include "rasterize.h"
+#include "thread_pool.h"
+
+namespace tch {
+
+struct TileParams {
+  CsfParams csf;
+  bool last_returns = true;         // drop the cloth on the last returns only
+  int k = 10;                       // neighbours of shp_plane and the building share
+  double th1 = 25, th2 = 6;         // shp_plane thresholds
+  double building_threshold = 0.2;  // share of planar neighbours of a building point
+  IdwParams idw;
+  double res = 1;                   // DTM and CHM cell size
+  double chunk = 100;               // chunk size of the k-NN and DTM stages, 0 for the whole tile
+  double chunk_buffer = 10;         // overlap of the chunks for the k-NN stages
+};
+
+class TileArena {
+public:
+  enum Stage { Read, Csf, Planes, Buildings, Normalize, Rasterize, kStages };
+  static const char* stage_name(int s) {
+    static const char* names[kStages] = {"read", "csf", "shp_plane", "point_metrics", "normalize",
+                                         "rasterize"};
+    return names[s];
+  }
+
+  // capacity for tiles of up to npoints points, so even the first tile
+  // does not grow the point columns
+  void reserve(std::size_t npoints) {
+    cols_.z.reserve(npoints);
+    for (std::vector<std::int32_t>* v :
+         {&cols_.qx, &cols_.qy, &cols_.qz, &cols_.return_number, &cols_.number_of_returns,
+          &cols_.classification, &use_, &ground_, &planar_, &building_})
+      v->reserve(npoints);
+    rows_.reserve(npoints);
+    ground_idx_.reserve(npoints);
+  }
+
+  // Run the point stages on the LAS/LAZ file at path; the CHM (and the
+  // columns) stay valid until the next tile.
+  const Grid<float>& process(const std::string& path, const TileParams& p, ThreadPool& pool) {
+    using clock = std::chrono::steady_clock;
+    clock::time_point t = clock::now();
+    auto lap = [&](Stage s) {
+      clock::time_point now = clock::now();
+      seconds_[s] = std::chrono::duration<double>(now - t).count();
+      t = now;
+    };
+    std::size_t before = capacity_bytes();
+
+    LasReader reader(path);
+    reader.read_into(ColumnSelection::parse("xyzrncq"), &pool, cols_, &las_);
+    const std::size_t n = cols_.size();
+    const LasHeader& h = reader.header();
+    const QuantizedAxis x = h.axis(cols_.qx, 0), y = h.axis(cols_.qy, 1), qz = h.axis(cols_.qz, 2);
+    cols_.z.resize(n);
+    double* z = cols_.z.data();
+    for (std::size_t i = 0; i < n; ++i) z[i] = qz[i];
+    std::int32_t* cls = cols_.classification.data();
+    lap(Read);
+
+    use_.resize(n);
+    for (std::size_t i = 0; i < n; ++i)
+      use_[i] = !p.last_returns || cols_.return_number[i] == cols_.number_of_returns[i];
+    ground_.resize(n);
+    csf_ground_into(x, y, z, n, use_.data(), p.csf, pool, ground_.data(), csf_);
+    // as lidR: new ground is class 2, former ground unclassified
+    for (std::size_t i = 0; i < n; ++i) cls[i] = ground_[i] ? 2 : (cls[i] == 2 ? 1 : cls[i]);
+    lap(Csf);
+
+    if (p.chunk > 0)
+      plan_chunks_into(plan_, x, y, n, p.chunk, p.chunk_buffer, fill_);
+    else
+      plan_single_chunk_into(plan_, x, y, n);
+    const QuantizedAxis coords[3] = {x, y, qz};
+    // the non-ground points of the chunk and its buffer are the tree, its
+    // core ones (the first) the queries
+    planar_.assign(n, 0);
+    for (const Chunk& ch : plan_.chunks) {
+      const std::uint32_t* idx = plan_.indices(ch);
+      rows_.clear();
+      std::size_t ncore = 0;
+      for (std::size_t j = 0; j < ch.size(); ++j)
+        if (cls[idx[j]] != 2) {
+          rows_.push_back(idx[j]);
+          ncore += j < ch.ncore;
+        }
+      if (ncore == 0) continue;
+      tree_.rebuild(coords, n, rows_.data(), rows_.size(), kd_);
+      knn_adjacency_into(tree_, coords, n, p.k, pool, nb_, knn_, rows_.data(), ncore);
+      segment_planes(x, y, qz, nb_, p.th1, p.th2, planar_.data(), pool);
+    }
+    lap(Planes);
+
+    // the planar flags of the buffer points are those of their own chunk
+    building_.assign(n, kNaFlag);
+    for (const Chunk& ch : plan_.chunks) {
+      if (ch.ncore == 0) continue;
+      tree_.rebuild(coords, n, plan_.indices(ch), ch.size(), kd_);
+      knn_adjacency_into(tree_, coords, n, p.k, pool, nb_, knn_, plan_.indices(ch), ch.ncore);
+      neighbour_fraction(nb_, planar_.data(), p.building_threshold, nullptr, building_.data(), pool);
+    }
+    lap(Buildings);
+
+    ground_idx_.clear();
+    for (std::size_t i = 0; i < n; ++i)
+      if (!std::isnan(z[i]) && (cls[i] == 2 || cls[i] == 9)) ground_idx_.push_back(std::uint32_t(i));
+    if (ground_idx_.empty()) throw std::runtime_error("no ground points in '" + path + "'");
+    GridSpec spec = grid_spec_covering(x, y, n, p.res);
+    chunked_dtm(spec, p.idw, x, y, z, n, pool);
+    // the DTM is complete, so Z can be normalized in place
+    subtract_dtm(dtm_, x, y, z, n, pool);
+    MaskRule building, planar;
+    building.int32 = building_.data();
+    building.value = 1;
+    planar.int32 = planar_.data();
+    planar.value = 1;
+    rules_.assign({building, planar});
+    mask_heights(z, n, rules_, 0, pool);
+    lap(Normalize);
+
+    rasterize_into(chm_, x, y, z, n, spec, Reducer::Max, 0.95, &pool, 256, raster_);
+    lap(Rasterize);
+
+    ++tiles_;
+    if (capacity_bytes() > before) ++grows_;
+    return chm_;
+  }
+
+  const Grid<float>& chm() const { return chm_; }
+  // X, Y quantized, Z normalized and masked in z
+  const LasColumns& columns() const { return cols_; }
+  const std::vector<std::int32_t>& planar() const { return planar_; }
+  const std::vector<std::int32_t>& building() const { return building_; }
+  double seconds(int stage) const { return seconds_[stage]; }
+  std::size_t tiles() const { return tiles_; }
+  std::size_t grows() const { return grows_; }
+
+  // bytes held by all buffers of the arena
+  std::size_t capacity_bytes() const {
+    std::size_t b = bytes(cols_.x) + bytes(cols_.y) + bytes(cols_.z) + bytes(cols_.qx) +
+                    bytes(cols_.qy) + bytes(cols_.qz) + bytes(cols_.gpstime) +
+                    bytes(cols_.intensity) + bytes(cols_.return_number) +
+                    bytes(cols_.number_of_returns) + bytes(cols_.classification);
+    b += bytes(use_) + bytes(ground_) + bytes(planar_) + bytes(building_) + bytes(rows_) +
+         bytes(ground_idx_) + bytes(rules_) + plan_bytes(plan_) + bytes(fill_) + bytes(col_start_) +
+         bytes(row_start_);
+    b += tree_.bytes() + idw_.tree().bytes() + bytes(kd_.order) + bytes(kd_.ids) + bytes(kd_.pts) +
+         bytes(kd_.qpts);
+    b += bytes(nb_.rows) + bytes(nb_.offset) + bytes(nb_.idx) + bytes(nb_.dist);
+    b += bytes(knn_.found) + bytes(knn_.visit) + bytes(knn_.row_of);
+    for (const std::vector<double>& d2 : knn_.d2.all()) b += bytes(d2);
+    b += bytes(csf_.sub) + bytes(csf_.sx) + bytes(csf_.sy) + bytes(csf_.sh) + plan_bytes(csf_.plan) +
+         bytes(csf_.fill) + bytes(csf_.steps);
+    for (const detail::Cloth& c : csf_.cloths.all())
+      b += bytes(c.h) + bytes(c.old) + bytes(c.mov) + bytes(c.ground) + bytes(c.best) +
+           bytes(c.filled) + bytes(c.queue);
+    b += bytes(dtm_.values) + bytes(chm_.values) + bytes(raster_.sum) + bytes(raster_.cnt) +
+         bytes(raster_.key) + bytes(raster_.fill) + plan_bytes(raster_.plan);
+    for (const LasChunkScratch& s : las_.all()) b += bytes(s.bytes);
+    return b;
+  }
+
+private:
+  // The DTM over spec chunk by chunk: the cells whose centres fall into a
+  // chunk from the ground points within rmax of them, the neighbours of
+  // the whole tile's IDW
+  void chunked_dtm(const GridSpec& spec, const IdwParams& idw, QuantizedAxis x, QuantizedAxis y,
+                  const double* z, std::size_t n, ThreadPool& pool) {
+    dtm_.spec = spec;
+    dtm_.values.assign(spec.size(), std::numeric_limits<double>::quiet_NaN());
+    // first DTM column/row of every chunk column/row, and one past the last
+    const GridSpec& l = plan_.layout;
+    auto starts = [](std::vector<int>& v, int nchunk, int ncell, auto chunk_of) {
+      v.assign(std::size_t(nchunk) + 1, ncell);
+      for (int c = ncell - 1; c >= 0; --c) v[chunk_of(c)] = c;
+      for (int k = nchunk - 1; k >= 0; --k) v[k] = std::min(v[k], v[k + 1]);
+    };
+    starts(col_start_, l.ncol, spec.ncol, [&](int c) { return l.col_of(spec.xmin + (c + 0.5) * spec.res); });
+    starts(row_start_, l.nrow, spec.nrow, [&](int r) { return l.row_of(spec.ymax() - (r + 0.5) * spec.res); });
+    for (int cr = 0; cr < l.nrow; ++cr)
+      for (int cc = 0; cc < l.ncol; ++cc) {
+        int r0 = row_start_[cr], r1 = row_start_[cr + 1], c0 = col_start_[cc], c1 = col_start_[cc + 1];
+        if (r0 >= r1 || c0 >= c1) continue;
+        double x0 = spec.xmin + c0 * spec.res - idw.rmax, x1 = spec.xmin + c1 * spec.res + idw.rmax;
+        double y1 = spec.ymax() - r0 * spec.res + idw.rmax, y0 = spec.ymax() - r1 * spec.res - idw.rmax;
+        rows_.clear();
+        for (std::uint32_t i : ground_idx_)
+          if (x[i] >= x0 && x[i] <= x1 && y[i] >= y0 && y[i] <= y1) rows_.push_back(i);
+        if (rows_.empty()) continue; // no ground within rmax: NaN, as for the whole tile
+        idw_.rebuild(x, y, z, rows_.data(), rows_.size(), n, idw, kd_);
+        idw_dtm_window(dtm_, idw_, r0, r1, c0, c1, pool);
+      }
+  }
+
+  template <class T>
+  static std::size_t bytes(const std::vector<T>& v) { return v.capacity() * sizeof(T); }
+  static std::size_t plan_bytes(const ChunkPlan& p) { return bytes(p.chunks) + bytes(p.members); }
+
+  LasColumns cols_;
+  std::vector<std::int32_t> use_, ground_, planar_, building_;
+  std::vector<std::uint32_t> rows_, ground_idx_;
+  ChunkPlan plan_;
+  std::vector<std::size_t> fill_;
+  std::vector<int> col_start_, row_start_;
+  std::vector<MaskRule> rules_;
+  KdTree<3, std::int32_t> tree_;
+  KdScratch kd_;
+  Neighbours nb_;
+  KnnScratch knn_;
+  CsfScratch csf_;
+  GroundIdw idw_;
+  Grid<double> dtm_;
+  Grid<float> chm_;
+  RasterScratch raster_;
+  PerWorker<LasChunkScratch> las_;
+  double seconds_[kStages] = {};
+  std::size_t tiles_ = 0, grows_ = 0;
+};
+
+} // namespace tch